@@ -0,0 +1,131 @@
+#include "bvh.h"
+
+#include <stdlib.h>
+
+static inline double centroid_axis(struct aabb *box, int axis)
+{
+    if (axis == 0) {
+        return box->min.x + box->max.x;
+    } else if (axis == 1) {
+        return box->min.y + box->max.y;
+    }
+    return box->min.z + box->max.z;
+}
+
+// Partially orders indices[lo, hi) so the entry at nth has its centroid
+// in sorted position along the axis (Hoare's quickselect).
+static void select_nth(u32 *indices, struct aabb *bounds, int axis,
+                       u32 lo, u32 hi, u32 nth)
+{
+    while (hi - lo > 1) {
+        double pivot = centroid_axis(&bounds[indices[lo + (hi - lo) / 2]], axis);
+        u32 i = lo;
+        u32 j = hi - 1;
+
+        while (i <= j) {
+            while (centroid_axis(&bounds[indices[i]], axis) < pivot) {
+                i++;
+            }
+            while (centroid_axis(&bounds[indices[j]], axis) > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                u32 temp = indices[i];
+                indices[i] = indices[j];
+                indices[j] = temp;
+                i++;
+                if (j == 0) {
+                    break;
+                }
+                j--;
+            }
+        }
+
+        if (nth <= j) {
+            hi = j + 1;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            return;
+        }
+    }
+}
+
+static void build_node(struct bvh *bvh, struct aabb *bounds, u32 node_index,
+                       u32 first, u32 count)
+{
+    struct bvh_node *node = &bvh->nodes[node_index];
+    struct aabb centroids = aabb_empty();
+
+    node->bounds = aabb_empty();
+    for (u32 i = first; i < first + count; i++) {
+        struct aabb *box = &bounds[bvh->indices[i]];
+        struct aabb centroid = {
+            {centroid_axis(box, 0), centroid_axis(box, 1), centroid_axis(box, 2)},
+            {centroid_axis(box, 0), centroid_axis(box, 1), centroid_axis(box, 2)}
+        };
+        aabb_grow(&node->bounds, *box);
+        aabb_grow(&centroids, centroid);
+    }
+
+    if (count <= BVH_LEAF_SIZE) {
+        node->first = first;
+        node->count = count;
+        return;
+    }
+
+    // Median split along the widest centroid axis keeps the tree balanced,
+    // which bounds the traversal stack depth.
+    v3 extent;
+    v3_sub(&extent, centroids.max, centroids.min);
+    int axis = 0;
+    if (extent.y > extent.x && extent.y >= extent.z) {
+        axis = 1;
+    } else if (extent.z > extent.x && extent.z > extent.y) {
+        axis = 2;
+    }
+
+    u32 half = count / 2;
+    select_nth(bvh->indices, bounds, axis, first, first + count, first + half);
+
+    u32 left = bvh->num_nodes;
+    bvh->num_nodes += 2;
+    node->first = left;
+    node->count = 0;
+
+    build_node(bvh, bounds, left, first, half);
+    build_node(bvh, bounds, left + 1, first + half, count - half);
+}
+
+/*
+ * Builds a hierarchy over `count` boxes. The boxes themselves are not kept,
+ * leaves refer back to them through the indices array.
+ */
+void bvh_build(struct bvh *bvh, struct aabb *bounds, u32 count)
+{
+    bvh->num_nodes = 0;
+    bvh->nodes = NULL;
+    bvh->indices = NULL;
+
+    if (count == 0) {
+        return;
+    }
+
+    bvh->nodes = malloc(sizeof(struct bvh_node) * (2 * count));
+    bvh->indices = malloc(sizeof(u32) * count);
+    for (u32 i = 0; i < count; i++) {
+        bvh->indices[i] = i;
+    }
+
+    bvh->num_nodes = 1;
+    build_node(bvh, bounds, 0, 0, count);
+}
+
+void bvh_free(struct bvh *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->indices);
+    bvh->nodes = NULL;
+    bvh->indices = NULL;
+    bvh->num_nodes = 0;
+}
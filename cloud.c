@@ -0,0 +1,764 @@
+#include "cloud.h"
+#include "intersect.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// One cluster in memory, with its particles in world space and the
+// hierarchy over them
+struct cloud_page {
+    struct sphere *particles;
+    u32 count;
+    struct bvh bvh;
+    u32 cloud;
+    u32 cluster;
+    u64 bytes;
+    // Threads using the page, it's only evicted at zero
+    u32 pins;
+    bool loading;
+    // Least recently used order of the unpinned pages
+    struct cloud_page *prev, *next;
+};
+
+// A cloud file attached to the cache
+struct cloud_file {
+    int fd;
+    // Resident page of every cluster, NULL while it's on disk
+    struct cloud_page **pages;
+    u32 num_clusters;
+};
+
+struct cloud_cache {
+    pthread_mutex_t lock;
+    // Broadcast when a page finishes loading or is unpinned
+    pthread_cond_t changed;
+    u32 references;
+    struct cloud_file *files;
+    u32 num_files;
+    // Unpinned pages, least recently used first
+    struct cloud_page *lru_head, *lru_tail;
+    u64 resident_bytes;
+    struct cloud_cache_stats stats;
+};
+
+/* ---- Cache ---- */
+
+struct cloud_cache *cloud_cache_create(u64 budget)
+{
+    struct cloud_cache *cache = calloc(1, sizeof(struct cloud_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->changed, NULL);
+    cache->references = 1;
+    cache->stats.budget = budget;
+    return cache;
+}
+
+void cloud_cache_retain(struct cloud_cache *cache)
+{
+    __atomic_add_fetch(&cache->references, 1, __ATOMIC_RELAXED);
+}
+
+static void free_page(struct cloud_page *page)
+{
+    free(page->particles);
+    bvh_free(&page->bvh);
+    free(page);
+}
+
+void cloud_cache_release(struct cloud_cache *cache)
+{
+    if (!cache || __atomic_sub_fetch(&cache->references, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    for (u32 i = 0; i < cache->num_files; i++) {
+        struct cloud_file *file = &cache->files[i];
+        for (u32 cluster = 0; cluster < file->num_clusters; cluster++) {
+            if (file->pages[cluster]) {
+                free_page(file->pages[cluster]);
+            }
+        }
+        free(file->pages);
+        close(file->fd);
+    }
+    free(cache->files);
+    pthread_cond_destroy(&cache->changed);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// Memory a page holds, counted against the budget. Until the cluster is
+// read this is an upper bound, a hierarchy has at most 2 * count nodes.
+static u64 page_bytes(u32 count, u32 num_nodes)
+{
+    return sizeof(struct cloud_page) + sizeof(struct sphere) * count +
+           sizeof(struct bvh_node) * num_nodes;
+}
+
+static void lru_remove(struct cloud_cache *cache, struct cloud_page *page)
+{
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        cache->lru_head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    } else {
+        cache->lru_tail = page->prev;
+    }
+    page->prev = page->next = NULL;
+}
+
+static void lru_append(struct cloud_cache *cache, struct cloud_page *page)
+{
+    page->prev = cache->lru_tail;
+    page->next = NULL;
+    if (cache->lru_tail) {
+        cache->lru_tail->next = page;
+    } else {
+        cache->lru_head = page;
+    }
+    cache->lru_tail = page;
+}
+
+// Drops the least recently used page, called with the lock held
+static void evict_page(struct cloud_cache *cache)
+{
+    struct cloud_page *page = cache->lru_head;
+    lru_remove(cache, page);
+    cache->files[page->cloud].pages[page->cluster] = NULL;
+    cache->resident_bytes -= page->bytes;
+    cache->stats.evictions++;
+    free_page(page);
+}
+
+void cloud_cache_set_budget(struct cloud_cache *cache, u64 budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.budget = budget;
+    while (cache->resident_bytes > budget && cache->lru_head) {
+        evict_page(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cloud_cache_stats(struct cloud_cache *cache, struct cloud_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Adds an open cloud file to the cache, which closes it when it's freed,
+// and returns its index
+static u32 attach_file(struct cloud_cache *cache, int fd, u32 num_clusters)
+{
+    pthread_mutex_lock(&cache->lock);
+    u32 id = cache->num_files++;
+    cache->files = realloc(cache->files, sizeof(struct cloud_file) * cache->num_files);
+    cache->files[id].fd = fd;
+    cache->files[id].pages = calloc(num_clusters + 1, sizeof(struct cloud_page *));
+    cache->files[id].num_clusters = num_clusters;
+    pthread_mutex_unlock(&cache->lock);
+    return id;
+}
+
+// pread() until size bytes arrived, false on errors and early ends
+static bool read_fully(int fd, void *buffer, size_t size, u64 offset)
+{
+    u8 *bytes = buffer;
+    while (size) {
+        ssize_t got = pread(fd, bytes, size, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+        offset += got;
+    }
+    return true;
+}
+
+// Stable radix sort of keys by their high 32 bits, 8 bits per pass and only
+// as many passes as values up to max need. Returns whichever of keys and
+// scratch ends up holding the result.
+static u64 *sort_high_bits(u64 *keys, u64 *scratch, u32 count, u32 max)
+{
+    for (u32 shift = 32; shift < 64 && max >> (shift - 32); shift += 8) {
+        u32 offsets[257] = {0};
+        for (u32 n = 0; n < count; n++) {
+            offsets[((keys[n] >> shift) & 0xff) + 1]++;
+        }
+        for (u32 digit = 0; digit < 256; digit++) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (u32 n = 0; n < count; n++) {
+            scratch[offsets[(keys[n] >> shift) & 0xff]++] = keys[n];
+        }
+        u64 *temp = keys;
+        keys = scratch;
+        scratch = temp;
+    }
+    return keys;
+}
+
+// Spreads the low 10 bits of value out to every third bit
+static inline u32 spread_bits(u32 value)
+{
+    value &= 0x3ff;
+    value = (value | value << 16) & 0x030000ff;
+    value = (value | value << 8) & 0x0300f00f;
+    value = (value | value << 4) & 0x030c30c3;
+    value = (value | value << 2) & 0x09249249;
+    return value;
+}
+
+// 30 bit Morton code of a point inside box
+static u32 morton_code(v3 point, struct aabb box)
+{
+    double x = box.max.x > box.min.x ? (point.x - box.min.x) / (box.max.x - box.min.x) : 0;
+    double y = box.max.y > box.min.y ? (point.y - box.min.y) / (box.max.y - box.min.y) : 0;
+    double z = box.max.z > box.min.z ? (point.z - box.min.z) / (box.max.z - box.min.z) : 0;
+    return spread_bits(fmin(fmax(x, 0), 1) * 1023) |
+           spread_bits(fmin(fmax(y, 0), 1) * 1023) << 1 |
+           spread_bits(fmin(fmax(z, 0), 1) * 1023) << 2;
+}
+
+// A page's particles are sorted by their Morton codes, and every node is
+// split where the highest bit its codes differ in changes, which halves
+// the node's space along one axis. That only takes a binary search per
+// node instead of the selection bvh_build() does at every level, which
+// dominated page-ins. Leaves index the particles directly, there is no
+// indices array.
+static void build_cluster_node(struct bvh *bvh, struct sphere *particles, u64 *keys,
+                               u32 node_index, u32 first, u32 count)
+{
+    struct bvh_node *node = &bvh->nodes[node_index];
+
+    if (count <= BVH_LEAF_SIZE) {
+        node->bounds = aabb_empty();
+        for (u32 i = first; i < first + count; i++) {
+            aabb_grow(&node->bounds, sphere_bounds(&particles[i]));
+        }
+        node->first = first;
+        node->count = count;
+        return;
+    }
+
+    // Particles with identical codes are just cut in half
+    u32 split = first + count / 2;
+    u32 lowest = keys[first] >> 32;
+    u32 highest = keys[first + count - 1] >> 32;
+    if (lowest != highest) {
+        u32 bit = 1u << (31 - __builtin_clz(lowest ^ highest));
+        u32 lo = first;
+        u32 hi = first + count - 1;
+        while (hi - lo > 1) {
+            u32 mid = lo + (hi - lo) / 2;
+            if ((keys[mid] >> 32) & bit) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        split = hi;
+    }
+
+    u32 left = bvh->num_nodes;
+    bvh->num_nodes += 2;
+    build_cluster_node(bvh, particles, keys, left, first, split - first);
+    build_cluster_node(bvh, particles, keys, left + 1, split, first + count - split);
+    node->bounds = bvh->nodes[left].bounds;
+    aabb_grow(&node->bounds, bvh->nodes[left + 1].bounds);
+    node->first = left;
+    node->count = 0;
+}
+
+// Reads a cluster into its page and builds the hierarchy over it. A
+// cluster that can't be read is left empty.
+static void read_page(struct cloud *cloud, int fd, struct cloud_page *page)
+{
+    struct cloud_cluster *cluster = &cloud->clusters[page->cluster];
+    u32 count = cluster->count;
+    float *raw = malloc(sizeof(float) * 4 * (count + 1));
+    u64 span = trace_begin();
+
+    if (!read_fully(fd, raw, sizeof(float) * 4 * count, cluster->offset)) {
+        fprintf(stderr, "Error: failed to read cluster %u of %s!\n", page->cluster, cloud->path);
+        count = 0;
+    }
+
+    struct aabb box = cloud->cluster_bounds[page->cluster];
+    u64 *keys = malloc(sizeof(u64) * 2 * (count + 1));
+    for (u32 i = 0; i < count; i++) {
+        v3 center = {raw[4 * i] + cloud->translation.x, raw[4 * i + 1] + cloud->translation.y,
+                     raw[4 * i + 2] + cloud->translation.z};
+        keys[i] = (u64)morton_code(center, box) << 32 | i;
+    }
+    u64 *sorted = sort_high_bits(keys, keys + count, count, (1u << 30) - 1);
+
+    page->particles = malloc(sizeof(struct sphere) * (count + 1));
+    page->count = count;
+    for (u32 i = 0; i < count; i++) {
+        struct sphere *particle = &page->particles[i];
+        const float *values = &raw[4 * (u32)sorted[i]];
+        particle->pos.x = values[0] + cloud->translation.x;
+        particle->pos.y = values[1] + cloud->translation.y;
+        particle->pos.z = values[2] + cloud->translation.z;
+        particle->rad = values[3];
+        particle->material = cloud->material;
+    }
+    free(raw);
+
+    page->bvh.nodes = malloc(sizeof(struct bvh_node) * (2 * count + 1));
+    page->bvh.indices = NULL;
+    page->bvh.num_nodes = count ? 1 : 0;
+    if (count) {
+        build_cluster_node(&page->bvh, page->particles, sorted, 0, 0, count);
+        page->bvh.nodes = realloc(page->bvh.nodes,
+                                  sizeof(struct bvh_node) * page->bvh.num_nodes);
+    }
+    page->bytes = page_bytes(count, page->bvh.num_nodes);
+    free(keys);
+    trace_end_arg("page in cluster", "cluster", page->cluster, span);
+}
+
+// Makes the cluster resident and keeps it so until the page is unpinned.
+// Only the thread that misses reads the cluster, others asking for it
+// meanwhile wait for the read. Pages are evicted until the new one fits
+// the budget; when every resident page is pinned that means waiting for
+// another thread to unpin one, unless nothing is resident at all.
+static struct cloud_page *pin_page(struct cloud_cache *cache, struct cloud *cloud, u32 cluster)
+{
+    u32 count = cloud->clusters[cluster].count;
+    u64 bytes = page_bytes(count, 2 * count);
+    struct cloud_file *file;
+    struct cloud_page *page;
+
+    pthread_mutex_lock(&cache->lock);
+    for (;;) {
+        file = &cache->files[cloud->id];
+        page = file->pages[cluster];
+        if (page) {
+            if (!page->pins++) {
+                lru_remove(cache, page);
+            }
+            cache->stats.page_hits++;
+            while (page->loading) {
+                pthread_cond_wait(&cache->changed, &cache->lock);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return page;
+        } else if (!cache->resident_bytes ||
+                   cache->resident_bytes + bytes <= cache->stats.budget) {
+            break;
+        } else if (cache->lru_head) {
+            evict_page(cache);
+        } else {
+            pthread_cond_wait(&cache->changed, &cache->lock);
+        }
+    }
+
+    page = calloc(1, sizeof(struct cloud_page));
+    page->cloud = cloud->id;
+    page->cluster = cluster;
+    page->bytes = bytes;
+    page->pins = 1;
+    page->loading = true;
+    file->pages[cluster] = page;
+    cache->resident_bytes += bytes;
+    pthread_mutex_unlock(&cache->lock);
+
+    read_page(cloud, file->fd, page);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->resident_bytes -= bytes - page->bytes;
+    if (cache->resident_bytes > cache->stats.peak_bytes) {
+        cache->stats.peak_bytes = cache->resident_bytes;
+    }
+    page->loading = false;
+    cache->stats.page_ins++;
+    cache->stats.bytes_read += sizeof(float) * 4 * page->count;
+    pthread_cond_broadcast(&cache->changed);
+    pthread_mutex_unlock(&cache->lock);
+    return page;
+}
+
+static void unpin_page(struct cloud_cache *cache, struct cloud_page *page)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (!--page->pins) {
+        lru_append(cache, page);
+        pthread_cond_broadcast(&cache->changed);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* ---- Files ---- */
+
+int load_cloud(struct cloud *cloud, struct cloud_cache *cache)
+{
+    struct cloud_header header;
+    struct stat info;
+    int fd = open(cloud->path, O_RDONLY);
+    if (fd < 0) {
+        return CLOUD_CANT_OPEN;
+    } else if (fstat(fd, &info) < 0) {
+        close(fd);
+        return CLOUD_CANT_OPEN;
+    } else if (!read_fully(fd, &header, sizeof(header), 0) || header.magic != CLOUD_MAGIC ||
+               header.version != CLOUD_VERSION) {
+        close(fd);
+        return CLOUD_BAD_HEADER;
+    }
+
+    u64 table_size = sizeof(struct cloud_cluster) * (u64)header.num_clusters;
+    if ((u64)info.st_size < sizeof(header) + table_size) {
+        close(fd);
+        return CLOUD_TRUNCATED;
+    }
+    cloud->clusters = malloc(table_size + 1);
+    if (!read_fully(fd, cloud->clusters, table_size, sizeof(header))) {
+        free(cloud->clusters);
+        cloud->clusters = NULL;
+        close(fd);
+        return CLOUD_TRUNCATED;
+    }
+
+    // Only the table is checked here, particles are read as rays need them
+    for (u32 i = 0; i < header.num_clusters; i++) {
+        struct cloud_cluster *cluster = &cloud->clusters[i];
+        if (cluster->count > CLOUD_CLUSTER_SIZE ||
+            cluster->offset + sizeof(float) * 4 * (u64)cluster->count > (u64)info.st_size) {
+            free(cloud->clusters);
+            cloud->clusters = NULL;
+            close(fd);
+            return cluster->count > CLOUD_CLUSTER_SIZE ? CLOUD_BAD_HEADER : CLOUD_TRUNCATED;
+        }
+    }
+
+    u64 span = trace_begin();
+    cloud->num_clusters = header.num_clusters;
+    cloud->num_particles = header.num_particles;
+    cloud->file_size = info.st_size;
+    cloud->file_mtime = (s64)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    cloud->cluster_bounds = malloc(sizeof(struct aabb) * (cloud->num_clusters + 1));
+    cloud->bounds = aabb_empty();
+    for (u32 i = 0; i < cloud->num_clusters; i++) {
+        struct cloud_cluster *cluster = &cloud->clusters[i];
+        struct aabb box = {
+            {cluster->min[0], cluster->min[1], cluster->min[2]},
+            {cluster->max[0], cluster->max[1], cluster->max[2]}
+        };
+        cloud->cluster_bounds[i] = aabb_translate(box, cloud->translation);
+        aabb_grow(&cloud->bounds, cloud->cluster_bounds[i]);
+    }
+    bvh_build(&cloud->bvh, cloud->cluster_bounds, cloud->num_clusters);
+    cloud->id = attach_file(cache, fd, cloud->num_clusters);
+    trace_end_arg("build cloud hierarchy", "clusters", cloud->num_clusters, span);
+    return CLOUD_SUCCESS;
+}
+
+void unload_cloud(struct cloud *cloud)
+{
+    free(cloud->clusters);
+    free(cloud->cluster_bounds);
+    bvh_free(&cloud->bvh);
+    cloud->clusters = NULL;
+    cloud->cluster_bounds = NULL;
+    cloud->num_clusters = 0;
+    cloud->num_particles = 0;
+}
+
+static void *copy_memory(const void *memory, size_t size)
+{
+    void *result = malloc(size ? size : 1);
+    memcpy(result, memory, size);
+    return result;
+}
+
+void copy_cloud(struct cloud *dest, struct cloud *src)
+{
+    *dest = *src;
+    dest->clusters = copy_memory(src->clusters, sizeof(struct cloud_cluster) * src->num_clusters);
+    dest->cluster_bounds = copy_memory(src->cluster_bounds,
+                                       sizeof(struct aabb) * src->num_clusters);
+    dest->bvh.nodes = copy_memory(src->bvh.nodes, sizeof(struct bvh_node) * src->bvh.num_nodes);
+    dest->bvh.indices = copy_memory(src->bvh.indices, sizeof(u32) * src->num_clusters);
+}
+
+/* ---- Tracing ---- */
+
+// Distance at which the ray enters the box, INFINITY when it misses the
+// box or only reaches it after tmax
+static inline double aabb_ray_entry(struct aabb *box, v3 ro, v3 inv_rd, double tmax)
+{
+    double tx0 = (box->min.x - ro.x) * inv_rd.x;
+    double tx1 = (box->max.x - ro.x) * inv_rd.x;
+    double tmin = fmin(tx0, tx1);
+    double tfar = fmax(tx0, tx1);
+
+    double ty0 = (box->min.y - ro.y) * inv_rd.y;
+    double ty1 = (box->max.y - ro.y) * inv_rd.y;
+    tmin = fmax(tmin, fmin(ty0, ty1));
+    tfar = fmin(tfar, fmax(ty0, ty1));
+
+    double tz0 = (box->min.z - ro.z) * inv_rd.z;
+    double tz1 = (box->max.z - ro.z) * inv_rd.z;
+    tmin = fmax(tmin, fmin(tz0, tz1));
+    tfar = fmin(tfar, fmax(tz0, tz1));
+
+    tmin = fmax(tmin, 0);
+    return tfar >= tmin && tmin < tmax ? tmin : INFINITY;
+}
+
+// Nearest particle of a resident cluster hit before nearest, like
+// group_intersect() in raycast.c
+static double page_intersect(struct cloud_page *page, v3 ro, v3 rd, v3 inv_rd, double nearest,
+                             bool any_hit, struct sphere *hit)
+{
+    u32 stack[BVH_MAX_DEPTH];
+    u32 top = 0;
+
+    if (!page->bvh.num_nodes) {
+        return nearest;
+    }
+    stack[top++] = 0;
+
+    while (top) {
+        struct bvh_node *node = &page->bvh.nodes[stack[--top]];
+        if (!aabb_ray_hit(&node->bounds, ro, inv_rd, nearest)) {
+            continue;
+        }
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                struct sphere *particle = &page->particles[i];
+                double t = sphere_intersection_check(particle, ro, rd);
+                if (t > 0 && t < nearest) {
+                    nearest = t;
+                    *hit = *particle;
+                    if (any_hit) {
+                        return nearest;
+                    }
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return nearest;
+}
+
+// Clusters are visited front to back, so that the nearest hit is usually
+// found in the first cluster paged in and cuts off the ones behind it
+static double cloud_intersect(struct cloud_cache *cache, struct cloud *cloud, v3 ro, v3 rd,
+                              v3 inv_rd, double nearest, bool any_hit, struct sphere *hit)
+{
+    struct bvh *bvh = &cloud->bvh;
+    u32 stack[BVH_MAX_DEPTH];
+    double entries[BVH_MAX_DEPTH];
+    u32 top = 0;
+
+    if (!bvh->num_nodes || aabb_ray_entry(&bvh->nodes[0].bounds, ro, inv_rd, nearest) == INFINITY) {
+        return nearest;
+    }
+    stack[top] = 0;
+    entries[top++] = 0;
+
+    while (top) {
+        top--;
+        if (entries[top] >= nearest) {
+            continue;
+        }
+        struct bvh_node *node = &bvh->nodes[stack[top]];
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                u32 cluster = bvh->indices[i];
+                if (!aabb_ray_hit(&cloud->cluster_bounds[cluster], ro, inv_rd, nearest)) {
+                    continue;
+                }
+                struct cloud_page *page = pin_page(cache, cloud, cluster);
+                double t = page_intersect(page, ro, rd, inv_rd, nearest, any_hit, hit);
+                unpin_page(cache, page);
+                if (t < nearest) {
+                    nearest = t;
+                    if (any_hit) {
+                        return nearest;
+                    }
+                }
+            }
+        } else {
+            // The nearer child goes on top of the stack
+            u32 near = node->first;
+            u32 far = node->first + 1;
+            double near_entry = aabb_ray_entry(&bvh->nodes[near].bounds, ro, inv_rd, nearest);
+            double far_entry = aabb_ray_entry(&bvh->nodes[far].bounds, ro, inv_rd, nearest);
+            if (far_entry < near_entry) {
+                u32 temp = near;
+                near = far;
+                far = temp;
+                double temp_entry = near_entry;
+                near_entry = far_entry;
+                far_entry = temp_entry;
+            }
+            if (far_entry < nearest) {
+                stack[top] = far;
+                entries[top++] = far_entry;
+            }
+            if (near_entry < nearest) {
+                stack[top] = near;
+                entries[top++] = near_entry;
+            }
+        }
+    }
+    return nearest;
+}
+
+double clouds_intersect(struct scene *scene, v3 ro, v3 rd, double nearest, bool any_hit,
+                        struct sphere *hit)
+{
+    v3 inv_rd = {1 / rd.x, 1 / rd.y, 1 / rd.z};
+
+    for (u32 i = 0; i < scene->num_clouds; i++) {
+        double t = cloud_intersect(scene->cloud_cache, &scene->clouds[i], ro, rd, inv_rd,
+                                   nearest, any_hit, hit);
+        if (t < nearest) {
+            nearest = t;
+            if (any_hit) {
+                return nearest;
+            }
+        }
+    }
+    return nearest;
+}
+
+/* ---- Batches ---- */
+
+static void push_visit(struct cloud_batch *batch, u32 cluster, u32 ray)
+{
+    if (batch->num_visits == batch->capacity) {
+        batch->capacity = batch->capacity ? 2 * batch->capacity : 4096;
+        batch->visits = realloc(batch->visits, sizeof(u64) * batch->capacity);
+        batch->sorted = realloc(batch->sorted, sizeof(u64) * batch->capacity);
+    }
+    batch->visits[batch->num_visits++] = (u64)cluster << 32 | ray;
+}
+
+// Every cluster of the cloud the ray enters before its nearest hit
+static void collect_visits(struct cloud_batch *batch, struct cloud *cloud,
+                           struct cloud_ray *ray, u32 index)
+{
+    struct bvh *bvh = &cloud->bvh;
+    v3 inv_rd = {1 / ray->rd.x, 1 / ray->rd.y, 1 / ray->rd.z};
+    u32 stack[BVH_MAX_DEPTH];
+    u32 top = 0;
+
+    if (!bvh->num_nodes) {
+        return;
+    }
+    stack[top++] = 0;
+
+    while (top) {
+        struct bvh_node *node = &bvh->nodes[stack[--top]];
+        if (!aabb_ray_hit(&node->bounds, ray->ro, inv_rd, ray->nearest)) {
+            continue;
+        }
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                u32 cluster = bvh->indices[i];
+                if (aabb_ray_hit(&cloud->cluster_bounds[cluster], ray->ro, inv_rd,
+                                 ray->nearest)) {
+                    push_visit(batch, cluster, index);
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+}
+
+// Sorts the visits by cluster. Visits are collected ray by ray and the
+// sort is stable, so each cluster's rays stay in order.
+static void sort_visits(struct cloud_batch *batch, u32 num_clusters)
+{
+    u64 *sorted = sort_high_bits(batch->visits, batch->sorted, batch->num_visits,
+                                 num_clusters - 1);
+    if (sorted != batch->visits) {
+        batch->sorted = batch->visits;
+        batch->visits = sorted;
+    }
+}
+
+// Whether the ray still needs the cluster now that earlier clusters may
+// have found hits
+static bool wants_cluster(struct cloud *cloud, u32 cluster, struct cloud_ray *ray,
+                          bool any_hit)
+{
+    v3 inv_rd = {1 / ray->rd.x, 1 / ray->rd.y, 1 / ray->rd.z};
+    return !(any_hit && ray->found) &&
+           aabb_ray_hit(&cloud->cluster_bounds[cluster], ray->ro, inv_rd, ray->nearest);
+}
+
+void trace_cloud_batch(struct scene *scene, struct cloud_batch *batch, struct cloud_ray *rays,
+                       u32 count, bool any_hit)
+{
+    for (u32 c = 0; c < scene->num_clouds; c++) {
+        struct cloud *cloud = &scene->clouds[c];
+
+        batch->num_visits = 0;
+        for (u32 n = 0; n < count; n++) {
+            if (!(any_hit && rays[n].found)) {
+                collect_visits(batch, cloud, &rays[n], n);
+            }
+        }
+        sort_visits(batch, cloud->num_clusters);
+
+        // One pin per cluster for all of its rays, skipped when none of
+        // them still needs it
+        for (u32 first = 0, last; first < batch->num_visits; first = last) {
+            u32 cluster = batch->visits[first] >> 32;
+            struct cloud_page *page = NULL;
+            for (last = first; last < batch->num_visits &&
+                 batch->visits[last] >> 32 == cluster; last++) {
+                struct cloud_ray *ray = &rays[(u32)batch->visits[last]];
+                if (!wants_cluster(cloud, cluster, ray, any_hit)) {
+                    continue;
+                }
+                if (!page) {
+                    page = pin_page(scene->cloud_cache, cloud, cluster);
+                }
+                v3 inv_rd = {1 / ray->rd.x, 1 / ray->rd.y, 1 / ray->rd.z};
+                double t = page_intersect(page, ray->ro, ray->rd, inv_rd, ray->nearest, any_hit,
+                                          &ray->hit);
+                if (t < ray->nearest) {
+                    ray->nearest = t;
+                    ray->found = true;
+                }
+            }
+            if (page) {
+                unpin_page(scene->cloud_cache, page);
+            }
+        }
+    }
+}
+
+void free_cloud_batch(struct cloud_batch *batch)
+{
+    free(batch->visits);
+    free(batch->sorted);
+    memset(batch, 0, sizeof(struct cloud_batch));
+}
@@ -1,4 +1,6 @@
 #include "csv_parser.h"
+#include "hash.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,26 +9,31 @@
 static void get_line_offset(struct file_contents *csv)
 {
     char *memory = (char *)csv->memory;
-    while (true) {
+    while (csv->offset < csv->size) {
         if (memory[csv->offset++] == '\n') {
             break;
         }
     }
 }
 
-// Gets the next line dictated by a newline character.
+// Gets the next line dictated by a newline character into str, which
+// holds MAX_LINE_LEN bytes. Overlong lines are cut short, the same way
+// scene_stream_feed() cuts them.
 static void get_line(struct file_contents *csv, char *str)
 {
     char *memory = csv->memory;
     u32 start = csv->offset;
     get_line_offset(csv);
-    u32 end = csv->offset;
+    u32 length = csv->offset - start;
+    if (length > MAX_LINE_LEN - 1) {
+        length = MAX_LINE_LEN - 1;
+    }
 
-    memcpy(str, &memory[start], (end - start));
-    str[end] = '\0';
+    memcpy(str, &memory[start], length);
+    str[length] = '\0';
 }
 
-// Gets the number of objects in the file (actually just counts newlines).
+// Gets the number of objects in the file (actually just counts lines).
 static u32 get_num_objs(char *memory, size_t size)
 {
     u32 n = 0;
@@ -35,31 +42,102 @@ static u32 get_num_objs(char *memory, size_t size)
             n++;
         }
     }
+    // The last line may be missing its newline
+    if (size && memory[size - 1] != '\n') {
+        n++;
+    }
     return n;
 }
 
 // Handy macro for comparing a string and literal string
 #define strlcmp(str, strlit) (strncmp(str, strlit, sizeof(strlit)) == 0)
 
+// Copies an identifier or path of at most size - 1 characters, stopping at
+// the end of the line
+static void copy_name(char *dest, char *src, int size)
+{
+    int i = 0;
+    while (i < size - 1 && src[i] && src[i] != '\n' && src[i] != '\r') {
+        dest[i] = src[i];
+        i++;
+    }
+    dest[i] = '\0';
+}
+
+/*
+ * Values are split off the front of the line. Each parser returns false,
+ * leaving its value alone, when the line ends before the value does.
+ */
+static bool parse_number(char **line, double *value)
+{
+    char *text = strsep(line, ",");
+    if (!text) {
+        return false;
+    }
+    *value = atof(text);
+    return true;
+}
+
+static bool parse_name(char **line, char *dest, int size)
+{
+    char *text = strsep(line, ",");
+    if (!text) {
+        return false;
+    }
+    copy_name(dest, text, size);
+    return true;
+}
+
+// Parses [x, y, z], the brackets are omitted from x and z
+static bool parse_vector(char **line, v3 *vector)
+{
+    char *xtemp = strsep(line, ",");
+    char *y = strsep(line, ",");
+    char *ztemp = strsep(line, ",");
+    if (!xtemp || !xtemp[0] || !y || !ztemp) {
+        return false;
+    }
+    char *z = strsep(&ztemp, "]");
+
+    vector->x = atof(&xtemp[1]);
+    vector->y = atof(y);
+    vector->z = atof(z);
+    return true;
+}
+
+static bool parse_color(char **line, color3f *color)
+{
+    v3 rgb;
+    if (!parse_vector(line, &rgb)) {
+        return false;
+    }
+    color->r = rgb.x;
+    color->g = rgb.y;
+    color->b = rgb.z;
+    return true;
+}
+
 static void init_camera_object(struct object *obj, char *line)
 {
-    float w, h;
+    float w = 0, h = 0;
     char *token = strsep(&line, ":");
 
-    if (strlcmp(token, "width")) {
+    // A missing value leaves its size at 0, which error_check_objects()
+    // reports
+    if (token && strlcmp(token, "width")) {
         char *width = strsep(&line, ",");
-        w = atof(width);
+        w = width ? atof(width) : 0;
 
         token = strsep(&line, ":");
         char *height = strsep(&line, ",");
-        h = atof(height);
-    } else if (strlcmp(token, "height")) {
+        h = height ? atof(height) : 0;
+    } else if (token && strlcmp(token, "height")) {
         char *height = strsep(&line, ",");
-        h = atof(height);
+        h = height ? atof(height) : 0;
 
         token = strsep(&line, ":");
         char *width = strsep(&line, ",");
-        w = atof(width);
+        w = width ? atof(width) : 0;
     }
 
     obj->type = OBJ_CAMERA;
@@ -69,64 +147,33 @@ static void init_camera_object(struct object *obj, char *line)
 
 static void init_light_object(struct object *obj, char *line)
 {
-    color3f color;
-    double theta;
+    color3f color = {0};
+    double theta = {0};
     double rad_a0 = {0};
     double rad_a1 = {0};
     double rad_a2 = {0};
     double ang_a0 = {0};
-    v3 direction;
-    v3 pos;
+    v3 direction = {0};
+    v3 pos = {0};
+    bool valid = true;
     char *token;
     while((token = strsep(&line, ":")) != NULL) {
         if (strlcmp(token, "color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            color.r = atof(r);
-            color.g = atof(g);
-            color.b = atof(b);
+            valid &= parse_color(&line, &color);
         } else if (strlcmp(token, "theta")) {
-            char *theta_str = strsep(&line, ",");
-            theta = atof(theta_str);
+            valid &= parse_number(&line, &theta);
         } else if (strlcmp(token, "radial-a0")) {
-            char *a0_str = strsep(&line, ",");
-            rad_a0 = atof(a0_str);
+            valid &= parse_number(&line, &rad_a0);
         } else if (strlcmp(token, "radial-a1")) {
-            char *a1_str = strsep(&line, ",");
-            rad_a1 = atof(a1_str);
+            valid &= parse_number(&line, &rad_a1);
         } else if (strlcmp(token, "radial-a2")) {
-            char *a2_str = strsep(&line, ",");
-            rad_a2 = atof(a2_str);
+            valid &= parse_number(&line, &rad_a2);
         } else if (strlcmp(token, "angular-a0")) {
-            char *a0_str = strsep(&line, ",");
-            ang_a0 = atof(a0_str);
+            valid &= parse_number(&line, &ang_a0);
         } else if (strlcmp(token, "position")) {
-            // the brackets are omitted from x and z
-            char *xtemp = strsep(&line, ",");
-            char *x = &xtemp[1];
-            char *y = strsep(&line, ",");
-            char *ztemp = strsep(&line, ",");
-            char *z = strsep(&ztemp, "]");
-
-            pos.x = atof(x);
-            pos.y = atof(y);
-            pos.z = atof(z);
+            valid &= parse_vector(&line, &pos);
         } else if (strlcmp(token, "direction")) {
-            // the brackets are omitted from x and z
-            char *xtemp = strsep(&line, ",");
-            char *x = &xtemp[1];
-            char *y = strsep(&line, ",");
-            char *ztemp = strsep(&line, ",");
-            char *z = strsep(&ztemp, "]");
-
-            direction.x = atof(x);
-            direction.y = atof(y);
-            direction.z = atof(z);
+            valid &= parse_vector(&line, &direction);
         }
     }
     obj->type = OBJ_LIGHT;
@@ -138,182 +185,168 @@ static void init_light_object(struct object *obj, char *line)
     obj->light.ang_a0 = ang_a0;
     obj->light.direction = direction;
     obj->light.pos = pos;
+    obj->malformed = !valid;
 }
 
 static void init_plane_object(struct object *obj, char *line)
 {
-    color3f color;
-    color3f diffuse;
-    color3f specular;
-    v3 pos, norm;
-    float reflectivity;
-    float refractivity;
-    float ior;
-
+    color3f color = {0};
+    color3f diffuse = {0};
+    color3f specular = {0};
+    v3 pos = {0};
+    v3 norm = {0};
+    double reflectivity = 0;
+    double refractivity = 0;
+    double ior = 0;
+
+    bool valid = true;
     char *token;
     while((token = strsep(&line, ":")) != NULL) {
         if (strlcmp(token, "color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            color.r = atof(r);
-            color.g = atof(g);
-            color.b = atof(b);
+            valid &= parse_color(&line, &color);
         } else if (strlcmp(token, "diffuse_color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            diffuse.r = atof(r);
-            diffuse.g = atof(g);
-            diffuse.b = atof(b);
+            valid &= parse_color(&line, &diffuse);
         } else if (strlcmp(token, "specular_color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            specular.r = atof(r);
-            specular.g = atof(g);
-            specular.b = atof(b);
+            valid &= parse_color(&line, &specular);
         } else if (strlcmp(token, "position")) {
-            // the brackets are omitted from x and z
-            char *xtemp = strsep(&line, ",");
-            char *x = &xtemp[1];
-            char *y = strsep(&line, ",");
-            char *ztemp = strsep(&line, ",");
-            char *z = strsep(&ztemp, "]");
-
-            pos.x = atof(x);
-            pos.y = atof(y);
-            pos.z = atof(z);
+            valid &= parse_vector(&line, &pos);
         } else if (strlcmp (token, "normal")) {
-            char *xtemp = strsep(&line, ",");
-            char *x = &xtemp[1];
-            char *y = strsep(&line, ",");
-            char *ztemp = strsep(&line, ",");
-            char *z = strsep(&ztemp, "]");
-
-            norm.x = atof(x);
-            norm.y = atof(y);
-            norm.z = atof(z);
+            valid &= parse_vector(&line, &norm);
         } else if (strlcmp (token, "reflectivity")) {
-            char *reflect = strsep(&line, ",");
-            reflectivity = atof(reflect);
+            valid &= parse_number(&line, &reflectivity);
         } else if (strlcmp (token, "refractivity")) {
-            char *refract = strsep(&line, ",");
-            refractivity = atof(refract);
+            valid &= parse_number(&line, &refractivity);
         } else if (strlcmp (token, "ior")) {
-            char *aior = strsep(&line, ",");
-            ior = atof(aior);
+            valid &= parse_number(&line, &ior);
         }
     }
     obj->type = OBJ_PLANE;
-    obj->plane.color = color;
-    obj->plane.diffuse = diffuse;
-    obj->plane.specular = specular;
+    obj->material.color = color;
+    obj->material.diffuse = diffuse;
+    obj->material.specular = specular;
+    obj->material.reflectivity = reflectivity;
+    obj->material.refractivity = refractivity;
+    obj->material.ior = ior;
     obj->plane.pos = pos;
     obj->plane.norm = norm;
-    obj->plane.reflectivity = reflectivity;
-    obj->plane.refractivity = refractivity;
-    obj->plane.ior = ior;
+    obj->malformed = !valid;
 }
 
 static void init_sphere_object(struct object *obj, char *line)
 {
-    color3f color;
-    color3f diffuse;
-    color3f specular;
-    float radius;
-    float reflectivity;
-    float refractivity;
-    float ior;
-    v3 pos;
+    color3f color = {0};
+    color3f diffuse = {0};
+    color3f specular = {0};
+    double radius = 0;
+    double reflectivity = 0;
+    double refractivity = 0;
+    double ior = 0;
+    v3 pos = {0};
+    bool valid = true;
     char *token;
 
     while((token = strsep(&line, ":")) != NULL) {
         if (strlcmp(token, "color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            color.r = atof(r);
-            color.g = atof(g);
-            color.b = atof(b);
+            valid &= parse_color(&line, &color);
         } else if (strlcmp(token, "diffuse_color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            diffuse.r = atof(r);
-            diffuse.g = atof(g);
-            diffuse.b = atof(b);
+            valid &= parse_color(&line, &diffuse);
         } else if (strlcmp(token, "specular_color")) {
-            // the brackets are omitted from r and b
-            char *rtemp = strsep(&line, ",");
-            char *r = &rtemp[1];
-            char *g = strsep(&line, ",");
-            char *btemp = strsep(&line, ",");
-            char *b = strsep(&btemp, "]");
-
-            specular.r = atof(r);
-            specular.g = atof(g);
-            specular.b = atof(b);
+            valid &= parse_color(&line, &specular);
         } else if (strlcmp(token, "position")) {
-            // the brackets are omitted from x and z
-            char *xtemp = strsep(&line, ",");
-            char *x = &xtemp[1];
-            char *y = strsep(&line, ",");
-            char *ztemp = strsep(&line, ",");
-            char *z = strsep(&ztemp, "]");
-
-            pos.x = atof(x);
-            pos.y = atof(y);
-            pos.z = atof(z);
+            valid &= parse_vector(&line, &pos);
         } else if (strlcmp (token, "radius")) {
-            char *arad = strsep(&line, ",");
-            radius = atof(arad);
+            valid &= parse_number(&line, &radius);
+        } else if (strlcmp (token, "group")) {
+            valid &= parse_name(&line, obj->group, MAX_NAME_LEN);
         } else if (strlcmp (token, "reflectivity")) {
-            char *reflect = strsep(&line, ",");
-            reflectivity = atof(reflect);
+            valid &= parse_number(&line, &reflectivity);
         } else if (strlcmp (token, "refractivity")) {
-            char *refract = strsep(&line, ",");
-            refractivity = atof(refract);
+            valid &= parse_number(&line, &refractivity);
         } else if (strlcmp (token, "ior")) {
-            char *aior = strsep(&line, ",");
-            ior = atof(aior);
+            valid &= parse_number(&line, &ior);
         }
     }
 
     obj->type = OBJ_SPHERE;
-    obj->sphere.color = color;
-    obj->sphere.diffuse = diffuse;
-    obj->sphere.specular = specular;
+    obj->material.color = color;
+    obj->material.diffuse = diffuse;
+    obj->material.specular = specular;
+    obj->material.reflectivity = reflectivity;
+    obj->material.refractivity = refractivity;
+    obj->material.ior = ior;
     obj->sphere.pos = pos;
     obj->sphere.rad = radius;
-    obj->sphere.reflectivity = reflectivity;
-    obj->sphere.refractivity = refractivity;
-    obj->sphere.ior = ior;
+    obj->malformed = !valid;
+}
+
+static void init_instance_object(struct object *obj, char *line)
+{
+    v3 translation = {0};
+    bool valid = true;
+    char *token;
+
+    while((token = strsep(&line, ":")) != NULL) {
+        if (strlcmp(token, "group")) {
+            valid &= parse_name(&line, obj->group, MAX_NAME_LEN);
+        } else if (strlcmp(token, "translation")) {
+            valid &= parse_vector(&line, &translation);
+        }
+    }
+
+    obj->type = OBJ_INSTANCE;
+    obj->instance.translation = translation;
+    obj->malformed = !valid;
+}
+
+static void init_mesh_object(struct object *obj, char *line)
+{
+    color3f color = {0};
+    color3f diffuse = {0};
+    color3f specular = {0};
+    v3 pos = {0};
+    bool valid = true;
+    char *token;
+
+    memset(&obj->mesh, 0, sizeof(struct mesh));
+    while((token = strsep(&line, ":")) != NULL) {
+        if (strlcmp(token, "path")) {
+            valid &= parse_name(&line, obj->mesh.path, MESH_MAX_PATH);
+        } else if (strlcmp(token, "color")) {
+            valid &= parse_color(&line, &color);
+        } else if (strlcmp(token, "diffuse_color")) {
+            valid &= parse_color(&line, &diffuse);
+        } else if (strlcmp(token, "specular_color")) {
+            valid &= parse_color(&line, &specular);
+        } else if (strlcmp(token, "position")) {
+            valid &= parse_vector(&line, &pos);
+        }
+    }
+
+    obj->type = OBJ_MESH;
+    memset(&obj->material, 0, sizeof(struct material));
+    obj->material.color = color;
+    obj->material.diffuse = diffuse;
+    obj->material.specular = specular;
+    obj->mesh.translation = pos;
+    obj->malformed = !valid;
+}
+
+// Clouds take the same properties as meshes
+static void init_cloud_object(struct object *obj, char *line)
+{
+    init_mesh_object(obj, line);
+    struct mesh mesh = obj->mesh;
+
+    memset(&obj->cloud, 0, sizeof(struct cloud));
+    memcpy(obj->cloud.path, mesh.path, MESH_MAX_PATH);
+    obj->cloud.translation = mesh.translation;
+    obj->type = OBJ_CLOUD;
 }
 
 static void parse_line(struct object *obj, char *line)
 {
     char *type = strsep(&line, ",");
+    memset(obj->group, 0, MAX_NAME_LEN);
     if (strlcmp(type, "camera")) {
         init_camera_object(obj, line);
     } else if (strlcmp(type, "plane")) {
@@ -322,9 +355,21 @@ static void parse_line(struct object *obj, char *line)
         init_sphere_object(obj, line);
     } else if (strlcmp(type, "light")) {
         init_light_object(obj, line);
+    } else if (strlcmp(type, "instance")) {
+        init_instance_object(obj, line);
+    } else if (strlcmp(type, "mesh")) {
+        init_mesh_object(obj, line);
+    } else if (strlcmp(type, "cloud")) {
+        init_cloud_object(obj, line);
     }
 }
 
+// Comments and blank lines don't describe an object
+static bool skip_line(char *line)
+{
+    return line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == '\0';
+}
+
 // Eats all whitespace from a given string (not including newlines)
 static void remove_all_spaces(char *src, char *dest)
 {
@@ -337,9 +382,10 @@ static void remove_all_spaces(char *src, char *dest)
     *dest = 0;
 }
 
-static struct object *get_csv_objects(struct file_contents *csvfc, u32 nobjs)
+// Parses nlines lines, leaving the number of objects in nobjs
+static struct object *get_csv_objects(struct file_contents *csvfc, u32 nlines, u32 *nobjs)
 {
-    struct object *objs = malloc(sizeof(struct object) * nobjs);
+    struct object *objs = malloc(sizeof(struct object) * (nlines + 1));
 
     if (!objs) {
         return NULL;
@@ -347,72 +393,249 @@ static struct object *get_csv_objects(struct file_contents *csvfc, u32 nobjs)
 
     // Iterate over the number of lines and parse each of them
     // Each line contains ONLY 1 object!
-    for (int i = 0; i < nobjs; i++) {
-        struct object *obj = &objs[i];
-        char temp[1024];
-        char line[1024];
+    *nobjs = 0;
+    for (int i = 0; i < nlines; i++) {
+        char temp[MAX_LINE_LEN];
+        char line[MAX_LINE_LEN];
 
         get_line(csvfc, temp);
         remove_all_spaces(temp, line);
-        if (line[0] != '#') {
+        if (!skip_line(line)) {
+            struct object *obj = &objs[(*nobjs)++];
+            memset(obj, 0, sizeof(struct object));
             parse_line(obj, line);
         }
     }
     return objs;
 }
 
-static inline void error_check_objects(struct object *objects, int num_objs)
+static inline int error_check_objects(struct object *objects, int num_objs)
 {
     for (int i = 0; i < num_objs; i++) {
         struct object *obj = &objects[i];
+        if (obj->malformed) {
+            return SCENE_MALFORMED_VALUE;
+        }
         switch (obj->type) {
         case OBJ_CAMERA:
             if (obj->camera.width == 0) {
-                fprintf(stderr, "Error: camera initialized without a width!\n");
-                free(objects);
-                exit(EXIT_FAILURE);
+                return SCENE_CAMERA_WITHOUT_WIDTH;
             } else if (obj->camera.height == 0) {
-                fprintf(stderr, "Error: camera initialized without a height!\n");
-                free(objects);
-                exit(EXIT_FAILURE);
+                return SCENE_CAMERA_WITHOUT_HEIGHT;
             }
             break;
        case OBJ_LIGHT:
             if (obj->light.theta) {
                 v3 dir = obj->light.direction;
                 if ((int)dir.x == 0 && (int)!dir.y == 0 && (int)!dir.z == 0) {
-                    fprintf(stderr, "Error: a spotlight was specified without a direction!\n");
-                    free(objects);
-                    exit(EXIT_FAILURE);
+                    return SCENE_SPOTLIGHT_WITHOUT_DIRECTION;
                 }
             }
             break;
-       case OBJ_UNKNOWN:
-            fprintf(stderr, "Error: an object was specified without a type!\n");
-            free(objects);
-            exit(EXIT_FAILURE);
+       case OBJ_INSTANCE:
+            if (obj->group[0] == '\0') {
+                return SCENE_INSTANCE_WITHOUT_GROUP;
+            }
+            break;
+       case OBJ_MESH:
+            if (obj->mesh.path[0] == '\0') {
+                return SCENE_MESH_WITHOUT_PATH;
+            }
             break;
+       case OBJ_CLOUD:
+            if (obj->cloud.path[0] == '\0') {
+                return SCENE_CLOUD_WITHOUT_PATH;
+            }
+            break;
+       case OBJ_UNKNOWN:
+            return SCENE_UNTYPED_OBJECT;
+        }
+    }
+    return SCENE_SUCCESS;
+}
+
+const char *scene_status_message(int status)
+{
+    switch (status) {
+        case SCENE_SUCCESS:
+            return "success";
+        case SCENE_NO_MEMORY:
+            return "out of memory while building the scene";
+        case SCENE_CAMERA_WITHOUT_WIDTH:
+            return "camera initialized without a width";
+        case SCENE_CAMERA_WITHOUT_HEIGHT:
+            return "camera initialized without a height";
+        case SCENE_SPOTLIGHT_WITHOUT_DIRECTION:
+            return "a spotlight was specified without a direction";
+        case SCENE_INSTANCE_WITHOUT_GROUP:
+            return "an instance was specified without a group";
+        case SCENE_UNKNOWN_GROUP:
+            return "an instance references an unknown group";
+        case SCENE_UNTYPED_OBJECT:
+            return "an object was specified without a type";
+        case SCENE_MESH_WITHOUT_PATH:
+            return "a mesh was specified without a path";
+        case SCENE_MESH_NOT_FOUND:
+            return "a mesh file could not be opened";
+        case SCENE_BAD_MESH:
+            return "a mesh file is truncated or invalid";
+        case SCENE_CLOUD_WITHOUT_PATH:
+            return "a cloud was specified without a path";
+        case SCENE_CLOUD_NOT_FOUND:
+            return "a cloud file could not be opened";
+        case SCENE_BAD_CLOUD:
+            return "a cloud file is truncated or invalid";
+        case SCENE_MALFORMED_VALUE:
+            return "a value was cut short or malformed";
+    }
+    return "unknown error";
+}
+
+/*
+ * Material table
+ * ==============
+ * Open addressing hash set over the distinct materials of the scene. Slots
+ * hold material index + 1 so that zero marks an empty slot.
+ */
+struct material_table {
+    struct material *materials;
+    u32 num_materials;
+    u32 *slots;
+    u32 mask;
+};
+
+static inline u64 hash_double(u64 hash, double value)
+{
+    // Adding zero folds -0.0 into 0.0 so equal values hash equally
+    value += 0.0;
+    return hash_bytes(hash, &value, sizeof(value));
+}
+
+static u64 hash_material(struct material *m)
+{
+    u64 hash = FNV_OFFSET_BASIS;
+    hash = hash_double(hash, m->color.r);
+    hash = hash_double(hash, m->color.g);
+    hash = hash_double(hash, m->color.b);
+    hash = hash_double(hash, m->diffuse.r);
+    hash = hash_double(hash, m->diffuse.g);
+    hash = hash_double(hash, m->diffuse.b);
+    hash = hash_double(hash, m->specular.r);
+    hash = hash_double(hash, m->specular.g);
+    hash = hash_double(hash, m->specular.b);
+    hash = hash_double(hash, m->reflectivity);
+    hash = hash_double(hash, m->refractivity);
+    hash = hash_double(hash, m->ior);
+    return hash;
+}
+
+static bool materials_equal(struct material *a, struct material *b)
+{
+    return a->color.r == b->color.r && a->color.g == b->color.g && a->color.b == b->color.b &&
+           a->diffuse.r == b->diffuse.r && a->diffuse.g == b->diffuse.g && a->diffuse.b == b->diffuse.b &&
+           a->specular.r == b->specular.r && a->specular.g == b->specular.g &&
+           a->specular.b == b->specular.b && a->reflectivity == b->reflectivity &&
+           a->refractivity == b->refractivity && a->ior == b->ior;
+}
+
+// Sized for the worst case of every primitive having its own material
+static void init_material_table(struct material_table *table, u32 max_materials)
+{
+    u32 capacity = 16;
+    while (capacity < 2 * max_materials) {
+        capacity *= 2;
+    }
+    table->materials = calloc(max_materials ? max_materials : 1, sizeof(struct material));
+    table->num_materials = 0;
+    table->slots = calloc(capacity, sizeof(u32));
+    table->mask = capacity - 1;
+}
+
+// Returns the index of the material, adding it to the table if it is new
+static u32 intern_material(struct material_table *table, struct material *material)
+{
+    u32 slot = hash_material(material) & table->mask;
+    while (table->slots[slot]) {
+        u32 index = table->slots[slot] - 1;
+        if (materials_equal(&table->materials[index], material)) {
+            return index;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+
+    u32 index = table->num_materials++;
+    table->materials[index] = *material;
+    table->slots[slot] = index + 1;
+    return index;
+}
+
+// Returns the index of the named group, or num_groups if there is none
+static u32 find_group(struct group *groups, u32 num_groups, char *name)
+{
+    for (u32 i = 0; i < num_groups; i++) {
+        if (strncmp(groups[i].name, name, MAX_NAME_LEN) == 0) {
+            return i;
         }
     }
+    return num_groups;
 }
 
-// Simply takes each individual object from the object array and constructs
-// 3 arrays of cameras, spheres, and planes
-void construct_scene(struct file_contents *csvfc, struct scene *scene)
+// Builds the bottom level hierarchy of every group and the top level
+// hierarchy over the instances placing them.
+static void build_instance_hierarchy(struct scene *scene)
 {
-    u32 nobjs = get_num_objs((char *)csvfc->memory, csvfc->size);
+    for (u32 i = 0; i < scene->num_groups; i++) {
+        struct group *group = &scene->groups[i];
+        struct aabb *bounds = malloc(sizeof(struct aabb) * group->num_spheres);
+
+        group->bounds = aabb_empty();
+        for (u32 j = 0; j < group->num_spheres; j++) {
+            bounds[j] = sphere_bounds(&group->spheres[j]);
+            aabb_grow(&group->bounds, bounds[j]);
+        }
+        bvh_build(&group->bvh, bounds, group->num_spheres);
+        free(bounds);
+    }
 
-    struct object *objs = get_csv_objects(csvfc, nobjs);
-    error_check_objects(objs, nobjs);
+    struct aabb *bounds = malloc(sizeof(struct aabb) * scene->num_instances);
+    for (u32 i = 0; i < scene->num_instances; i++) {
+        struct instance *instance = &scene->instances[i];
+        struct group *group = &scene->groups[instance->group];
+        bounds[i] = aabb_translate(group->bounds, instance->translation);
+    }
+    bvh_build(&scene->instance_bvh, bounds, scene->num_instances);
+    free(bounds);
+}
+
+// Builds the scene's arrays of cameras, lights, spheres, planes, groups,
+// instances, meshes and clouds from parsed objects, and frees them
+static int build_scene(struct object *objs, u32 nobjs, struct scene *scene)
+{
+    memset(scene, 0, sizeof(struct scene));
+    int status = error_check_objects(objs, nobjs);
+    if (status != SCENE_SUCCESS) {
+        free(objs);
+        return status;
+    }
 
     struct light *lights;
     struct camera *cameras;
     struct plane *planes;
     struct sphere *spheres;
+    struct group *groups;
+    struct instance *instances;
+    struct mesh *meshes;
+    struct cloud *clouds;
+    struct material_table table;
     u32 num_lights = 0;
     u32 num_cameras = 0;
     u32 num_planes = 0;
     u32 num_spheres = 0;
+    u32 num_grouped = 0;
+    u32 num_groups = 0;
+    u32 num_instances = 0;
+    u32 num_meshes = 0;
+    u32 num_clouds = 0;
 
     for (int i = 0; i < nobjs; i++) {
         struct object *obj = &objs[i];
@@ -422,8 +645,16 @@ void construct_scene(struct file_contents *csvfc, struct scene *scene)
             num_cameras++;
         } else if (obj->type == OBJ_PLANE) {
             num_planes++;
+        } else if (obj->type == OBJ_SPHERE && obj->group[0]) {
+            num_grouped++;
         } else if (obj->type == OBJ_SPHERE) {
             num_spheres++;
+        } else if (obj->type == OBJ_INSTANCE) {
+            num_instances++;
+        } else if (obj->type == OBJ_MESH) {
+            num_meshes++;
+        } else if (obj->type == OBJ_CLOUD) {
+            num_clouds++;
         }
     }
 
@@ -431,37 +662,209 @@ void construct_scene(struct file_contents *csvfc, struct scene *scene)
     cameras = malloc(sizeof(struct camera) * num_cameras);
     planes = malloc(sizeof(struct plane) * num_planes);
     spheres = malloc(sizeof(struct sphere) * num_spheres);
+    groups = calloc(num_grouped, sizeof(struct group));
+    instances = malloc(sizeof(struct instance) * num_instances);
+    meshes = malloc(sizeof(struct mesh) * num_meshes);
+    clouds = malloc(sizeof(struct cloud) * num_clouds);
+    init_material_table(&table, num_planes + num_spheres + num_grouped + num_meshes +
+                        num_clouds);
+
+    // Every distinct group name gets a group, sized by its member count
+    for (int i = 0; i < nobjs; i++) {
+        struct object *obj = &objs[i];
+        if (obj->type == OBJ_SPHERE && obj->group[0]) {
+            u32 group_index = find_group(groups, num_groups, obj->group);
+            if (group_index == num_groups) {
+                memcpy(groups[num_groups++].name, obj->group, MAX_NAME_LEN);
+            }
+            groups[group_index].num_spheres++;
+        }
+    }
+
+    // Instances can only be resolved once all group names are known
+    for (int i = 0; i < nobjs; i++) {
+        if (objs[i].type == OBJ_INSTANCE &&
+            find_group(groups, num_groups, objs[i].group) == num_groups) {
+            free(lights);
+            free(cameras);
+            free(planes);
+            free(spheres);
+            free(groups);
+            free(instances);
+            free(meshes);
+            free(clouds);
+            free(table.materials);
+            free(table.slots);
+            free(objs);
+            return SCENE_UNKNOWN_GROUP;
+        }
+    }
+
+    for (u32 i = 0; i < num_groups; i++) {
+        groups[i].spheres = malloc(sizeof(struct sphere) * groups[i].num_spheres);
+        groups[i].num_spheres = 0;
+    }
 
     u32 light_index = 0;
     u32 camera_index = 0;
     u32 plane_index = 0;
     u32 sphere_index = 0;
+    u32 instance_index = 0;
+    u32 mesh_index = 0;
+    u32 cloud_index = 0;
 
     for (int i = 0; i < nobjs; i++) {
         struct object *obj = &objs[i];
         if (obj->type == OBJ_LIGHT) {
             struct light *light = &lights[light_index++];
             memcpy(light, &obj->light, sizeof(struct light));
+            // Spotlight directions are normalized once here instead of per hit
+            if (light->theta) {
+                v3_normalize(&light->direction, light->direction);
+            }
         } else if (obj->type == OBJ_CAMERA) {
             struct camera *camera = &cameras[camera_index++];
             memcpy(camera, &obj->camera, sizeof(struct camera));
         } else if (obj->type == OBJ_PLANE) {
             struct plane *plane = &planes[plane_index++];
             memcpy(plane, &obj->plane, sizeof(struct plane));
+            plane->material = intern_material(&table, &obj->material);
+        } else if (obj->type == OBJ_SPHERE && obj->group[0]) {
+            struct group *group = &groups[find_group(groups, num_groups, obj->group)];
+            struct sphere *sphere = &group->spheres[group->num_spheres++];
+            memcpy(sphere, &obj->sphere, sizeof(struct sphere));
+            sphere->material = intern_material(&table, &obj->material);
         } else if (obj->type == OBJ_SPHERE) {
             struct sphere *sphere = &spheres[sphere_index++];
             memcpy(sphere, &obj->sphere, sizeof(struct sphere));
+            sphere->material = intern_material(&table, &obj->material);
+        } else if (obj->type == OBJ_INSTANCE) {
+            struct instance *instance = &instances[instance_index++];
+            memcpy(instance, &obj->instance, sizeof(struct instance));
+            instance->group = find_group(groups, num_groups, obj->group);
+        } else if (obj->type == OBJ_MESH) {
+            struct mesh *mesh = &meshes[mesh_index++];
+            memcpy(mesh, &obj->mesh, sizeof(struct mesh));
+            mesh->material = intern_material(&table, &obj->material);
+        } else if (obj->type == OBJ_CLOUD) {
+            struct cloud *cloud = &clouds[cloud_index++];
+            memcpy(cloud, &obj->cloud, sizeof(struct cloud));
+            cloud->material = intern_material(&table, &obj->material);
         }
     }
 
+    // Only the distinct materials are kept around
+    free(table.slots);
+    scene->materials = realloc(table.materials, sizeof(struct material) *
+                               (table.num_materials ? table.num_materials : 1));
+    scene->num_materials = table.num_materials;
     scene->lights = lights;
     scene->spheres = spheres;
     scene->planes = planes;
     scene->cameras = cameras;
+    scene->groups = groups;
+    scene->instances = instances;
+    scene->meshes = meshes;
+    scene->clouds = clouds;
     scene->num_lights = num_lights;
     scene->num_spheres = num_spheres;
     scene->num_planes = num_planes;
     scene->num_cameras = num_cameras;
+    scene->num_groups = num_groups;
+    scene->num_instances = num_instances;
 
+    u64 span = trace_begin();
+    build_instance_hierarchy(scene);
+    trace_end("build instance hierarchy", span);
     free(objs);
+
+    // Meshes are mapped last, so a bad one is cleaned up with the whole scene
+    for (u32 i = 0; i < num_meshes; i++) {
+        status = load_mesh(&meshes[i]);
+        if (status != MESH_SUCCESS) {
+            clear_scene(scene);
+            return status == MESH_CANT_OPEN ? SCENE_MESH_NOT_FOUND : SCENE_BAD_MESH;
+        }
+        scene->num_meshes++;
+    }
+
+    // Clouds only load their cluster tables, the particles stay on disk
+    if (num_clouds) {
+        scene->cloud_cache = cloud_cache_create((u64)CLOUD_DEFAULT_MB << 20);
+    }
+    for (u32 i = 0; i < num_clouds; i++) {
+        status = load_cloud(&clouds[i], scene->cloud_cache);
+        if (status != CLOUD_SUCCESS) {
+            clear_scene(scene);
+            return status == CLOUD_CANT_OPEN ? SCENE_CLOUD_NOT_FOUND : SCENE_BAD_CLOUD;
+        }
+        scene->num_clouds++;
+    }
+    return SCENE_SUCCESS;
+}
+
+int construct_scene(struct file_contents *csvfc, struct scene *scene)
+{
+    u32 nlines = get_num_objs((char *)csvfc->memory, csvfc->size);
+    u32 nobjs;
+
+    memset(scene, 0, sizeof(struct scene));
+    struct object *objs = get_csv_objects(csvfc, nlines, &nobjs);
+    if (!objs) {
+        return SCENE_NO_MEMORY;
+    }
+    return build_scene(objs, nobjs, scene);
+}
+
+/*
+ * Streaming
+ * =========
+ */
+void scene_stream_init(struct scene_stream *stream)
+{
+    memset(stream, 0, sizeof(struct scene_stream));
+}
+
+// Parses one line the same way get_csv_objects() does
+static void stream_line(struct scene_stream *stream)
+{
+    char line[MAX_LINE_LEN];
+    stream->partial[stream->partial_length] = '\0';
+    stream->partial_length = 0;
+    remove_all_spaces(stream->partial, line);
+    if (skip_line(line)) {
+        return;
+    }
+
+    if (stream->num_objects == stream->capacity) {
+        stream->capacity = stream->capacity ? 2 * stream->capacity : 64;
+        stream->objects = realloc(stream->objects, sizeof(struct object) * stream->capacity);
+    }
+    struct object *obj = &stream->objects[stream->num_objects++];
+    memset(obj, 0, sizeof(struct object));
+    parse_line(obj, line);
+}
+
+void scene_stream_feed(struct scene_stream *stream, const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        // Overlong lines are cut short rather than overflowing
+        if (stream->partial_length < MAX_LINE_LEN - 1) {
+            stream->partial[stream->partial_length++] = data[i];
+        }
+        if (data[i] == '\n') {
+            stream_line(stream);
+        }
+    }
+}
+
+int scene_stream_finish(struct scene_stream *stream, struct scene *scene)
+{
+    if (stream->partial_length) {
+        stream_line(stream);
+    }
+    struct object *objs = stream->objects ? stream->objects : malloc(sizeof(struct object));
+    int status = build_scene(objs, stream->num_objects, scene);
+    scene_stream_init(stream);
+    return status;
 }
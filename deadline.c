@@ -0,0 +1,191 @@
+#include "deadline.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+const struct quality_level quality_levels[] = {
+    {1, true},
+    {2, true},
+    {4, true},
+    {8, true},
+    {8, false}
+};
+const u32 num_quality_levels = sizeof(quality_levels) / sizeof(*quality_levels);
+
+static double seconds_since(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+// Source index and 8 bit weight of the next sample for every destination
+// coordinate, sampling at pixel centers
+struct sample_weights {
+    u32 *first;
+    u32 *second;
+    u32 *weight;
+};
+
+static struct sample_weights sample_weights(u32 src_size, u32 dst_size)
+{
+    struct sample_weights result;
+    result.first = malloc(sizeof(u32) * dst_size);
+    result.second = malloc(sizeof(u32) * dst_size);
+    result.weight = malloc(sizeof(u32) * dst_size);
+
+    for (u32 n = 0; n < dst_size; n++) {
+        double x = clamp((n + 0.5) * src_size / dst_size - 0.5, 0, src_size - 1);
+        result.first[n] = (u32)x;
+        result.second[n] = result.first[n] + 1 < src_size ? result.first[n] + 1 : result.first[n];
+        result.weight[n] = (u32)((x - result.first[n]) * 256 + 0.5);
+    }
+    return result;
+}
+
+static void free_sample_weights(struct sample_weights *weights)
+{
+    free(weights->first);
+    free(weights->second);
+    free(weights->weight);
+}
+
+static inline u8 lerp_channel(u32 a, u32 b, u32 c, u32 d, u32 fx, u32 fy)
+{
+    u32 top = a * (256 - fx) + b * fx;
+    u32 bottom = c * (256 - fx) + d * fx;
+    return (top * (256 - fy) + bottom * fy + 32768) >> 16;
+}
+
+// Bilinear upscale of a whole pixmap in 8 bit fixed point
+static void upscale(struct pixmap src, struct pixmap dst)
+{
+    struct sample_weights columns = sample_weights(src.width, dst.width);
+    struct sample_weights rows = sample_weights(src.height, dst.height);
+
+    for (u32 i = 0; i < dst.height; i++) {
+        pixel *row0 = &src.pixels[rows.first[i] * src.width];
+        pixel *row1 = &src.pixels[rows.second[i] * src.width];
+        u32 fy = rows.weight[i];
+
+        for (u32 j = 0; j < dst.width; j++) {
+            pixel *a = &row0[columns.first[j]];
+            pixel *b = &row0[columns.second[j]];
+            pixel *c = &row1[columns.first[j]];
+            pixel *d = &row1[columns.second[j]];
+            u32 fx = columns.weight[j];
+            pixel *out = &dst.pixels[i * dst.width + j];
+            out->r = lerp_channel(a->r, b->r, c->r, d->r, fx, fy);
+            out->g = lerp_channel(a->g, b->g, c->g, d->g, fx, fy);
+            out->b = lerp_channel(a->b, b->b, c->b, d->b, fx, fy);
+        }
+    }
+
+    free_sample_weights(&columns);
+    free_sample_weights(&rows);
+}
+
+static struct pixmap scaled_pixmap(struct pixmap image, u32 divisor)
+{
+    struct pixmap result = {0};
+    if (divisor == 1) {
+        return image;
+    }
+    result.width = (image.width + divisor - 1) / divisor;
+    result.height = (image.height + divisor - 1) / divisor;
+    result.pixels = malloc(sizeof(pixel) * result.width * result.height);
+    return result;
+}
+
+// Renders at a quality level and returns the time it took per pixel
+static double render_level(struct scene *scene, struct pixmap image, u32 level,
+                           struct render_options options, struct pixmap *result)
+{
+    struct quality_level quality = quality_levels[level];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    options.skip_shadows = options.skip_shadows || !quality.shadows;
+    *result = scaled_pixmap(image, quality.divisor);
+    render_scene(scene, *result, options);
+    return seconds_since(start) / (result->width * result->height);
+}
+
+// Best level from `first` down to `last` expected to fit in the budget,
+// or last + 1 when none does
+static u32 pick_level(struct pixmap image, u32 first, u32 last, double pixel_cost, double budget,
+                      double *estimate)
+{
+    for (u32 level = first; level <= last; level++) {
+        u32 divisor = quality_levels[level].divisor;
+        u32 width = (image.width + divisor - 1) / divisor;
+        u32 height = (image.height + divisor - 1) / divisor;
+        if (pixel_cost * width * height <= budget) {
+            *estimate = pixel_cost * width * height;
+            return level;
+        }
+    }
+    return last + 1;
+}
+
+/*
+ * The cheapest level is rendered first, which measures the cost of a
+ * primary ray and guarantees there's an image to return. Shadowed levels
+ * are first estimated at one extra ray per light. If the smallest shadowed
+ * level fits it's rendered next, which measures the real cost of shading
+ * with shadows, and that picks the final level.
+ */
+void render_with_deadline(struct scene *scene, struct pixmap image, struct render_options options)
+{
+    struct timespec start;
+    struct render_options pass = options;
+    u32 cheapest = num_quality_levels - 1;
+    struct pixmap best_pixels;
+    u32 best = cheapest;
+    double estimate;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Stats are left describing the last render
+    pass.deadline_ms = 0;
+    pass.tile_mask = NULL;
+
+    double deadline = options.deadline_ms * 1e-3;
+    double primary_cost = render_level(scene, image, cheapest, pass, &best_pixels);
+    estimate = seconds_since(start);
+    double shaded_cost = primary_cost * (1 + scene->num_lights);
+
+    u32 level = pick_level(image, cheapest - 1, cheapest - 1, shaded_cost,
+                           (deadline - seconds_since(start)) * DEADLINE_MARGIN, &estimate);
+    if (level < cheapest) {
+        struct pixmap pixels;
+        shaded_cost = render_level(scene, image, level, pass, &pixels);
+        free(best_pixels.pixels);
+        best_pixels = pixels;
+        best = level;
+
+        level = pick_level(image, 0, best - 1, shaded_cost,
+                           (deadline - seconds_since(start)) * DEADLINE_MARGIN, &estimate);
+        if (level < best) {
+            render_level(scene, image, level, pass, &pixels);
+            if (best_pixels.pixels != image.pixels) {
+                free(best_pixels.pixels);
+            }
+            best_pixels = pixels;
+            best = level;
+        }
+    }
+
+    if (best_pixels.pixels != image.pixels) {
+        u64 span = trace_begin();
+        upscale(best_pixels, image);
+        trace_end("upscale", span);
+        free(best_pixels.pixels);
+    }
+
+    if (options.stats) {
+        options.stats->quality_level = best;
+        options.stats->estimated_seconds = estimate;
+        options.stats->seconds = seconds_since(start);
+    }
+}
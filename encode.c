@@ -0,0 +1,390 @@
+#include "encode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+// Fastest deflate level, the point is to beat the disk, not to be small
+#define PNG_DEFLATE_LEVEL 1
+#endif
+
+#define QOI_OP_INDEX    0x00
+#define QOI_OP_DIFF     0x40
+#define QOI_OP_LUMA     0x80
+#define QOI_OP_RUN      0xc0
+#define QOI_OP_RGB      0xfe
+#define QOI_MAX_RUN     62
+
+struct encoded_band {
+    u8 *data;
+    size_t size;
+    // Checksum and size of the data the band compressed, for PNG
+    u32 adler;
+    size_t raw_size;
+    bool ready;
+    // Bands of zero width images are empty, so failures are flagged apart
+    bool failed;
+};
+
+struct encode_job {
+    struct ppm_pixmap pm;
+    enum image_format format;
+    struct encoded_band *bands;
+    u32 num_bands;
+    u32 next_band;
+    pthread_mutex_t lock;
+    pthread_cond_t band_ready;
+};
+
+enum image_format image_format(const char *path)
+{
+    const char *extension = strrchr(path, '.');
+    if (extension && strcasecmp(extension, ".qoi") == 0) {
+        return FORMAT_QOI;
+    } else if (extension && strcasecmp(extension, ".png") == 0) {
+        return FORMAT_PNG;
+    }
+    return FORMAT_PPM;
+}
+
+bool format_supported(enum image_format format)
+{
+#ifdef HAVE_ZLIB
+    return true;
+#else
+    return format != FORMAT_PNG;
+#endif
+}
+
+const char *format_name(enum image_format format)
+{
+    static const char *names[] = {"PPM", "QOI", "PNG"};
+    return names[format];
+}
+
+static inline u8 *put_u32_be(u8 *out, u32 value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+    return out + 4;
+}
+
+/* ---- QOI ---- */
+
+static inline u32 qoi_hash(pixel px)
+{
+    return (px.r * 3 + px.g * 5 + px.b * 7 + 255 * 11) % 64;
+}
+
+static inline bool same_pixel(pixel a, pixel b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+/*
+ * Encodes count pixels following prev. The decoder's color index holds
+ * whatever came before the band, which is unknown here, so an index entry
+ * is only used once this band has stored it. Every decoded pixel, runs
+ * included, is stored at its hash, exactly as the decoder does.
+ */
+static size_t qoi_encode_band(const pixel *pixels, u32 count, pixel prev, u8 *out)
+{
+    pixel index[64];
+    u64 known = 0;
+    u32 run = 0;
+    u8 *start = out;
+
+    for (u32 i = 0; i < count; i++) {
+        pixel px = pixels[i];
+        u32 slot = qoi_hash(px);
+        if (same_pixel(px, prev)) {
+            if (++run == QOI_MAX_RUN) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+        } else {
+            if (run) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            s8 dr = px.r - prev.r;
+            s8 dg = px.g - prev.g;
+            s8 db = px.b - prev.b;
+            s8 dr_dg = dr - dg;
+            s8 db_dg = db - dg;
+            if ((known >> slot & 1) && same_pixel(index[slot], px)) {
+                *out++ = QOI_OP_INDEX | slot;
+            } else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                       db_dg >= -8 && db_dg <= 7) {
+                *out++ = QOI_OP_LUMA | (dg + 32);
+                *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+            } else {
+                *out++ = QOI_OP_RGB;
+                *out++ = px.r;
+                *out++ = px.g;
+                *out++ = px.b;
+            }
+        }
+        index[slot] = px;
+        known |= 1ULL << slot;
+        prev = px;
+    }
+    if (run) {
+        *out++ = QOI_OP_RUN | (run - 1);
+    }
+    return out - start;
+}
+
+/* ---- PNG ---- */
+
+#ifdef HAVE_ZLIB
+/*
+ * Filters the band's rows with the Up filter, which only needs the row
+ * above, and deflates them into a raw stream. Every band but the last ends
+ * with a sync flush, so the streams can be concatenated. The first band
+ * carries the zlib header.
+ */
+static bool png_encode_band(struct ppm_pixmap pm, u32 y0, u32 y1, bool last,
+                            struct encoded_band *band)
+{
+    u32 row_size = sizeof(pixel) * pm.width;
+    band->raw_size = (size_t)(y1 - y0) * (row_size + 1);
+    u8 *filtered = malloc(band->raw_size);
+    for (u32 y = y0; y < y1; y++) {
+        const u8 *row = (const u8 *)&pm.pixmap[(size_t)y * pm.width];
+        const u8 *above = y ? row - row_size : NULL;
+        u8 *out = &filtered[(size_t)(y - y0) * (row_size + 1)];
+        *out++ = 2;
+        for (u32 k = 0; k < row_size; k++) {
+            out[k] = above ? row[k] - above[k] : row[k];
+        }
+    }
+    band->adler = adler32(adler32(0, NULL, 0), filtered, band->raw_size);
+
+    z_stream stream = {0};
+    if (deflateInit2(&stream, PNG_DEFLATE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(filtered);
+        return false;
+    }
+    size_t header = y0 ? 0 : 2;
+    size_t capacity = header + deflateBound(&stream, band->raw_size) + 16;
+    band->data = malloc(capacity);
+    if (header) {
+        band->data[0] = 0x78;
+        band->data[1] = 0x01;
+    }
+    stream.next_in = filtered;
+    stream.avail_in = band->raw_size;
+    stream.next_out = band->data + header;
+    stream.avail_out = capacity - header;
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    band->size = header + stream.total_out;
+    deflateEnd(&stream);
+    free(filtered);
+    return status == (last ? Z_STREAM_END : Z_OK) && stream.avail_in == 0;
+}
+
+static bool write_png_chunk(FILE *fh, const char *type, const u8 *data, u32 size)
+{
+    u8 length[4];
+    u8 crc[4];
+    // crc32() treats a NULL buffer as a request for the initial value
+    u32 checksum = crc32(0, (const u8 *)type, 4);
+    put_u32_be(length, size);
+    put_u32_be(crc, size ? crc32(checksum, data, size) : checksum);
+    return fwrite(length, 4, 1, fh) == 1 && fwrite(type, 4, 1, fh) == 1 &&
+           (!size || fwrite(data, size, 1, fh) == 1) && fwrite(crc, 4, 1, fh) == 1;
+}
+#endif
+
+/* ---- Bands ---- */
+
+static bool encode_band(struct encode_job *job, u32 b)
+{
+    struct ppm_pixmap pm = job->pm;
+    struct encoded_band *band = &job->bands[b];
+    u32 y0 = b * ENCODE_BAND_ROWS;
+    u32 y1 = y0 + ENCODE_BAND_ROWS < pm.height ? y0 + ENCODE_BAND_ROWS : pm.height;
+    bool encoded = true;
+
+    u64 span = trace_begin();
+    if (job->format == FORMAT_QOI) {
+        u32 count = (y1 - y0) * pm.width;
+        const pixel *pixels = &pm.pixmap[(size_t)y0 * pm.width];
+        pixel prev = y0 ? pixels[-1] : (pixel){0, 0, 0};
+        band->data = malloc((size_t)count * 4 + 1);
+        band->size = qoi_encode_band(pixels, count, prev, band->data);
+    } else {
+#ifdef HAVE_ZLIB
+        encoded = png_encode_band(pm, y0, y1, b == job->num_bands - 1, band);
+#endif
+    }
+    trace_end_arg("encode band", "rows", y1 - y0, span);
+    return encoded;
+}
+
+static void *encode_thread_main(void *arg)
+{
+    struct encode_job *job = arg;
+    u32 b;
+    while ((b = __atomic_fetch_add(&job->next_band, 1, __ATOMIC_RELAXED)) < job->num_bands) {
+        // A failed band fails the whole write
+        job->bands[b].failed = !encode_band(job, b);
+        pthread_mutex_lock(&job->lock);
+        job->bands[b].ready = true;
+        pthread_cond_broadcast(&job->band_ready);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+static bool write_header(struct ppm_pixmap pm, FILE *fh, enum image_format format)
+{
+    if (format == FORMAT_QOI) {
+        u8 header[14] = {'q', 'o', 'i', 'f'};
+        put_u32_be(&header[4], pm.width);
+        put_u32_be(&header[8], pm.height);
+        header[12] = 3;     // RGB
+        header[13] = 0;     // sRGB with linear alpha
+        return fwrite(header, sizeof(header), 1, fh) == 1;
+    }
+#ifdef HAVE_ZLIB
+    static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    u8 header[13] = {0};
+    put_u32_be(&header[0], pm.width);
+    put_u32_be(&header[4], pm.height);
+    header[8] = 8;          // bits per channel
+    header[9] = 2;          // RGB
+    return fwrite(signature, sizeof(signature), 1, fh) == 1 &&
+           write_png_chunk(fh, "IHDR", header, sizeof(header));
+#else
+    return false;
+#endif
+}
+
+static bool write_band(struct encode_job *job, FILE *fh, u32 b)
+{
+    struct encoded_band *band = &job->bands[b];
+    if (job->format == FORMAT_QOI) {
+        return fwrite(band->data, 1, band->size, fh) == band->size;
+    }
+#ifdef HAVE_ZLIB
+    return write_png_chunk(fh, "IDAT", band->data, band->size);
+#else
+    return false;
+#endif
+}
+
+static bool write_trailer(struct encode_job *job, FILE *fh)
+{
+    if (job->format == FORMAT_QOI) {
+        static const u8 end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        return fwrite(end, sizeof(end), 1, fh) == 1;
+    }
+#ifdef HAVE_ZLIB
+    // Adler-32 of all the filtered rows closes the zlib stream
+    u32 adler = adler32(0, NULL, 0);
+    for (u32 b = 0; b < job->num_bands; b++) {
+        adler = adler32_combine(adler, job->bands[b].adler, job->bands[b].raw_size);
+    }
+    u8 checksum[4];
+    put_u32_be(checksum, adler);
+    return write_png_chunk(fh, "IDAT", checksum, sizeof(checksum)) &&
+           write_png_chunk(fh, "IEND", NULL, 0);
+#else
+    return false;
+#endif
+}
+
+// Size of everything around the bands
+static u64 framing_bytes(enum image_format format, u32 num_bands)
+{
+    if (format == FORMAT_QOI) {
+        return 14 + 8;
+    }
+    // Signature, IHDR, one IDAT per band plus the checksum's, IEND
+    return 8 + 25 + 12 * (u64)num_bands + 16 + 12;
+}
+
+bool write_encoded_image(struct ppm_pixmap pm, FILE *fh, enum image_format format, u32 threads,
+                         struct encode_stats *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    u64 raw_bytes = sizeof(pixel) * (u64)pm.width * pm.height;
+    u64 encoded_bytes = 0;
+    bool written;
+
+    if (format == FORMAT_PPM) {
+        long before = ftell(fh);
+        write_ppm_header(pm, fh, pm.format);
+        write_p6_pixmap(pm, fh);
+        long after = ftell(fh);
+        written = !ferror(fh);
+        encoded_bytes = before >= 0 && after >= 0 ? (u64)(after - before) : raw_bytes;
+    } else {
+        struct encode_job job = {0};
+        job.pm = pm;
+        job.format = format;
+        job.num_bands = (pm.height + ENCODE_BAND_ROWS - 1) / ENCODE_BAND_ROWS;
+        job.bands = calloc(job.num_bands + 1, sizeof(struct encoded_band));
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.band_ready, NULL);
+
+        u32 num_threads = threads < job.num_bands ? threads : job.num_bands;
+        num_threads = num_threads > 1 ? num_threads : 0;
+        pthread_t *workers = malloc(sizeof(pthread_t) * (num_threads + 1));
+        for (u32 t = 0; t < num_threads; t++) {
+            pthread_create(&workers[t], NULL, encode_thread_main, &job);
+        }
+
+        // Bands go out in order as they finish, encoded here when there
+        // are no threads to do it
+        written = write_header(pm, fh, format);
+        for (u32 b = 0; b < job.num_bands; b++) {
+            if (num_threads) {
+                pthread_mutex_lock(&job.lock);
+                while (!job.bands[b].ready) {
+                    pthread_cond_wait(&job.band_ready, &job.lock);
+                }
+                pthread_mutex_unlock(&job.lock);
+            } else {
+                job.bands[b].failed = !encode_band(&job, b);
+            }
+            written = written && !job.bands[b].failed && write_band(&job, fh, b);
+            encoded_bytes += job.bands[b].size;
+            free(job.bands[b].data);
+            job.bands[b].data = NULL;
+        }
+        written = written && write_trailer(&job, fh);
+        encoded_bytes += framing_bytes(format, job.num_bands);
+
+        for (u32 t = 0; t < num_threads; t++) {
+            pthread_join(workers[t], NULL);
+        }
+        pthread_cond_destroy(&job.band_ready);
+        pthread_mutex_destroy(&job.lock);
+        free(workers);
+        free(job.bands);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (stats) {
+        stats->format = format;
+        stats->raw_bytes = raw_bytes;
+        stats->encoded_bytes = encoded_bytes;
+        stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+    return written;
+}
@@ -0,0 +1,88 @@
+#include "heatmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Evenly spaced stops of the color scale
+static const pixel heatmap_scale[] = {
+    {0, 0, 0},
+    {32, 0, 160},
+    {200, 0, 96},
+    {255, 128, 0},
+    {255, 240, 32},
+    {255, 255, 255}
+};
+#define HEATMAP_STOPS (sizeof(heatmap_scale) / sizeof(*heatmap_scale))
+
+static pixel scale_color(double x)
+{
+    double position = x * (HEATMAP_STOPS - 1);
+    u32 stop = position < HEATMAP_STOPS - 1 ? (u32)position : HEATMAP_STOPS - 2;
+    double f = position - stop;
+    pixel a = heatmap_scale[stop];
+    pixel b = heatmap_scale[stop + 1];
+    pixel result = {a.r + f * (b.r - a.r) + 0.5, a.g + f * (b.g - a.g) + 0.5,
+                    a.b + f * (b.b - a.b) + 0.5};
+    return result;
+}
+
+static int compare_cycles(const void *a, const void *b)
+{
+    u64 ca = *(const u64 *)a;
+    u64 cb = *(const u64 *)b;
+    return ca < cb ? -1 : ca > cb;
+}
+
+u64 cycles_percentile(struct pixel_cost *costs, u32 count, double fraction)
+{
+    u64 *cycles = malloc(sizeof(u64) * (count + 1));
+    u32 rendered = 0;
+    for (u32 n = 0; n < count; n++) {
+        if (costs[n].cycles) {
+            cycles[rendered++] = costs[n].cycles;
+        }
+    }
+    qsort(cycles, rendered, sizeof(u64), compare_cycles);
+    u64 result = rendered ? cycles[(u32)(fraction * (rendered - 1))] : 0;
+    free(cycles);
+    return result;
+}
+
+void heatmap_colors(struct pixel_cost *costs, u32 count, pixel *colors)
+{
+    u64 lowest = cycles_percentile(costs, count, HEATMAP_LOW);
+    u64 highest = cycles_percentile(costs, count, HEATMAP_HIGH);
+    double range = highest > lowest ? log((double)highest / lowest) : 1;
+
+    // Pixels that weren't rendered stay black, the cheapest are just above
+    for (u32 n = 0; n < count; n++) {
+        u64 cycles = costs[n].cycles;
+        if (!cycles) {
+            colors[n] = heatmap_scale[0];
+            continue;
+        }
+        cycles = cycles < lowest ? lowest : cycles > highest ? highest : cycles;
+        colors[n] = scale_color(0.02 + 0.98 * log((double)cycles / lowest) / range);
+    }
+}
+
+bool write_cost_counts(const char *path, struct pixel_cost *costs, struct tile_rect window)
+{
+    FILE *output = fopen(path, "w");
+    if (!output) {
+        return false;
+    }
+
+    fprintf(output, "# x y cycles shadow_rays material\n");
+    for (int i = window.y0; i < window.y1; i++) {
+        for (int j = window.x0; j < window.x1; j++) {
+            struct pixel_cost *cost = costs++;
+            fprintf(output, "%d %d %llu %u %d\n", j, i, (unsigned long long)cost->cycles,
+                    cost->shadow_rays, cost->material == COST_MISS ? -1 : (int)cost->material);
+        }
+    }
+
+    bool written = !ferror(output);
+    return fclose(output) == 0 && written;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "3dmath.h"
+
+/*
+ * Axis aligned bounding boxes
+ * ===========================
+ */
+struct aabb {
+    v3 min, max;
+};
+
+static inline struct aabb aabb_empty(void)
+{
+    struct aabb result = {
+        {INFINITY, INFINITY, INFINITY},
+        {-INFINITY, -INFINITY, -INFINITY}
+    };
+    return result;
+}
+
+static inline void aabb_grow(struct aabb *box, struct aabb other)
+{
+    box->min.x = fmin(box->min.x, other.min.x);
+    box->min.y = fmin(box->min.y, other.min.y);
+    box->min.z = fmin(box->min.z, other.min.z);
+    box->max.x = fmax(box->max.x, other.max.x);
+    box->max.y = fmax(box->max.y, other.max.y);
+    box->max.z = fmax(box->max.z, other.max.z);
+}
+
+static inline struct aabb aabb_translate(struct aabb box, v3 offset)
+{
+    struct aabb result = {0};
+    v3_add(&result.min, box.min, offset);
+    v3_add(&result.max, box.max, offset);
+    return result;
+}
+
+// Slab test, returns true if the ray enters the box before tmax
+static inline bool aabb_ray_hit(struct aabb *box, v3 ro, v3 inv_rd, double tmax)
+{
+    double tx0 = (box->min.x - ro.x) * inv_rd.x;
+    double tx1 = (box->max.x - ro.x) * inv_rd.x;
+    double tmin = fmin(tx0, tx1);
+    double tfar = fmax(tx0, tx1);
+
+    double ty0 = (box->min.y - ro.y) * inv_rd.y;
+    double ty1 = (box->max.y - ro.y) * inv_rd.y;
+    tmin = fmax(tmin, fmin(ty0, ty1));
+    tfar = fmin(tfar, fmax(ty0, ty1));
+
+    double tz0 = (box->min.z - ro.z) * inv_rd.z;
+    double tz1 = (box->max.z - ro.z) * inv_rd.z;
+    tmin = fmax(tmin, fmin(tz0, tz1));
+    tfar = fmin(tfar, fmax(tz0, tz1));
+
+    return tfar >= fmax(tmin, 0) && tmin < tmax;
+}
+
+/*
+ * Bounding volume hierarchy
+ * =========================
+ * Nodes are stored depth first in a flat array. Interior nodes keep their
+ * two children next to each other starting at `first`, leaves reference
+ * `count` entries of the `indices` array starting at `first`.
+ */
+#define BVH_LEAF_SIZE   4
+#define BVH_MAX_DEPTH   64
+
+struct bvh_node {
+    struct aabb bounds;
+    u32 first;
+    u32 count;
+};
+
+struct bvh {
+    struct bvh_node *nodes;
+    u32 *indices;
+    u32 num_nodes;
+};
+
+void bvh_build(struct bvh *bvh, struct aabb *bounds, u32 count);
+void bvh_free(struct bvh *bvh);
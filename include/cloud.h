@@ -0,0 +1,138 @@
+#pragma once
+
+#include "raycast.h"
+
+/*
+ * Particle clouds
+ * ===============
+ * Clouds are sets of particles, spheres sharing one material, too large to
+ * keep in memory. They are rendered out of core: the particles stay in a
+ * file, cut into spatially coherent clusters, and only the table of
+ * cluster bounds and a hierarchy over it are loaded with the scene.
+ * Clusters are read on demand into a cache of pages with a fixed memory
+ * budget, shared by all clouds of the scene, and the least recently used
+ * pages are evicted to make room.
+ *
+ * All values in the file are little endian: a struct cloud_header, then
+ * num_clusters struct cloud_cluster entries, then the particles of every
+ * cluster as x, y, z, radius float quadruples, each cluster starting on a
+ * CLOUD_PAGE_SIZE boundary. scripts/cloud.py writes this format from a
+ * list of particles, sorted along a Morton curve so that clusters are
+ * compact.
+ */
+#define CLOUD_MAGIC         0x554f4c43  // "CLOU"
+#define CLOUD_VERSION       1
+#define CLOUD_PAGE_SIZE     4096
+// Most particles a cluster can hold
+#define CLOUD_CLUSTER_SIZE  1024
+#define CLOUD_DEFAULT_MB    256
+
+struct cloud_header {
+    u32 magic;
+    u32 version;
+    u32 num_clusters;
+    u32 reserved;
+    u64 num_particles;
+};
+
+struct cloud_cluster {
+    float min[3];
+    float max[3];
+    // Byte offset of the cluster's particles in the file
+    u64 offset;
+    u32 count;
+    u32 reserved;
+};
+
+struct cloud {
+    char path[MESH_MAX_PATH];
+    // Added to every particle, like the translation of a mesh
+    v3 translation;
+    u32 material;
+    // Index of the file in the scene's cloud cache, set by load_cloud()
+    u32 id;
+    // Resident part: the cluster table, the world space bounds of the
+    // clusters and the hierarchy over them
+    struct cloud_cluster *clusters;
+    struct aabb *cluster_bounds;
+    struct bvh bvh;
+    u32 num_clusters;
+    u64 num_particles;
+    struct aabb bounds;
+    // Identify the file for incremental renders and the tile cache
+    u64 file_size;
+    s64 file_mtime;
+};
+
+// Totals since the cache was created
+struct cloud_cache_stats {
+    // Clusters read from disk, and how often a cluster was already resident
+    u64 page_ins;
+    u64 page_hits;
+    u64 evictions;
+    u64 bytes_read;
+    // Memory the pages held at most, and were allowed to hold
+    u64 peak_bytes;
+    u64 budget;
+};
+
+// Returned by load_cloud()
+enum cloud_status {
+    CLOUD_SUCCESS,
+    CLOUD_CANT_OPEN,
+    CLOUD_BAD_HEADER,
+    CLOUD_TRUNCATED
+};
+
+struct cloud_cache *cloud_cache_create(u64 budget);
+// The cache is freed once every scene sharing it has released it
+void cloud_cache_retain(struct cloud_cache *cache);
+void cloud_cache_release(struct cloud_cache *cache);
+// Evicts pages as needed to fit the new budget
+void cloud_cache_set_budget(struct cloud_cache *cache, u64 budget);
+void cloud_cache_stats(struct cloud_cache *cache, struct cloud_cache_stats *stats);
+
+// Opens cloud->path, reads its cluster table and builds the hierarchy
+// over it, and attaches the file to the cache. Leaves the cloud empty on
+// errors.
+int load_cloud(struct cloud *cloud, struct cloud_cache *cache);
+void unload_cloud(struct cloud *cloud);
+// Deep copy of the resident part, reading through the same cache entry
+void copy_cloud(struct cloud *dest, struct cloud *src);
+
+// Nearest particle of the scene's clouds hit before nearest, or with
+// any_hit the first one found. Sets *hit to the particle in world space
+// and returns its distance, or returns nearest when nothing was hit.
+double clouds_intersect(struct scene *scene, v3 ro, v3 rd, double nearest, bool any_hit,
+                        struct sphere *hit);
+
+/*
+ * Batches
+ * =======
+ * Tracing rays one at a time through the clouds pins a page per cluster
+ * per ray. A batch instead collects every (cluster, ray) visit of a set of
+ * rays from the resident hierarchy, sorts the visits by cluster and then
+ * pins each cluster once for all the rays that reach it. Visits are culled
+ * against the nearest hit known before the batch, not against particles
+ * found during it, so rays may test clusters beyond their final hit.
+ */
+struct cloud_ray {
+    v3 ro, rd;
+    // Distance of the nearest hit so far, updated by the batch
+    double nearest;
+    struct sphere hit;
+    bool found;
+};
+
+// Scratch space of a batch, reused from one batch to the next
+struct cloud_batch {
+    // Cluster in the high 32 bits, ray in the low ones
+    u64 *visits;
+    u64 *sorted;
+    u32 num_visits;
+    u32 capacity;
+};
+
+void trace_cloud_batch(struct scene *scene, struct cloud_batch *batch, struct cloud_ray *rays,
+                       u32 count, bool any_hit);
+void free_cloud_batch(struct cloud_batch *batch);
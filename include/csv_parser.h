@@ -2,24 +2,84 @@
 
 #include "ppmrw.h"
 #include "raycast.h"
+#include "cloud.h"
+
+#include <stddef.h>
+
+// Longest line read from a scene, longer ones are cut short
+#define MAX_LINE_LEN 1024
 
 enum object_type {
     OBJ_UNKNOWN,
     OBJ_CAMERA,
     OBJ_SPHERE,
     OBJ_PLANE,
-    OBJ_LIGHT
+    OBJ_LIGHT,
+    OBJ_INSTANCE,
+    OBJ_MESH,
+    OBJ_CLOUD
 };
 
 struct object {
     enum object_type type;
+    // Group a sphere belongs to, or the group an instance places
+    char group[MAX_NAME_LEN];
+    // Surface of spheres and planes, deduplicated by construct_scene()
+    struct material material;
+    // A value on the line ended early, reported by construct_scene()
+    bool malformed;
     union {
         struct light light;
         struct camera camera;
         struct sphere sphere;
         struct plane plane;
+        struct instance instance;
+        struct mesh mesh;
+        struct cloud cloud;
     };
 };
 
-void construct_scene(struct file_contents *csvfc, struct scene *scene);
+// Returned by construct_scene(), which leaves an empty scene on errors
+enum scene_status {
+    SCENE_SUCCESS,
+    SCENE_NO_MEMORY,
+    SCENE_CAMERA_WITHOUT_WIDTH,
+    SCENE_CAMERA_WITHOUT_HEIGHT,
+    SCENE_SPOTLIGHT_WITHOUT_DIRECTION,
+    SCENE_INSTANCE_WITHOUT_GROUP,
+    SCENE_UNKNOWN_GROUP,
+    SCENE_UNTYPED_OBJECT,
+    SCENE_MESH_WITHOUT_PATH,
+    SCENE_MESH_NOT_FOUND,
+    SCENE_BAD_MESH,
+    SCENE_CLOUD_WITHOUT_PATH,
+    SCENE_CLOUD_NOT_FOUND,
+    SCENE_BAD_CLOUD,
+    SCENE_MALFORMED_VALUE
+};
+
+int construct_scene(struct file_contents *csvfc, struct scene *scene);
+const char *scene_status_message(int status);
+
+/*
+ * Streaming
+ * =========
+ * Parses a scene while it arrives, from a pipe for example: every complete
+ * line fed in is parsed into an object right away, and the scene is built
+ * from them once the input ends. Gives the same scene as construct_scene()
+ * on the whole input.
+ */
+struct scene_stream {
+    struct object *objects;
+    u32 num_objects;
+    u32 capacity;
+    // The line that hasn't seen its newline yet
+    char partial[MAX_LINE_LEN];
+    u32 partial_length;
+};
+
+void scene_stream_init(struct scene_stream *stream);
+void scene_stream_feed(struct scene_stream *stream, const char *data, size_t size);
+// Builds the scene like construct_scene() and resets the stream
+int scene_stream_finish(struct scene_stream *stream, struct scene *scene);
 
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Deadline rendering
+ * ==================
+ * Renders cheap low resolution versions of the image first to measure the
+ * cost of a pixel, then picks the best quality level expected to finish
+ * before the deadline. Lower levels render a smaller image that is
+ * upscaled to the requested size, and the lowest one also skips shadow
+ * rays.
+ */
+struct quality_level {
+    // The image is rendered at 1 / divisor of the requested resolution
+    u32 divisor;
+    bool shadows;
+};
+
+extern const struct quality_level quality_levels[];
+extern const u32 num_quality_levels;
+
+// Only plan to use this fraction of the remaining time, leaving a margin
+// for the estimate being off and for upscaling
+#define DEADLINE_MARGIN 0.8
+
+void render_with_deadline(struct scene *scene, struct pixmap image, struct render_options options);
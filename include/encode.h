@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ppmrw.h"
+
+/*
+ * Compressed image output
+ * =======================
+ * Besides P6, images can be written as QOI (https://qoiformat.org) or, when
+ * built with zlib, as PNG, picked by the file extension. Both are lossless.
+ *
+ * The image is cut into bands of ENCODE_BAND_ROWS rows that are compressed
+ * independently on several threads, and each band is written out as soon
+ * as it and every band above it are done. A QOI band starts with an empty
+ * color index, and only uses index entries it wrote itself, so the stream
+ * stays valid for any decoder. PNG bands are separate deflate streams,
+ * joined with sync flushes, with their checksums combined at the end.
+ */
+#define ENCODE_BAND_ROWS 32
+
+enum image_format {
+    FORMAT_PPM,
+    FORMAT_QOI,
+    FORMAT_PNG
+};
+
+struct encode_stats {
+    enum image_format format;
+    // Size of the raw pixels and of the written file
+    u64 raw_bytes;
+    u64 encoded_bytes;
+    double seconds;
+};
+
+// From the extension of path (.qoi, .png), PPM for anything else
+enum image_format image_format(const char *path);
+// False for PNG when built without zlib
+bool format_supported(enum image_format format);
+const char *format_name(enum image_format format);
+// Writes pm to fh in the given format, encoding bands on up to threads
+// threads, 0 or 1 encodes on the caller's. Crops are only recorded by PPM.
+// Returns false when writing fails.
+bool write_encoded_image(struct ppm_pixmap pm, FILE *fh, enum image_format format, u32 threads,
+                         struct encode_stats *stats);
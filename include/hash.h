@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ppmrw.h"
+
+/*
+ * 64 bit FNV-1a, used wherever scene contents need a cheap stable key
+ */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+static inline u64 hash_bytes(u64 hash, const void *data, size_t size)
+{
+    const u8 *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+#include <stdbool.h>
+
+/*
+ * Cost heatmaps
+ * =============
+ * Turns the pixel costs recorded by render_scene() into a false color
+ * image and a plain text dump of the raw counts. Cycles are mapped on a log
+ * scale from black through blue, red and yellow to white. The scale spans
+ * the 1st to the 99.5th percentile, so the odd pixel that took an interrupt
+ * or a page fault doesn't wash out the rest of the image.
+ */
+#define HEATMAP_LOW     0.01
+#define HEATMAP_HIGH    0.995
+
+// Cycles the given fraction of the rendered pixels stayed under
+u64 cycles_percentile(struct pixel_cost *costs, u32 count, double fraction);
+void heatmap_colors(struct pixel_cost *costs, u32 count, pixel *colors);
+// Writes one "x y cycles shadow_rays material" line per pixel of the
+// window, with material -1 where the primary ray missed
+bool write_cost_counts(const char *path, struct pixel_cost *costs, struct tile_rect window);
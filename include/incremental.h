@@ -0,0 +1,17 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+// Past this many changed objects the per pixel checks cost about as much
+// as rendering, so the whole image is marked dirty instead
+#define MAX_CHANGED_VOLUMES 256
+
+/*
+ * Marks the tiles of an image whose pixels can differ between a previous
+ * and a new version of a scene, one flag per tile in `dirty`. Returns the
+ * number of dirty tiles. Changes to the camera, lights, planes, meshes or
+ * clouds can't be localized and mark every tile.
+ */
+u32 find_dirty_tiles(struct scene *old_scene, struct scene *new_scene,
+                     struct pixmap image, u8 *dirty);
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "raycast.h"
+
+#include <math.h>
+
+/*
+ * Ray/primitive intersection kernels
+ * ==================================
+ * Distance along a ray to a sphere, plane or triangle, -1 on a miss. Kept
+ * in a header so the renderer can inline them into every shading kernel,
+ * and so the kernel benchmark (kernels_bench.c) can check and time the
+ * exact code the renderer runs.
+ */
+
+// Every function a shading kernel calls with its feature set is forced
+// inline, so that the checks of absent features fold away in each variant
+// (and GCC doesn't leave the small helpers out of line in the large ones)
+#define KERNEL static inline __attribute__((always_inline))
+
+// Checks the spheres for intersection
+KERNEL double sphere_intersection_check(struct sphere *sphere, v3 ro, v3 rd)
+{
+    // This vector represents the vector from the origin to the sphere
+    v3 sphere_vec;
+    v3_sub(&sphere_vec, ro, sphere->pos);
+
+    double b = 2 * (rd.x * sphere_vec.x + rd.y * sphere_vec.y + rd.z * sphere_vec.z);
+    double c = sphere_vec.x*sphere_vec.x + sphere_vec.y*sphere_vec.y +
+               sphere_vec.z*sphere_vec.z - sphere->rad*sphere->rad;
+
+    double disc = b*b - 4*c;
+
+    if (disc < 0.00001) {
+        return -1;
+    }
+
+    double sqrt_disc = sqrt(disc);
+    // neither t0 or t1 can be < 0
+    // also t0 will always be the closest point because it does the "-"
+    double t0 = (-b - sqrt_disc) / 2;
+    double t1 = (-b + sqrt_disc) / 2;
+
+    if (t0 < 0) {
+        if(t1 < 0) {
+            return -1;
+        } else {
+            return t1;
+        }
+    } else {
+        return t0;
+    }
+}
+
+// Checks planes for intersection
+KERNEL double plane_intersection_check(struct plane *plane, v3 ro, v3 rd)
+{
+    v3 norm = plane->norm;
+    v3 pos = plane->pos;
+    // This vector represents the vector from the origin to the plane
+    v3 plane_vec;
+
+    v3_sub(&plane_vec, pos, ro);
+    double vo = v3_dot(plane_vec, norm);
+    double vd = v3_dot(norm, rd);
+
+    if (vd > 0.00001) {
+        return -1;
+    }
+
+    // do I need to negate here? doesn't seem like it...
+    double t = vo / vd;
+
+    if (t < 0) {
+        return -1;
+    }
+
+    return t;
+}
+
+/*
+ * Triangles
+ * =========
+ * Watertight ray/triangle test (Woop, Benthin and Wald 2013). The triangle
+ * is sheared into a space where the ray runs along +z from the origin, so
+ * the test reduces to 2D edge functions. The edge shared by two triangles
+ * gets the same edge function in both, so rays through edges and vertices
+ * can't slip between neighbouring triangles.
+ */
+struct triangle_ray {
+    // Axes of the ray space, z being the dominant axis of the direction
+    int kx, ky, kz;
+    // Shear taking the direction to +z
+    double sx, sy, sz;
+};
+
+static inline double v3_axis(v3 vec, int axis)
+{
+    return axis == 0 ? vec.x : axis == 1 ? vec.y : vec.z;
+}
+
+KERNEL struct triangle_ray triangle_ray(v3 rd)
+{
+    struct triangle_ray result;
+    double x = fabs(rd.x), y = fabs(rd.y), z = fabs(rd.z);
+
+    result.kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+    result.kx = (result.kz + 1) % 3;
+    result.ky = (result.kx + 1) % 3;
+    // Swapping keeps the winding, and so the edge function signs, intact
+    if (v3_axis(rd, result.kz) < 0) {
+        int temp = result.kx;
+        result.kx = result.ky;
+        result.ky = temp;
+    }
+
+    double dz = v3_axis(rd, result.kz);
+    result.sx = v3_axis(rd, result.kx) / dz;
+    result.sy = v3_axis(rd, result.ky) / dz;
+    result.sz = 1 / dz;
+    return result;
+}
+
+// Distance along the ray to the triangle (both of its sides), -1 on a miss.
+// Free of branches, so the triangles of a leaf are tested side by side.
+KERNEL double triangle_intersection_check(struct triangle_ray *ray, v3 ro, v3 a, v3 b, v3 c)
+{
+    v3_sub(&a, a, ro);
+    v3_sub(&b, b, ro);
+    v3_sub(&c, c, ro);
+
+    double az = v3_axis(a, ray->kz);
+    double bz = v3_axis(b, ray->kz);
+    double cz = v3_axis(c, ray->kz);
+    double ax = v3_axis(a, ray->kx) - ray->sx * az;
+    double ay = v3_axis(a, ray->ky) - ray->sy * az;
+    double bx = v3_axis(b, ray->kx) - ray->sx * bz;
+    double by = v3_axis(b, ray->ky) - ray->sy * bz;
+    double cx = v3_axis(c, ray->kx) - ray->sx * cz;
+    double cy = v3_axis(c, ray->ky) - ray->sy * cz;
+
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    double det = u + v + w;
+    double t = ray->sz * (u * az + v * bz + w * cz) / det;
+
+    bool inside = (u >= 0 && v >= 0 && w >= 0) | (u <= 0 && v <= 0 && w <= 0);
+    return inside & (det != 0) & (t > 0) ? t : -1;
+}
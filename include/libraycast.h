@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libraycast
+ * ==========
+ * Embeddable interface to the renderer. A scene is loaded once into an
+ * opaque handle and can then be rendered any number of times. Rendering
+ * never modifies a loaded scene, so any number of threads may render the
+ * same or different scenes at once. Problems are reported as error codes,
+ * the library never exits the process.
+ */
+#ifdef __GNUC__
+#define RAYCAST_API __attribute__((visibility("default")))
+#else
+#define RAYCAST_API
+#endif
+
+typedef struct raycast_scene raycast_scene;
+
+enum raycast_error {
+    RAYCAST_OK,
+    RAYCAST_ERROR_INVALID_ARGUMENT,
+    RAYCAST_ERROR_IO,
+    RAYCAST_ERROR_INVALID_SCENE,
+    RAYCAST_ERROR_NO_CAMERA
+};
+
+// Zero initialized options render like the command line defaults
+struct raycast_options {
+    float exposure;         // in stops
+    float gamma;            // encode with a 1 / gamma curve when non-zero
+    int srgb;               // encode with the sRGB curve, overrides gamma
+    int deferred;           // shade from a G-buffer, one light at a time
+    uint32_t deadline_ms;   // lower the quality to finish in time when non-zero
+};
+
+// Parses a scene from CSV text, *scene is only set on success
+RAYCAST_API int raycast_scene_load_memory(const char *csv, size_t size, raycast_scene **scene);
+RAYCAST_API int raycast_scene_load_file(const char *path, raycast_scene **scene);
+RAYCAST_API void raycast_scene_free(raycast_scene *scene);
+
+// Renders into rgb, which holds width * height packed 8 bit r, g, b
+// triples in row major order. options may be NULL.
+RAYCAST_API int raycast_render(const raycast_scene *scene, uint32_t width, uint32_t height,
+                               const struct raycast_options *options, uint8_t *rgb);
+
+RAYCAST_API const char *raycast_error_string(int error);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "bvh.h"
+
+#include <stddef.h>
+
+/*
+ * Triangle meshes
+ * ===============
+ * Meshes are stored in a binary file that is mapped straight into memory,
+ * so nothing is parsed when a scene is loaded. All values are little
+ * endian: a struct mesh_header, then num_vertices x, y, z float triples,
+ * then num_triangles triples of u32 vertex indices. scripts/obj2mesh.py
+ * converts Wavefront OBJ files to this format.
+ */
+#define MESH_MAGIC      0x4853454d  // "MESH"
+#define MESH_VERSION    1
+#define MESH_MAX_PATH   256
+
+struct mesh_header {
+    u32 magic;
+    u32 version;
+    u32 num_vertices;
+    u32 num_triangles;
+};
+
+struct mesh {
+    char path[MESH_MAX_PATH];
+    // Read only views into the mapped file
+    const float *vertices;
+    const u32 *indices;
+    u32 num_vertices;
+    u32 num_triangles;
+    // Meshes are placed like instances, vertices are local to the mesh
+    v3 translation;
+    u32 material;
+    // Mesh space bounds and the hierarchy over its triangles
+    struct aabb bounds;
+    struct bvh bvh;
+    void *mapping;
+    size_t mapping_size;
+};
+
+// Returned by load_mesh()
+enum mesh_status {
+    MESH_SUCCESS,
+    MESH_CANT_OPEN,
+    MESH_BAD_HEADER,
+    MESH_TRUNCATED,
+    MESH_BAD_INDEX
+};
+
+// Maps mesh->path and builds its hierarchy, leaves the mesh unmapped on errors
+int load_mesh(struct mesh *mesh);
+void unload_mesh(struct mesh *mesh);
+
+static inline v3 mesh_vertex(struct mesh *mesh, u32 index)
+{
+    const float *vertex = &mesh->vertices[3 * index];
+    v3 result = {vertex[0], vertex[1], vertex[2]};
+    return result;
+}
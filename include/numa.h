@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * NUMA placement
+ * ==============
+ * Linux places a page on the node of the thread that first touches it, so
+ * memory ends up local to a thread by having that thread (pinned to a CPU
+ * of the node) be the first to write it. The topology is read from sysfs,
+ * which avoids depending on libnuma. Without sysfs every CPU is on node 0.
+ */
+#define MAX_NUMA_NODES  64
+
+// Transparent huge pages are only requested for buffers at least this big
+#define HUGE_PAGE_SIZE  (2u << 20)
+
+struct cpu_topology {
+    // CPUs the process may run on, and the node of each
+    u32 *cpus;
+    u32 *nodes;
+    u32 num_cpus;
+    // Highest node number plus one
+    u32 num_nodes;
+};
+
+void read_topology(struct cpu_topology *topology);
+void free_topology(struct cpu_topology *topology);
+// Restricts the calling thread to one CPU, false if it isn't allowed
+bool pin_thread(u32 cpu);
+// Asks for transparent huge pages over the 2 MB aligned part of a buffer,
+// which only has an effect before the buffer is first touched
+void advise_huge_pages(void *memory, size_t size);
+// Copies the scene onto every node with CPUs, through a thread pinned to
+// that node, when there is more than one. Returns the number of nodes the
+// scene is on, leaving NULL in replicas for nodes that didn't get a copy.
+u32 replicate_scene(struct scene *scene, struct cpu_topology *topology, bool huge_pages,
+                    struct scene **replicas);
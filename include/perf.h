@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ppmrw.h"
+
+#include <stdbool.h>
+
+/*
+ * Hardware cache counters
+ * =======================
+ * Thin wrapper around perf_event_open(2) counting the cache misses and
+ * branches of the calling thread and of the threads it starts (which only
+ * add theirs when they exit). L2 misses are counted as last level cache
+ * accesses, which is what reaches the LLC after missing the private caches.
+ */
+enum perf_counter {
+    PERF_L1D_MISSES,
+    PERF_L2_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_NUM_COUNTERS
+};
+
+struct perf_counters {
+    int fds[PERF_NUM_COUNTERS];
+};
+
+// Opens and starts the counters, false when the kernel doesn't allow them
+// (missing support or a too strict perf_event_paranoid)
+bool perf_start(struct perf_counters *counters);
+// Stops and closes the counters, leaving their values in counts
+void perf_stop(struct perf_counters *counters, u64 counts[PERF_NUM_COUNTERS]);
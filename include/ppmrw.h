@@ -36,7 +36,8 @@ enum status_code {
     INVALID_FORMAT,
     INVALID_WIDTH,
     INVALID_HEIGHT,
-    INVALID_MAXVAL
+    INVALID_MAXVAL,
+    INVALID_PIXELS
 };
 
 /*
@@ -58,6 +59,11 @@ struct ppm_pixmap {
     u32 width, height;
     u32 maxval;             // 0 to bits_per_channel for RGB
     pixel *pixmap;          // NOTE: allocated during init, so needs to be freed
+
+    // Set when the pixmap is a crop of a larger image. The crop's position
+    // travels in a "# region x y full_width full_height" header comment.
+    u32 x_offset, y_offset;
+    u32 full_width, full_height;
 };
 
 struct file_contents {
@@ -72,7 +78,9 @@ struct file_contents {
  */
 struct file_contents get_file_contents(FILE *fh);
 int init_ppm_pixmap(struct ppm_pixmap *pm, struct file_contents *fc);
+void handle_init_error_code(int error_code);
 void write_ppm_header(struct ppm_pixmap pm, FILE *fh, u32 fmt);
 void write_p3_pixmap(struct ppm_pixmap pm, FILE *fh);
 void write_p6_pixmap(struct ppm_pixmap pm, FILE *fh);
+void write_p6_rows(struct ppm_pixmap pm, FILE *fh, u32 y0, u32 y1);
 
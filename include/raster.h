@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Rasterized primary visibility
+ * =============================
+ * Instead of testing every object for every primary ray, the screen space
+ * bounds of each sphere and instance are splatted into per tile candidate
+ * lists. Primary rays then only test their tile's candidates plus the
+ * planes, which have no finite bounds. Shadow rays still see everything.
+ *
+ * The lists can also be built the other way around, by culling every
+ * object against the frustum of each tile.
+ */
+
+// Candidate ids are sphere indices, or instance indices with this bit set
+#define CANDIDATE_INSTANCE 0x80000000u
+
+// Candidate lists of all tiles, stored back to back. The candidates of a
+// tile are ids[offsets[tile]] up to ids[offsets[tile + 1]].
+struct tile_candidates {
+    u32 *offsets;
+    u32 *ids;
+};
+
+// Conservative pixel bounds (x1, y1 exclusive) of a bounding sphere as seen
+// by the primary rays. Returns false when no primary ray can reach it.
+bool project_volume(v3 center, double radius, struct camera camera, struct pixmap image,
+                    struct tile_rect *pixels);
+
+void rasterize_candidates(struct scene *scene, struct pixmap image,
+                          struct tile_candidates *candidates);
+// Builds the same lists by testing every object against the side planes of
+// every tile's frustum
+void cull_candidates(struct scene *scene, struct pixmap image,
+                     struct tile_candidates *candidates);
+void free_candidates(struct tile_candidates *candidates);
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "3dmath.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "tonemap.h"
+
+#define MAX_NAME_LEN 32
 
 typedef struct color3f color3f;
 struct color3f {
@@ -20,38 +25,309 @@ struct light {
     double ang_a0;
 };
 
-struct sphere {
+// Surface properties shared by every primitive that references them.
+// Identical materials are stored once in the scene's material table.
+struct material {
     color3f color;
     color3f diffuse;
     color3f specular;
-    v3 pos;
-    double rad;
     float reflectivity;
     float refractivity;
     float ior;
 };
 
+struct sphere {
+    v3 pos;
+    double rad;
+    u32 material;
+};
+
 struct plane {
-    color3f color;
-    color3f diffuse;
-    color3f specular;
     v3 pos, norm;
-    float reflectivity;
-    float refractivity;
-    float ior;
+    u32 material;
 };
 
 struct camera {
     double width, height;
 };
 
+// A named set of spheres that is stored once and placed by instances.
+// Sphere positions are local to the group.
+struct group {
+    char name[MAX_NAME_LEN];
+    struct sphere *spheres;
+    u32 num_spheres;
+    struct aabb bounds;
+    struct bvh bvh;
+};
+
+struct instance {
+    v3 translation;
+    u32 group;
+};
+
+static inline struct aabb sphere_bounds(struct sphere *sphere)
+{
+    struct aabb result = {
+        {sphere->pos.x - sphere->rad, sphere->pos.y - sphere->rad, sphere->pos.z - sphere->rad},
+        {sphere->pos.x + sphere->rad, sphere->pos.y + sphere->rad, sphere->pos.z + sphere->rad}
+    };
+    return result;
+}
+
+// Out of core particle sets, see cloud.h
+struct cloud;
+struct cloud_cache;
+
 struct scene {
+    struct material *materials;
     struct light *lights;
     struct sphere *spheres;
     struct plane *planes;
     struct camera *cameras;
+    struct group *groups;
+    struct instance *instances;
+    struct mesh *meshes;
+    struct cloud *clouds;
+    // Pages of the clouds' clusters, NULL without clouds
+    struct cloud_cache *cloud_cache;
+    // Top level hierarchy over the world space bounds of the instances
+    struct bvh instance_bvh;
+    u32 num_materials;
     u32 num_lights;
     u32 num_spheres;
     u32 num_planes;
     u32 num_cameras;
+    u32 num_groups;
+    u32 num_instances;
+    u32 num_meshes;
+    u32 num_clouds;
+};
+
+// Nearest hit of a ray, t is 0 when nothing was hit
+struct intersect_data {
+    double t;
+    v3 point;
+    v3 normal;
+    u32 material;
 };
+
+static inline v3 get_intersection_point(v3 ro, v3 rd, double t)
+{
+    v3 result = {0};
+    result.x = ro.x + rd.x*t;
+    result.y = ro.y + rd.y*t;
+    result.z = ro.z + rd.z*t;
+    return result;
+}
+
+// Shadow rays start this far along the normal from their hit, so that they
+// don't hit the surface they leave
+#define SHADOW_OFFSET 0.1
+
+static inline v3 apply_epsilon(struct intersect_data intersect)
+{
+    v3 result = {0};
+    v3 epsilon = {0};
+    v3_scale(&epsilon, intersect.normal, SHADOW_OFFSET);
+    v3_add(&result, intersect.point, epsilon);
+    return result;
+}
+
+// Direction of the primary ray through the center of pixel (i, j). Primary
+// rays start at the origin and pass through an image plane at z = -1 that
+// spans the camera's width and height.
+static inline v3 primary_ray(struct camera camera, struct pixmap image, int i, int j)
+{
+    double pixel_width = camera.width / image.width;
+    double pixel_height = camera.height / image.height;
+    double focal_point = -1;
+
+    v3 center = {0, 0, focal_point};
+    v3 p = {0};
+    v3 rd = {0};
+
+    p.x = center.x - camera.width*0.5 + pixel_width * (j + 0.5);
+    // Make the +Y axis be "up" by negating it
+    p.y = -(center.y - camera.height*0.5 + pixel_height * (i + 0.5));
+    p.z = center.z;
+    v3_normalize(&rd, p);
+    return rd;
+}
+
+/*
+ * Tiles
+ * =====
+ * The image is rendered in square tiles, numbered in row major order.
+ */
+#define TILE_SIZE 32
+
+static inline u32 tiles_across(struct pixmap image)
+{
+    return (image.width + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static inline u32 num_tiles(struct pixmap image)
+{
+    return tiles_across(image) * ((image.height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+// Pixel bounds of a tile, x1 and y1 are exclusive
+struct tile_rect {
+    int x0, y0, x1, y1;
+};
+
+static inline struct tile_rect get_tile_rect(struct pixmap image, u32 tile)
+{
+    struct tile_rect result = {0};
+    result.x0 = (tile % tiles_across(image)) * TILE_SIZE;
+    result.y0 = (tile / tiles_across(image)) * TILE_SIZE;
+    result.x1 = result.x0 + TILE_SIZE < image.width ? result.x0 + TILE_SIZE : image.width;
+    result.y1 = result.y0 + TILE_SIZE < image.height ? result.y0 + TILE_SIZE : image.height;
+    return result;
+}
+
+// How the nearest hit of each primary ray is found
+enum primary_visibility {
+    PRIMARY_TRACE,
+    // Test only the objects whose projected bounds cover the tile
+    PRIMARY_RASTER,
+    // Test only the objects overlapping the frustum of the tile
+    PRIMARY_FRUSTUM
+};
+
+// Order tiles, and pixels inside a tile, are rendered in (see traversal.h)
+enum traversal_order {
+    ORDER_SCANLINE,
+    ORDER_MORTON,
+    ORDER_HILBERT
+};
+
+/*
+ * Shading kernels
+ * ===============
+ * The tile renderers are compiled once per combination of the scene
+ * features below, with the checks for absent features folded away, and
+ * render_scene() picks the matching variant once per render.
+ */
+enum scene_features {
+    // Some light has a cone (theta), so angular attenuation applies
+    FEATURE_SPOTLIGHTS = 1 << 0,
+    // Some material has a specular color
+    FEATURE_SPECULAR = 1 << 1,
+    FEATURE_PLANES = 1 << 2,
+    FEATURES_ALL = (1 << 3) - 1
+};
+
+// Counters filled in by render_scene() when render_options.stats is set
+struct render_stats {
+    u32 tiles;
+    // Spheres and instances the primary rays of each rendered tile would
+    // test without culling, and after culling, summed over the tiles
+    u64 objects;
+    u64 candidates;
+    // Shadow rays traced, how many were blocked and how many of those the
+    // occluder cache answered
+    u64 shadow_rays;
+    u64 shadow_rays_blocked;
+    u64 shadow_cache_hits;
+    // Indexed by enum perf_counter, only valid with have_cache_misses
+    u64 cache_misses[3];
+    // Branches retired and mispredicted, with the same validity
+    u64 branches;
+    u64 branch_misses;
+    bool have_cache_misses;
+    // Feature set of the shading kernel that rendered the image
+    u32 kernel;
+    // Threads that rendered tiles, and the NUMA nodes the scene was on
+    u32 threads;
+    u32 numa_nodes;
+    // Tiles copied from the tile cache instead of being rendered
+    u32 cached_tiles;
+    // Cloud clusters read from disk and found resident during the render,
+    // and the most memory their pages took (see cloud.h)
+    u64 cluster_page_ins;
+    u64 cluster_page_hits;
+    u64 cluster_bytes_read;
+    u64 cluster_peak_bytes;
+    u64 cluster_budget;
+    // Quality level picked for a deadline (see deadline.h), and the time
+    // it was estimated to take
+    u32 quality_level;
+    double estimated_seconds;
+    double seconds;
+};
+
+// What one pixel cost to render, recorded by render_scene() when
+// render_options.cost is set
+#define COST_MISS 0xffffffff
+
+struct pixel_cost {
+    // Time stamp counter ticks (nanoseconds where there is none)
+    u64 cycles;
+    u32 shadow_rays;
+    // Material of the primary hit, COST_MISS when the ray hit nothing
+    u32 material;
+};
+
+struct tile_cache;
+
+// Settings chosen on the command line that change how a scene is rendered
+struct render_options {
+    bool deferred;
+    bool wavefront;
+    enum primary_visibility primary;
+    enum traversal_order order;
+    // Use the kernel handling every feature instead of the specialized one
+    bool generic_kernel;
+    struct tonemap_options tonemap;
+    // When set, only tiles with a non-zero entry are rendered and the other
+    // pixels of the pixmap are left untouched
+    u8 *tile_mask;
+    // When non-empty, only this window of the image is rendered and the
+    // pixmap holds just the window's pixels
+    struct tile_rect region;
+    // Treat every light as visible instead of tracing shadow rays
+    bool skip_shadows;
+    // When non-zero, lower the quality as needed to finish in this time
+    u32 deadline_ms;
+    // Render tiles on this many threads, 0 or 1 renders on the caller's
+    u32 threads;
+    // Pin the threads to CPUs and give each NUMA node a copy of the scene
+    bool numa;
+    // Ask for transparent huge pages for large buffers and scene arrays
+    bool huge_pages;
+    struct render_stats *stats;
+    // When set, renders forward and records the cost of every pixel of the
+    // window here, row major. Pixels of skipped tiles cost nothing.
+    struct pixel_cost *cost;
+    // When set, called with every band of finished pixmap rows [y0, y1) in
+    // order from the top, as soon as all tiles covering it are done. Calls
+    // come from the render threads, one at a time.
+    void (*band_done)(void *user, u32 y0, u32 y1);
+    void *band_user;
+    // When set, tiles found in this cache are copied instead of rendered,
+    // and rendered tiles are added to it (see tilecache.h). Ignored when
+    // recording costs.
+    struct tile_cache *tile_cache;
+    // When non-zero, the memory the scene's cloud pages may take, in bytes
+    u64 cloud_budget;
+};
+
+// The part of the image render_scene() traces
+static inline struct tile_rect render_window(struct pixmap image, struct render_options options)
+{
+    if (options.region.x1 > options.region.x0 && options.region.y1 > options.region.y0) {
+        return options.region;
+    }
+    struct tile_rect result = {0, 0, image.width, image.height};
+    return result;
+}
+
+struct intersect_data ray_intersect(struct scene *scene, v3 ro, v3 rd);
+color3f raycast(struct scene *scene, v3 ro, v3 rd);
+bool render_scene(struct scene *scene, struct pixmap image, struct render_options options);
+void clear_scene(struct scene *scene);
+void free_scene(struct scene *scene);
+// Deep copy owning all of its memory, placed on the calling thread's node
+struct scene *copy_scene(struct scene *scene, bool huge_pages);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Scene hashing
+ * =============
+ * Content hashes and bounding spheres of the objects of a scene, shared by
+ * incremental re-rendering, which diffs two scenes by them, and the tile
+ * cache, which keys tiles by them. A hash covers everything about an
+ * object that can change pixels, so objects with equal hashes render the
+ * same wherever they are listed in the scene.
+ */
+struct volume {
+    v3 center;
+    double radius;
+};
+
+// Identifies an object by content, so reordering objects isn't a change
+struct object_key {
+    u64 hash;
+    struct volume bounds;
+};
+
+u64 hash_material(u64 hash, struct material *material);
+u64 hash_sphere(u64 hash, struct scene *scene, struct sphere *sphere);
+// Camera, lights, planes, meshes, clouds and the material misses are
+// shaded with: everything that can affect every pixel
+u64 hash_scene_globals(u64 hash, struct scene *scene);
+
+struct volume volume_from_aabb(struct aabb box);
+// Keys of the spheres followed by those of the instances, unsorted
+struct object_key *object_keys(struct scene *scene);
+
+// Grown a little, so that rounding can't make tests against the volume
+// less conservative than the renderer
+static inline double padded(double radius)
+{
+    return radius * (1 + 1e-6) + 1e-6;
+}
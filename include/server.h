@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Render daemon protocol
+ * ======================
+ * A client connects to the Unix domain socket, sends one render_request
+ * optionally followed by scene_size bytes of CSV, and reads back a
+ * render_response. On RENDER_OK the response is followed by a P6 image and
+ * the server closes the connection once it is written.
+ *
+ * Scenes are kept resident by the FNV-1a hash of their CSV contents, so a
+ * client first asks by hash alone and only uploads the CSV when the server
+ * answers RENDER_SCENE_NOT_FOUND.
+ */
+#define RENDER_REQUEST_MAGIC    0x51524352  // "RCRQ"
+#define RENDER_RESPONSE_MAGIC   0x53524352  // "RCRS"
+#define MAX_REQUEST_DIMENSION   16384
+#define MAX_REQUEST_SCENE_SIZE  (256u << 20)
+
+enum render_status {
+    RENDER_OK,
+    RENDER_SCENE_NOT_FOUND,
+    RENDER_BAD_REQUEST,
+    RENDER_BAD_SCENE,
+    RENDER_BUSY
+};
+
+struct render_request {
+    u32 magic;
+    u32 width, height;
+    u32 scene_size;         // bytes of CSV following the request, may be 0
+    u64 scene_hash;
+    // Overrides the scene's camera when both are non-zero
+    double camera_width, camera_height;
+};
+
+struct render_response {
+    u32 magic;
+    u32 status;
+};
+
+struct server_options {
+    u32 workers;            // render threads
+    u32 queue_size;         // connections waiting for a worker
+    u32 max_scenes;         // resident scenes before the least recently used is dropped
+    const char *trace_path; // written on SIGUSR1 when set
+    struct render_options render;
+};
+
+int serve(const char *socket_path, struct server_options options);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Frame splitting
+ * ===============
+ * A frame can be rendered as several crops (see --region) by independent
+ * processes and stitched back together. Every pixel only depends on its own
+ * rays, so the stitched image is identical to a single process render.
+ */
+
+// Rows per band used when estimating and balancing the cost of the image
+#define SPLIT_ROW_GRANULARITY 8
+
+// Divides the image into `count` row bands of roughly equal estimated cost,
+// returns how many regions were produced (less than count for tiny images,
+// none for empty ones)
+u32 balance_regions(struct scene *scene, struct pixmap image, u32 count,
+                    struct tile_rect *regions);
+
+// Renders each region in a worker process running this binary with `args`
+// (the coordinator's own options) and stitches the results into image
+bool run_region_workers(char **args, u32 num_args, const char *input, struct pixmap image,
+                        struct tile_rect *regions, u32 count);
+
+// Copies a partial image written by a --region render into its place
+bool stitch_region(struct pixmap image, const char *path);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+#include <limits.h>
+
+/*
+ * Tile cache
+ * ==========
+ * Rendered tiles are kept across runs in a directory, one file per tile,
+ * named after a key that hashes everything the tile's pixels can depend
+ * on: the renderer version, resolution, tile rectangle, camera, lights,
+ * planes, meshes, clouds, and the spheres and instances that are relevant
+ * to the tile. An object is relevant when its bounds project into the
+ * tile, or when a shadow ray leaving any surface that projects into it can
+ * pass through it. Keys are computed from bounds alone, without tracing,
+ * so unrelated edits elsewhere in the scene leave the key alone, and a
+ * tile whose key is found is copied from the cache without tracing a ray.
+ *
+ * Files hold the linear HDR colors of the tile, so tonemapping options
+ * don't affect the cache. Hits refresh the file's modification time, and
+ * once the directory grows past its size limit the least recently used
+ * tiles are deleted.
+ */
+
+// Bump whenever a change to the renderer changes its pixels
+#define TILE_CACHE_VERSION      1
+#define TILE_CACHE_MAGIC        0x454c4954  // "TILE"
+#define TILE_CACHE_DEFAULT_MB   1024
+
+struct tile_cache {
+    char dir[PATH_MAX];
+    u64 max_bytes;
+};
+
+// What the keys of one render are built from, see prepare_tile_keys()
+struct tile_keys {
+    // Everything that affects every tile
+    u64 scene_hash;
+    // Spheres, then instances, with their bounding spheres
+    struct tile_object *objects;
+    u32 num_objects;
+    // Bounds of the meshes, then the clouds
+    struct tile_object *surfaces;
+    u32 num_surfaces;
+    // Farthest a shadow ray can start from its hit
+    double shadow_offset;
+    bool skip_shadows;
+};
+
+// Creates the directory if needed, false if it can't be used
+bool tile_cache_open(struct tile_cache *cache, const char *dir, u64 max_bytes);
+// Reads the tile with this key into rows of width texels, stride texels
+// apart. False on a miss, leaving the pixels in an unspecified state.
+bool tile_cache_load(struct tile_cache *cache, u64 key, float *pixels, u32 width, u32 height,
+                     u32 stride);
+void tile_cache_store(struct tile_cache *cache, u64 key, const float *pixels, u32 width,
+                      u32 height, u32 stride);
+// Deletes the least recently used tiles until the cache fits its limit
+void tile_cache_trim(struct tile_cache *cache);
+
+void prepare_tile_keys(struct tile_keys *keys, struct scene *scene, struct pixmap image,
+                       bool skip_shadows);
+// Key of the tile covering rect
+u64 tile_key(struct tile_keys *keys, struct scene *scene, struct pixmap image,
+             struct tile_rect rect);
+void free_tile_keys(struct tile_keys *keys);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ppmrw.h"
+
+/*
+ * Tonemapping
+ * ===========
+ * Converts a linear HDR buffer of interleaved r, g, b floats into 8 bit
+ * pixels: scale by the exposure, clamp to [0, 1], apply the optional
+ * transfer curve and quantize. Runs as a separate pass after tracing.
+ */
+enum transfer_curve {
+    TRANSFER_LINEAR,
+    TRANSFER_GAMMA,
+    TRANSFER_SRGB
+};
+
+struct tonemap_options {
+    float exposure;             // in stops, 0 leaves the colors untouched
+    float gamma;                // only used by TRANSFER_GAMMA
+    enum transfer_curve curve;
+};
+
+// Resolution of the lookup table used for the non-linear transfer curves
+#define CURVE_LUT_SIZE 4096
+
+// The options resolved into what the pass needs, built once per render and
+// shared read only by every tonemap() call of it
+struct tonemap_curve {
+    float scale;
+    bool linear;
+    u8 lut[CURVE_LUT_SIZE];
+};
+
+void tonemap_prepare(struct tonemap_curve *curve, struct tonemap_options options);
+void tonemap(float *hdr, pixel *pixels, u32 num_pixels, const struct tonemap_curve *curve);
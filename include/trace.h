@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ppmrw.h"
+
+#include <stdbool.h>
+
+/*
+ * Span tracing
+ * ============
+ * Records named begin/end spans (scene loading, parsing, acceleration
+ * builds, tiles, image writes) and writes them out as Chrome trace_event
+ * JSON, which chrome://tracing and ui.perfetto.dev open directly.
+ *
+ * Every thread records into its own ring buffer, allocated on its first
+ * span, so recording takes no locks. A full buffer overwrites its oldest
+ * spans, which bounds memory at TRACE_BUFFER_SPANS spans per thread and
+ * makes it safe to leave tracing on in a long running daemon. While
+ * tracing is off a span costs a single branch.
+ */
+#define TRACE_BUFFER_SPANS  16384
+#define TRACE_NO_ARG        0xffffffff
+
+extern bool trace_enabled;
+
+// Turns recording on, timestamps are relative to this call
+void trace_start(void);
+// Nanoseconds since trace_start(), never 0
+u64 trace_now(void);
+// Records a span from start (a trace_begin() value) to now, with an
+// optional numeric argument shown as arg_name
+void trace_record(const char *name, const char *arg_name, u32 arg, u64 start);
+// Writes every thread's spans to path, false if it can't be written
+bool trace_write(const char *path);
+
+static inline u64 trace_begin(void)
+{
+    return trace_enabled ? trace_now() : 0;
+}
+
+// Names must be string literals, only the pointer is kept
+static inline void trace_end(const char *name, u64 start)
+{
+    if (start) {
+        trace_record(name, NULL, TRACE_NO_ARG, start);
+    }
+}
+
+static inline void trace_end_arg(const char *name, const char *arg_name, u32 arg, u64 start)
+{
+    if (start) {
+        trace_record(name, arg_name, arg, start);
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ppmrw.h"
+#include "raycast.h"
+
+/*
+ * Traversal orders
+ * ================
+ * The order tiles are rendered in, and the order pixels are visited inside
+ * a tile. Space filling curves keep consecutive rays close together on
+ * screen, so they keep hitting the same objects and BVH nodes. Results are
+ * still written to the row major pixmap.
+ */
+struct traversal {
+    // Tile indices in rendering order
+    u32 *tiles;
+    u32 num_tiles;
+    // Pixel offsets from the corner of a tile in visiting order
+    u8 pixel_x[TILE_SIZE * TILE_SIZE];
+    u8 pixel_y[TILE_SIZE * TILE_SIZE];
+};
+
+void init_traversal(struct traversal *traversal, struct pixmap image, enum traversal_order order);
+void free_traversal(struct traversal *traversal);
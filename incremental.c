@@ -0,0 +1,173 @@
+#include "incremental.h"
+#include "hash.h"
+#include "raster.h"
+#include "scenehash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Incremental re-rendering
+ * ========================
+ * The two scenes are diffed as multisets of objects: anything present in
+ * only one of them was added, removed or moved, and contributes a bounding
+ * sphere to the list of changed volumes. A pixel can only change if its
+ * primary ray or one of its shadow rays passes through a changed volume,
+ * since everything else it depends on is identical in both scenes.
+ */
+struct volume_list {
+    struct volume *volumes;
+    u32 count;
+};
+
+static int compare_keys(const void *a, const void *b)
+{
+    u64 ha = ((struct object_key *)a)->hash;
+    u64 hb = ((struct object_key *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// Keys of the spheres and instances, sorted by hash
+static struct object_key *sorted_keys(struct scene *scene, u32 *count)
+{
+    struct object_key *keys = object_keys(scene);
+    *count = scene->num_spheres + scene->num_instances;
+    qsort(keys, *count, sizeof(struct object_key), compare_keys);
+    return keys;
+}
+
+static void add_volume(struct volume_list *list, struct volume volume)
+{
+    if (list->count < MAX_CHANGED_VOLUMES) {
+        list->volumes[list->count] = volume;
+    }
+    list->count++;
+}
+
+// Walks two sorted key arrays and records every key that isn't in both
+static void diff_keys(struct volume_list *list, struct object_key *old_keys, u32 old_count,
+                      struct object_key *new_keys, u32 new_count)
+{
+    u32 i = 0;
+    u32 j = 0;
+    while (i < old_count || j < new_count) {
+        if (j == new_count || (i < old_count && old_keys[i].hash < new_keys[j].hash)) {
+            add_volume(list, old_keys[i++].bounds);
+        } else if (i == old_count || new_keys[j].hash < old_keys[i].hash) {
+            add_volume(list, new_keys[j++].bounds);
+        } else {
+            i++;
+            j++;
+        }
+    }
+}
+
+// Camera, lights, planes, meshes and clouds affect every pixel, so they
+// must be identical
+static bool globals_equal(struct scene *a, struct scene *b)
+{
+    return a->num_cameras && b->num_cameras &&
+           hash_scene_globals(FNV_OFFSET_BASIS, a) == hash_scene_globals(FNV_OFFSET_BASIS, b);
+}
+
+// Any positive hit of the ray with the sphere, slightly enlarged so that
+// rounding can't make the test less conservative than the renderer
+static inline bool ray_hits_volume(struct volume *volume, v3 ro, v3 rd)
+{
+    double radius = padded(volume->radius);
+    v3 oc;
+    v3_sub(&oc, ro, volume->center);
+
+    double b = v3_dot(oc, rd);
+    double c = v3_dot(oc, oc) - radius * radius;
+    double disc = b * b - c;
+    return disc >= 0 && -b + sqrt(disc) > 0;
+}
+
+// Marks every tile the projection of the volume can touch
+static void mark_primary_footprint(struct volume *volume, struct camera camera,
+                                   struct pixmap image, u8 *dirty)
+{
+    u32 across = tiles_across(image);
+    struct tile_rect pixels;
+
+    if (!project_volume(volume->center, volume->radius, camera, image, &pixels)) {
+        return;
+    }
+
+    for (int ty = pixels.y0 / TILE_SIZE; ty <= (pixels.y1 - 1) / TILE_SIZE; ty++) {
+        for (int tx = pixels.x0 / TILE_SIZE; tx <= (pixels.x1 - 1) / TILE_SIZE; tx++) {
+            dirty[ty * across + tx] = 1;
+        }
+    }
+}
+
+// Traces the tile's primary rays and checks whether any shadow ray they
+// spawn can pass through a changed volume
+static bool shadows_changed(struct scene *scene, struct volume_list *list,
+                            struct pixmap image, struct tile_rect rect)
+{
+    struct camera camera = scene->cameras[0];
+    v3 ro = {0};
+
+    for (int i = rect.y0; i < rect.y1; i++) {
+        for (int j = rect.x0; j < rect.x1; j++) {
+            struct intersect_data hit = ray_intersect(scene, ro, primary_ray(camera, image, i, j));
+            v3 origin = apply_epsilon(hit);
+
+            for (u32 l = 0; l < scene->num_lights; l++) {
+                v3 light_ray;
+                v3_sub(&light_ray, scene->lights[l].pos, hit.point);
+                v3_normalize(&light_ray, light_ray);
+                for (u32 v = 0; v < list->count; v++) {
+                    if (ray_hits_volume(&list->volumes[v], origin, light_ray)) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+u32 find_dirty_tiles(struct scene *old_scene, struct scene *new_scene,
+                     struct pixmap image, u8 *dirty)
+{
+    u32 count = num_tiles(image);
+    struct volume_list list = {0};
+    list.volumes = malloc(sizeof(struct volume) * MAX_CHANGED_VOLUMES);
+
+    if (globals_equal(old_scene, new_scene)) {
+        u32 old_count, new_count;
+        struct object_key *old_keys = sorted_keys(old_scene, &old_count);
+        struct object_key *new_keys = sorted_keys(new_scene, &new_count);
+        diff_keys(&list, old_keys, old_count, new_keys, new_count);
+        free(old_keys);
+        free(new_keys);
+    } else {
+        list.count = MAX_CHANGED_VOLUMES + 1;
+    }
+
+    if (list.count > MAX_CHANGED_VOLUMES) {
+        memset(dirty, 1, count);
+        free(list.volumes);
+        return count;
+    }
+
+    memset(dirty, 0, count);
+    for (u32 v = 0; v < list.count; v++) {
+        mark_primary_footprint(&list.volumes[v], new_scene->cameras[0], image, dirty);
+    }
+
+    u32 num_dirty = 0;
+    for (u32 tile = 0; tile < count; tile++) {
+        if (!dirty[tile] && list.count &&
+            shadows_changed(new_scene, &list, image, get_tile_rect(image, tile))) {
+            dirty[tile] = 1;
+        }
+        num_dirty += dirty[tile];
+    }
+
+    free(list.volumes);
+    return num_dirty;
+}
@@ -0,0 +1,510 @@
+/*
+ * Correctness and speed harness for the math and intersection kernels the
+ * renderer inlines everywhere (3dmath.h, intersect.h) and for tonemap().
+ * Every kernel runs on the same randomized inputs, shaped like the rays
+ * and objects of a render, and is compared against a long double
+ * reference. Errors are measured in units in the last place of the error
+ * scale of the computation: the largest magnitude it goes through, grown
+ * by the condition of the formula where it divides by a small quantity
+ * (the root of a grazing ray's discriminant, a plane seen edge on). The
+ * rounding any double implementation of the formula makes isn't mistaken
+ * for a bug that way, while a faster variant still has to do as well as
+ * the current one. Results within rounding distance of one of the
+ * kernel's thresholds (a ray grazing a sphere, a hit at t = 0) may go
+ * either way and are only counted.
+ *
+ *   raycast-kernels [seed]
+ *
+ * Exits with a failure when some kernel is outside its tolerance, so the
+ * harness can gate a faster replacement of any of them.
+ */
+
+#include "ppmrw.h"
+#include "raycast.h"
+#include "intersect.h"
+#include "tonemap.h"
+
+#include <stdlib.h>
+#include <float.h>
+#include <time.h>
+
+#define NUM_INPUTS      4096
+// Passes over the inputs per timing run, and runs of which the best counts
+#define TIMED_PASSES    256
+#define TIMING_RUNS     5
+// How close to a threshold, in machine epsilons of the operands, a result
+// has to be to count as borderline
+#define BORDERLINE_EPS  64
+
+struct inputs {
+    // Arbitrary vectors spanning six decades of magnitude
+    v3 a[NUM_INPUTS];
+    v3 b[NUM_INPUTS];
+    v3 normals[NUM_INPUTS];
+    // Ray origins and unit directions
+    v3 ro[NUM_INPUTS];
+    v3 rd[NUM_INPUTS];
+    struct sphere spheres[NUM_INPUTS];
+    struct plane planes[NUM_INPUTS];
+    float hdr[3 * NUM_INPUTS];
+    pixel pixels[NUM_INPUTS];
+};
+
+struct check {
+    double max_error;
+    u32 failures;
+    u32 borderline;
+};
+
+struct kernel {
+    const char *name;
+    const char *variant;
+    double tolerance;
+    const char *unit;
+    void (*check)(struct check *result, double tolerance);
+    // One pass over the inputs, returning something that depends on every
+    // result so the work can't be optimized away
+    double (*run)(void);
+};
+
+static struct inputs in;
+static u64 rng_state;
+static volatile double sink;
+
+/* ---- Inputs ---- */
+
+// xorshift64*
+static u64 next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double uniform(double min, double max)
+{
+    return min + (max - min) * (next_random() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static v3 random_unit(void)
+{
+    v3 result;
+    double length;
+    do {
+        result = (v3){uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)};
+        length = v3_magnitude(result);
+    } while (length < 1e-3 || length > 1);
+    v3_scale(&result, result, 1 / length);
+    return result;
+}
+
+static v3 random_point(double extent)
+{
+    return (v3){uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent)};
+}
+
+static void generate_inputs(void)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3_scale(&in.a[i], random_unit(), pow(10, uniform(-3, 3)));
+        v3_scale(&in.b[i], random_unit(), pow(10, uniform(-3, 3)));
+        in.normals[i] = random_unit();
+
+        // A quarter of the rays leave a surface the way shadow rays do,
+        // 0.1 away from the sphere they're tested against, half aim at the
+        // sphere and the rest go anywhere
+        struct sphere *sphere = &in.spheres[i];
+        sphere->pos = random_point(20);
+        sphere->rad = uniform(0.1, 4);
+        in.ro[i] = random_point(5);
+        u32 kind = next_random() % 4;
+        if (kind == 0) {
+            v3 offset;
+            v3_scale(&offset, random_unit(), sphere->rad + 0.1);
+            v3_add(&in.ro[i], sphere->pos, offset);
+            in.rd[i] = random_unit();
+        } else if (kind <= 2) {
+            v3 target = random_point(1.5 * sphere->rad);
+            v3_add(&target, target, sphere->pos);
+            v3_sub(&target, target, in.ro[i]);
+            v3_normalize(&in.rd[i], target);
+        } else {
+            in.rd[i] = random_unit();
+        }
+
+        in.planes[i].pos = random_point(10);
+        in.planes[i].norm = random_unit();
+    }
+    for (u32 i = 0; i < 3 * NUM_INPUTS; i++) {
+        in.hdr[i] = uniform(-0.25, 1.25);
+    }
+}
+
+/* ---- Error measurement ---- */
+
+static double ulp(long double x)
+{
+    x = fabsl(x);
+    return x < DBL_MIN ? DBL_MIN * DBL_EPSILON : ldexp(1, ilogbl(x) - (DBL_MANT_DIG - 1));
+}
+
+static void record(struct check *result, double error, double tolerance)
+{
+    if (error > result->max_error) {
+        result->max_error = error;
+    }
+    if (error > tolerance) {
+        result->failures++;
+    }
+}
+
+// Largest component error of a vector result, in ulps of scale
+static double vector_error(v3 result, long double x, long double y, long double z,
+                           long double scale)
+{
+    double error = fabsl(result.x - x);
+    error = fmax(error, fabsl(result.y - y));
+    error = fmax(error, fabsl(result.z - z));
+    return error / ulp(scale);
+}
+
+static long double magnitude_reference(v3 vec)
+{
+    return sqrtl((long double)vec.x * vec.x + (long double)vec.y * vec.y +
+                 (long double)vec.z * vec.z);
+}
+
+// Compares distances of hit tests, where a miss is -1 on both sides
+static void record_distance(struct check *result, double t, long double reference,
+                            long double scale, bool borderline, double tolerance)
+{
+    if ((t < 0) != (reference < 0)) {
+        if (borderline) {
+            result->borderline++;
+        } else {
+            result->failures++;
+        }
+    } else if (reference >= 0) {
+        record(result, fabsl(t - reference) / ulp(scale), tolerance);
+    }
+}
+
+/* ---- Vector kernels ---- */
+
+static void check_normalize(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 vec = in.a[i];
+        v3 normalized;
+        v3_normalize(&normalized, vec);
+        long double length = magnitude_reference(vec);
+        record(result, vector_error(normalized, vec.x / length, vec.y / length, vec.z / length, 1),
+               tolerance);
+    }
+}
+
+static double run_normalize(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 normalized;
+        v3_normalize(&normalized, in.a[i]);
+        sum += normalized.x;
+    }
+    return sum;
+}
+
+static void check_reflection(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 vec = in.a[i];
+        v3 n = in.normals[i];
+        v3 reflected;
+        v3_reflection(&reflected, vec, n);
+        long double d = (long double)vec.x * n.x + (long double)vec.y * n.y +
+                        (long double)vec.z * n.z;
+        record(result, vector_error(reflected, vec.x - 2 * d * n.x, vec.y - 2 * d * n.y,
+                                    vec.z - 2 * d * n.z, magnitude_reference(vec)),
+               tolerance);
+    }
+}
+
+static double run_reflection(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 reflected;
+        v3_reflection(&reflected, in.a[i], in.normals[i]);
+        sum += reflected.x;
+    }
+    return sum;
+}
+
+static void check_dot(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 a = in.a[i];
+        v3 b = in.b[i];
+        long double reference = (long double)a.x * b.x + (long double)a.y * b.y +
+                                (long double)a.z * b.z;
+        long double scale = magnitude_reference(a) * magnitude_reference(b);
+        record(result, fabsl(v3_dot(a, b) - reference) / ulp(scale), tolerance);
+    }
+}
+
+static double run_dot(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        sum += v3_dot(in.a[i], in.b[i]);
+    }
+    return sum;
+}
+
+static void check_cross(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 a = in.a[i];
+        v3 b = in.b[i];
+        v3 cross;
+        v3_cross(&cross, a, b);
+        long double scale = magnitude_reference(a) * magnitude_reference(b);
+        record(result, vector_error(cross, (long double)a.y * b.z - (long double)a.z * b.y,
+                                    (long double)a.z * b.x - (long double)a.x * b.z,
+                                    (long double)a.x * b.y - (long double)a.y * b.x, scale),
+               tolerance);
+    }
+}
+
+static double run_cross(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        v3 cross;
+        v3_cross(&cross, in.a[i], in.b[i]);
+        sum += cross.x;
+    }
+    return sum;
+}
+
+/* ---- Intersection kernels ---- */
+
+// Same decisions as sphere_intersection_check(), in long double
+static long double sphere_reference(struct sphere *sphere, v3 ro, v3 rd, long double *scale,
+                                    bool *borderline)
+{
+    long double x = (long double)ro.x - sphere->pos.x;
+    long double y = (long double)ro.y - sphere->pos.y;
+    long double z = (long double)ro.z - sphere->pos.z;
+    long double b = 2 * (rd.x * x + rd.y * y + rd.z * z);
+    long double c = x * x + y * y + z * z - (long double)sphere->rad * sphere->rad;
+    long double disc = b * b - 4 * c;
+    long double operands = b * b + 4 * (x * x + y * y + z * z);
+
+    // Rounding disc by an epsilon of its operands moves its root by that
+    // much over twice the root
+    *scale = (fabsl(b) + sqrtl(fabsl(disc))) / 2 + operands / (4 * sqrtl(fabsl(disc)) + DBL_MIN);
+    *borderline = fabsl(disc - 0.00001L) <= BORDERLINE_EPS * DBL_EPSILON * operands;
+    if (disc < 0.00001L) {
+        return -1;
+    }
+
+    long double t0 = (-b - sqrtl(disc)) / 2;
+    long double t1 = (-b + sqrtl(disc)) / 2;
+    *borderline |= fabsl(t0) <= BORDERLINE_EPS * DBL_EPSILON * *scale ||
+                   fabsl(t1) <= BORDERLINE_EPS * DBL_EPSILON * *scale;
+    return t0 >= 0 ? t0 : t1 >= 0 ? t1 : -1;
+}
+
+static void check_sphere(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        long double scale;
+        bool borderline;
+        long double reference = sphere_reference(&in.spheres[i], in.ro[i], in.rd[i], &scale,
+                                                 &borderline);
+        double t = sphere_intersection_check(&in.spheres[i], in.ro[i], in.rd[i]);
+        record_distance(result, t, reference, scale, borderline, tolerance);
+    }
+}
+
+static double run_sphere(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        sum += sphere_intersection_check(&in.spheres[i], in.ro[i], in.rd[i]);
+    }
+    return sum;
+}
+
+// Same decisions as plane_intersection_check(), in long double
+static long double plane_reference(struct plane *plane, v3 ro, v3 rd, long double *scale,
+                                   bool *borderline)
+{
+    v3 n = plane->norm;
+    long double x = (long double)plane->pos.x - ro.x;
+    long double y = (long double)plane->pos.y - ro.y;
+    long double z = (long double)plane->pos.z - ro.z;
+    long double vo = x * n.x + y * n.y + z * n.z;
+    long double vd = (long double)n.x * rd.x + (long double)n.y * rd.y + (long double)n.z * rd.z;
+    long double distance = sqrtl(x * x + y * y + z * z);
+
+    // Both dot products round by an epsilon of their operands, and the
+    // division amplifies that by 1 / vd
+    *scale = fabsl(vd) > 0 ? distance / (vd * vd) : 1;
+    *borderline = fabsl(vd - 0.00001L) <= BORDERLINE_EPS * DBL_EPSILON ||
+                  fabsl(vo) <= BORDERLINE_EPS * DBL_EPSILON * distance;
+    if (vd > 0.00001L) {
+        return -1;
+    }
+    long double t = vo / vd;
+    return t >= 0 ? t : -1;
+}
+
+static void check_plane(struct check *result, double tolerance)
+{
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        long double scale;
+        bool borderline;
+        long double reference = plane_reference(&in.planes[i], in.ro[i], in.rd[i], &scale,
+                                                &borderline);
+        double t = plane_intersection_check(&in.planes[i], in.ro[i], in.rd[i]);
+        record_distance(result, t, reference, scale, borderline, tolerance);
+    }
+}
+
+static double run_plane(void)
+{
+    double sum = 0;
+    for (u32 i = 0; i < NUM_INPUTS; i++) {
+        sum += plane_intersection_check(&in.planes[i], in.ro[i], in.rd[i]);
+    }
+    return sum;
+}
+
+/* ---- Tonemapping ---- */
+
+// Errors are in 8 bit levels. The reference quantizes exactly, borderline
+// channels are those whose scaled value lies within float rounding of a
+// level boundary.
+static void check_tonemap_curve(struct check *result, double tolerance,
+                                enum transfer_curve curve)
+{
+    struct tonemap_options options = {0, 2.2f, curve};
+    struct tonemap_curve prepared;
+    tonemap_prepare(&prepared, options);
+    // One pixel short, so the scalar tail of a SIMD path is checked too
+    u32 count = NUM_INPUTS - 1;
+    tonemap(in.hdr, in.pixels, count, &prepared);
+
+    u8 *out = (u8 *)in.pixels;
+    for (u32 i = 0; i < 3 * count; i++) {
+        long double v = in.hdr[i];
+        v = v > 0 ? (v < 1 ? v : 1) : 0;
+        if (curve == TRANSFER_SRGB) {
+            v = v <= 0.0031308L ? 12.92L * v : 1.055L * powl(v, 1 / 2.4L) - 0.055L;
+        }
+        long double level = curve == TRANSFER_LINEAR ? v * 255 : v * 255 + 0.5L;
+        long double boundary = fabsl(level - roundl(level));
+        long double error = fabsl((long double)out[i] - floorl(level));
+        if (error > tolerance && boundary <= 255 * BORDERLINE_EPS * FLT_EPSILON) {
+            result->borderline++;
+        } else {
+            record(result, error, tolerance);
+        }
+    }
+}
+
+static void check_tonemap_linear(struct check *result, double tolerance)
+{
+    check_tonemap_curve(result, tolerance, TRANSFER_LINEAR);
+}
+
+static void check_tonemap_srgb(struct check *result, double tolerance)
+{
+    check_tonemap_curve(result, tolerance, TRANSFER_SRGB);
+}
+
+static double run_tonemap_linear(void)
+{
+    struct tonemap_options options = {0, 2.2f, TRANSFER_LINEAR};
+    struct tonemap_curve prepared;
+    tonemap_prepare(&prepared, options);
+    tonemap(in.hdr, in.pixels, NUM_INPUTS, &prepared);
+    return in.pixels[NUM_INPUTS - 1].r;
+}
+
+static double run_tonemap_srgb(void)
+{
+    struct tonemap_options options = {0, 2.2f, TRANSFER_SRGB};
+    struct tonemap_curve prepared;
+    tonemap_prepare(&prepared, options);
+    tonemap(in.hdr, in.pixels, NUM_INPUTS, &prepared);
+    return in.pixels[NUM_INPUTS - 1].r;
+}
+
+#ifdef __SSE2__
+#define TONEMAP_VARIANT "sse2"
+#else
+#define TONEMAP_VARIANT "scalar"
+#endif
+
+// Tolerances: a few ulps for plain arithmetic, more for the quadratic,
+// and for sRGB the error of its 4096 entry lookup table
+static const struct kernel kernels[] = {
+    {"v3_normalize", "scalar", 4, "ulp", check_normalize, run_normalize},
+    {"v3_reflection", "scalar", 8, "ulp", check_reflection, run_reflection},
+    {"v3_dot", "scalar", 4, "ulp", check_dot, run_dot},
+    {"v3_cross", "scalar", 4, "ulp", check_cross, run_cross},
+    {"sphere_intersection", "scalar", 16, "ulp", check_sphere, run_sphere},
+    {"plane_intersection", "scalar", 16, "ulp", check_plane, run_plane},
+    {"tonemap linear", TONEMAP_VARIANT, 0, "lvl", check_tonemap_linear, run_tonemap_linear},
+    {"tonemap srgb", TONEMAP_VARIANT, 2, "lvl", check_tonemap_srgb, run_tonemap_srgb},
+};
+
+// Best time of a pass over the inputs, in seconds
+static double time_kernel(const struct kernel *kernel)
+{
+    double best = INFINITY;
+    for (int run = 0; run < TIMING_RUNS; run++) {
+        struct timespec start, end;
+        double sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int pass = 0; pass < TIMED_PASSES; pass++) {
+            sum += kernel->run();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sink = sum;
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        best = fmin(best, seconds / TIMED_PASSES);
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    u64 seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 0x5eed;
+    rng_state = seed ? seed : 1;
+    generate_inputs();
+
+    printf("%u inputs per kernel, seed %llu\n", NUM_INPUTS, (unsigned long long)seed);
+    printf("%-20s %-7s %10s %10s %9s %10s %9s %9s\n", "kernel", "variant", "max error",
+           "tolerance", "failures", "borderline", "ns/op", "Mops/s");
+
+    int status = EXIT_SUCCESS;
+    for (u32 k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const struct kernel *kernel = &kernels[k];
+        struct check result = {0};
+        kernel->check(&result, kernel->tolerance);
+        double ns = time_kernel(kernel) * 1e9 / NUM_INPUTS;
+
+        printf("%-20s %-7s %6.2f %s %6.0f %s %9u %10u %9.2f %9.1f\n", kernel->name,
+               kernel->variant, result.max_error, kernel->unit, kernel->tolerance, kernel->unit,
+               result.failures, result.borderline, ns, 1e3 / ns);
+        if (result.failures) {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
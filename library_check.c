@@ -0,0 +1,71 @@
+/*
+ * Checks that libraycast reports malformed scenes as errors instead of
+ * crashing the program embedding it. Every scene below is cut short or
+ * malformed somewhere a value is expected, and has to come back as
+ * RAYCAST_ERROR_INVALID_SCENE without touching the handle. A valid scene
+ * is loaded and rendered last, to show the failures left nothing behind.
+ *
+ *   raycast-library-check
+ *
+ * Uses libraycast.h only, and exits with a failure when any check fails.
+ */
+
+#include "libraycast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *malformed_scenes[] = {
+    "camera, width: 2, height: 2\nsphere, radius: 1, position: [0",
+    "camera, width: 2, height: 2\nsphere, radius: 1, position: [0, 1",
+    "camera, width: 2, height: 2\nsphere, radius: 1, position: [",
+    "camera, width: 2, height: 2\nsphere, radius",
+    "camera, width: 2, height: 2\nsphere, diffuse_color: [1, 0",
+    "camera, width: 2, height: 2\nplane, normal: [0, 1",
+    "camera, width: 2, height: 2\nlight, color: [1, 1, 1], position: [0, 0",
+    "camera, width: 2, height: 2\nlight, theta",
+    "camera, width: 2, height: 2\ninstance, group",
+    "camera, width: 2, height: 2\ninstance, group: a, translation: [1",
+    "camera, width: 2, height: 2\nmesh, path",
+    "camera",
+    "camera, width",
+};
+
+static const char *valid_scene =
+    "camera, width: 2, height: 2\n"
+    "sphere, radius: 1, diffuse_color: [1, 0, 0], position: [0, 0, -5]\n"
+    "light, color: [1, 1, 1], theta: 0, radial-a2: 0.1, radial-a1: 0.1, radial-a0: 0.1, "
+    "position: [1, 3, -1]\n";
+
+int main(void)
+{
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(malformed_scenes) / sizeof(malformed_scenes[0]); i++) {
+        const char *csv = malformed_scenes[i];
+        raycast_scene *scene = NULL;
+        int error = raycast_scene_load_memory(csv, strlen(csv), &scene);
+        if (error != RAYCAST_ERROR_INVALID_SCENE || scene) {
+            printf("FAIL: scene %zu loaded with \"%s\"\n", i, raycast_error_string(error));
+            failures++;
+        }
+    }
+
+    raycast_scene *scene = NULL;
+    uint8_t rgb[16 * 16 * 3];
+    int error = raycast_scene_load_memory(valid_scene, strlen(valid_scene), &scene);
+    if (error == RAYCAST_OK) {
+        error = raycast_render(scene, 16, 16, NULL, rgb);
+        raycast_scene_free(scene);
+    }
+    if (error != RAYCAST_OK) {
+        printf("FAIL: valid scene failed with \"%s\"\n", raycast_error_string(error));
+        failures++;
+    }
+
+    if (failures) {
+        return EXIT_FAILURE;
+    }
+    printf("All malformed scenes were rejected\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#include "libraycast.h"
+#include "ppmrw.h"
+#include "raycast.h"
+#include "csv_parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The scene comes first so that free_scene() releases the handle too
+struct raycast_scene {
+    struct scene scene;
+};
+
+int raycast_scene_load_memory(const char *csv, size_t size, raycast_scene **scene)
+{
+    if (!csv || !scene) {
+        return RAYCAST_ERROR_INVALID_ARGUMENT;
+    }
+
+    // The parser reads from a private copy, so the caller's text is
+    // left untouched
+    struct file_contents fc = {0};
+    fc.memory = malloc(size + 1);
+    fc.size = size;
+    memcpy(fc.memory, csv, size);
+
+    raycast_scene *result = malloc(sizeof(raycast_scene));
+    int status = construct_scene(&fc, &result->scene);
+    free(fc.memory);
+    if (status != SCENE_SUCCESS) {
+        free(result);
+        return RAYCAST_ERROR_INVALID_SCENE;
+    }
+
+    *scene = result;
+    return RAYCAST_OK;
+}
+
+int raycast_scene_load_file(const char *path, raycast_scene **scene)
+{
+    if (!path || !scene) {
+        return RAYCAST_ERROR_INVALID_ARGUMENT;
+    }
+
+    FILE *input = fopen(path, "r");
+    if (!input) {
+        return RAYCAST_ERROR_IO;
+    }
+    struct file_contents fc = get_file_contents(input);
+    fclose(input);
+
+    int error = raycast_scene_load_memory(fc.memory, fc.size, scene);
+    free(fc.memory);
+    return error;
+}
+
+void raycast_scene_free(raycast_scene *scene)
+{
+    if (scene) {
+        free_scene(&scene->scene);
+    }
+}
+
+int raycast_render(const raycast_scene *scene, uint32_t width, uint32_t height,
+                   const struct raycast_options *options, uint8_t *rgb)
+{
+    if (!scene || !rgb || !width || !height || (u64)width * height > UINT32_MAX / 3) {
+        return RAYCAST_ERROR_INVALID_ARGUMENT;
+    }
+
+    struct render_options render = {0};
+    if (options) {
+        render.deferred = options->deferred;
+        render.deadline_ms = options->deadline_ms;
+        render.tonemap.exposure = options->exposure;
+        if (options->srgb) {
+            render.tonemap.curve = TRANSFER_SRGB;
+        } else if (options->gamma > 0) {
+            render.tonemap.curve = TRANSFER_GAMMA;
+            render.tonemap.gamma = options->gamma;
+        }
+    }
+
+    // Rendering only reads the scene, the copy just drops the const
+    struct scene view = scene->scene;
+    struct pixmap image = {width, height, (pixel *)rgb};
+    return render_scene(&view, image, render) ? RAYCAST_OK : RAYCAST_ERROR_NO_CAMERA;
+}
+
+const char *raycast_error_string(int error)
+{
+    switch (error) {
+        case RAYCAST_OK:
+            return "success";
+        case RAYCAST_ERROR_INVALID_ARGUMENT:
+            return "invalid argument";
+        case RAYCAST_ERROR_IO:
+            return "failed to read the scene file";
+        case RAYCAST_ERROR_INVALID_SCENE:
+            return "invalid scene";
+        case RAYCAST_ERROR_NO_CAMERA:
+            return "the scene has no camera";
+    }
+    return "unknown error";
+}
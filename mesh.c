@@ -0,0 +1,100 @@
+#include "mesh.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct aabb triangle_bounds(struct mesh *mesh, u32 triangle)
+{
+    struct aabb result = aabb_empty();
+    for (int k = 0; k < 3; k++) {
+        v3 vertex = mesh_vertex(mesh, mesh->indices[3 * triangle + k]);
+        struct aabb point = {vertex, vertex};
+        aabb_grow(&result, point);
+    }
+    return result;
+}
+
+// Checks the header and sizes against the file, then points the mesh at
+// the vertex and index arrays inside the mapping
+static int validate_mesh(struct mesh *mesh)
+{
+    const struct mesh_header *header = mesh->mapping;
+    if (header->magic != MESH_MAGIC || header->version != MESH_VERSION) {
+        return MESH_BAD_HEADER;
+    }
+
+    u64 expected = sizeof(struct mesh_header) + 3 * sizeof(float) * (u64)header->num_vertices +
+                   3 * sizeof(u32) * (u64)header->num_triangles;
+    if (mesh->mapping_size < expected) {
+        return MESH_TRUNCATED;
+    }
+
+    mesh->num_vertices = header->num_vertices;
+    mesh->num_triangles = header->num_triangles;
+    mesh->vertices = (const float *)(header + 1);
+    mesh->indices = (const u32 *)(mesh->vertices + 3 * mesh->num_vertices);
+    for (u32 i = 0; i < 3 * mesh->num_triangles; i++) {
+        if (mesh->indices[i] >= mesh->num_vertices) {
+            return MESH_BAD_INDEX;
+        }
+    }
+    return MESH_SUCCESS;
+}
+
+int load_mesh(struct mesh *mesh)
+{
+    struct stat info;
+    int fd = open(mesh->path, O_RDONLY);
+    if (fd < 0) {
+        return MESH_CANT_OPEN;
+    } else if (fstat(fd, &info) < 0) {
+        close(fd);
+        return MESH_CANT_OPEN;
+    } else if (info.st_size < (off_t)sizeof(struct mesh_header)) {
+        close(fd);
+        return MESH_BAD_HEADER;
+    }
+
+    mesh->mapping_size = info.st_size;
+    mesh->mapping = mmap(NULL, mesh->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mesh->mapping == MAP_FAILED) {
+        mesh->mapping = NULL;
+        return MESH_CANT_OPEN;
+    }
+
+    int status = validate_mesh(mesh);
+    if (status != MESH_SUCCESS) {
+        unload_mesh(mesh);
+        return status;
+    }
+
+    u64 span = trace_begin();
+    struct aabb *bounds = malloc(sizeof(struct aabb) * (mesh->num_triangles + 1));
+    mesh->bounds = aabb_empty();
+    for (u32 i = 0; i < mesh->num_triangles; i++) {
+        bounds[i] = triangle_bounds(mesh, i);
+        aabb_grow(&mesh->bounds, bounds[i]);
+    }
+    bvh_build(&mesh->bvh, bounds, mesh->num_triangles);
+    free(bounds);
+    trace_end_arg("build mesh hierarchy", "triangles", mesh->num_triangles, span);
+    return MESH_SUCCESS;
+}
+
+void unload_mesh(struct mesh *mesh)
+{
+    if (mesh->mapping) {
+        munmap(mesh->mapping, mesh->mapping_size);
+    }
+    bvh_free(&mesh->bvh);
+    mesh->mapping = NULL;
+    mesh->vertices = NULL;
+    mesh->indices = NULL;
+    mesh->num_vertices = 0;
+    mesh->num_triangles = 0;
+}
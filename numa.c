@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// Node directories are linked from each CPU's sysfs directory
+static u32 cpu_node(u32 cpu)
+{
+    char path[64];
+    for (u32 node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/node%u", cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+void read_topology(struct cpu_topology *topology)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_SET(0, &allowed);
+    }
+
+    u32 count = CPU_COUNT(&allowed);
+    topology->cpus = malloc(sizeof(u32) * count);
+    topology->nodes = malloc(sizeof(u32) * count);
+    topology->num_cpus = 0;
+    topology->num_nodes = 1;
+    for (u32 cpu = 0; cpu < CPU_SETSIZE && topology->num_cpus < count; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            u32 n = topology->num_cpus++;
+            topology->cpus[n] = cpu;
+            topology->nodes[n] = cpu_node(cpu);
+            if (topology->nodes[n] >= topology->num_nodes) {
+                topology->num_nodes = topology->nodes[n] + 1;
+            }
+        }
+    }
+}
+
+void free_topology(struct cpu_topology *topology)
+{
+    free(topology->cpus);
+    free(topology->nodes);
+}
+
+bool pin_thread(u32 cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+u32 replicate_scene(struct scene *scene, struct cpu_topology *topology, bool huge_pages,
+                    struct scene **replicas)
+{
+    for (u32 node = 0; node < MAX_NUMA_NODES; node++) {
+        replicas[node] = NULL;
+    }
+    if (topology->num_nodes < 2) {
+        return 1;
+    }
+
+    // The calling thread moves to each node in turn to make the copy
+    cpu_set_t previous;
+    pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous);
+    u32 copies = 0;
+    for (u32 n = 0; n < topology->num_cpus; n++) {
+        u32 node = topology->nodes[n];
+        if (!replicas[node] && pin_thread(topology->cpus[n])) {
+            replicas[node] = copy_scene(scene, huge_pages);
+            copies++;
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+    return copies;
+}
+
+void advise_huge_pages(void *memory, size_t size)
+{
+    uintptr_t start = ((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)memory + size) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start) {
+        madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+}
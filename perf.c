@@ -0,0 +1,67 @@
+#include "perf.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct {
+    u32 type;
+    u64 config;
+} events[PERF_NUM_COUNTERS] = {
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+static int open_counter(u32 type, u64 config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Render threads started later are counted too, once they exit
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+bool perf_start(struct perf_counters *counters)
+{
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        counters->fds[c] = open_counter(events[c].type, events[c].config);
+        if (counters->fds[c] < 0) {
+            while (c--) {
+                close(counters->fds[c]);
+            }
+            return false;
+        }
+    }
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        ioctl(counters->fds[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return true;
+}
+
+void perf_stop(struct perf_counters *counters, u64 counts[PERF_NUM_COUNTERS])
+{
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        ioctl(counters->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (read(counters->fds[c], &counts[c], sizeof(u64)) != sizeof(u64)) {
+            counts[c] = 0;
+        }
+        close(counters->fds[c]);
+    }
+}
@@ -11,6 +11,8 @@
 
 #include "ppmrw.h"
 
+#define REGION_COMMENT "# region "
+
 /*
  * Reads a file into memory and returns a struct with a pointer
  * to the memory and the file size.
@@ -65,13 +67,10 @@ static void read_comments(struct file_contents *fc)
 }
 
 /*
- * This function is a wrapper around getting an ASCII value and converting
- * it to binary. The ASCII value should be delimited by whitespace!
- *
- * IMPORTANT: this function also handles the proceeding whitespaces and comments,
- * for ease of use.
+ * Converts the ASCII value at the current offset to binary, consuming the
+ * single whitespace character that terminates it.
  */
-static int get_binary_value(struct file_contents *fc)
+static int get_ascii_value(struct file_contents *fc)
 {
     // Get the start of the string and the end of the string
     u32 start = fc->offset;
@@ -80,15 +79,29 @@ static int get_binary_value(struct file_contents *fc)
 
     // Allocate a string for the characters and copy the values from
     // memory. We also need to null terminate for atoi to work.
-    char ascii[end - start];
+    char ascii[end - start + 1];
     strncpy(ascii, fc->memory + start, end - start);
     ascii[end - start] = '\0';
 
+    return atoi(ascii);
+}
+
+/*
+ * This function is a wrapper around getting an ASCII value and converting
+ * it to binary. The ASCII value should be delimited by whitespace!
+ *
+ * IMPORTANT: this function also handles the proceeding whitespaces and comments,
+ * for ease of use.
+ */
+static int get_binary_value(struct file_contents *fc)
+{
+    int value = get_ascii_value(fc);
+
     // Get us to the next value
     read_whitespace(fc);
     read_comments(fc);
 
-    return atoi(ascii);
+    return value;
 }
 
 /*
@@ -112,17 +125,25 @@ int init_ppm_pixmap(struct ppm_pixmap *pm, struct file_contents *fc)
        return INVALID_FORMAT;
     }
 
-    u32 offset = 0;
-
     read_until_whitespace(fc);
     read_whitespace(fc);
+
+    // Crops carry their position in the first comment
+    pm->x_offset = pm->y_offset = pm->full_width = pm->full_height = 0;
+    if (fc->size - fc->offset > sizeof(REGION_COMMENT) &&
+        strncmp(&ascii_mem[fc->offset], REGION_COMMENT, sizeof(REGION_COMMENT) - 1) == 0) {
+        sscanf(&ascii_mem[fc->offset + sizeof(REGION_COMMENT) - 1], "%u %u %u %u",
+               &pm->x_offset, &pm->y_offset, &pm->full_width, &pm->full_height);
+    }
     read_comments(fc);
 
     // Parse out the width, height, and bits per channel from the header
     // NOTE: these functions account for whitespace and comments!
     s32 width = get_binary_value(fc);
     s32 height = get_binary_value(fc);
-    s32 maxval = get_binary_value(fc);
+    // Binary pixel data starts right after the single whitespace that
+    // follows maxval, so it must not be skipped like the other values
+    s32 maxval = pm->format == P6_PPM ? get_ascii_value(fc) : get_binary_value(fc);
 
     // Error checking for negative widths and heights
     // and maxval != 255
@@ -132,6 +153,9 @@ int init_ppm_pixmap(struct ppm_pixmap *pm, struct file_contents *fc)
         return INVALID_HEIGHT;
     } else if (maxval != MAX_CHANNEL_VAL) {
         return INVALID_MAXVAL;
+    } else if (pm->format == P6_PPM &&
+               fc->size - fc->offset < sizeof(struct pixel) * width * height) {
+        return INVALID_PIXELS;
     }
 
     pm->width = width;
@@ -150,7 +174,7 @@ int init_ppm_pixmap(struct ppm_pixmap *pm, struct file_contents *fc)
         }
     } else {
         // Cast the binary blob into a pixel array
-        memcpy(pm->pixmap, fc->memory + offset, sizeof(struct pixel) * width * height);
+        memcpy(pm->pixmap, fc->memory + fc->offset, sizeof(struct pixel) * width * height);
     }
 
     return INIT_SUCCESS;
@@ -160,7 +184,7 @@ int init_ppm_pixmap(struct ppm_pixmap *pm, struct file_contents *fc)
  * This function handles the error messages for the error_code
  * from the init_ppm_pixmap function.
  */
-static void handle_init_error_code(int error_code)
+void handle_init_error_code(int error_code)
 {
     switch (error_code) {
         case INVALID_FORMAT:
@@ -175,16 +199,25 @@ static void handle_init_error_code(int error_code)
         case INVALID_MAXVAL:
             fprintf(stderr, "Error: input file has an invalid bits per channel specified in header.\n");
         break;
+        case INVALID_PIXELS:
+            fprintf(stderr, "Error: input file is missing pixel data.\n");
+        break;
     }
 }
 
 /*
  * Writes the PPM header. NOTE: It takes format as a parameter,
- * so it can be extensible to formats other than P3/P6
+ * so it can be extensible to formats other than P3/P6. Crops of a larger
+ * image also get their region comment.
  */
 void write_ppm_header(struct ppm_pixmap pm, FILE *fh, u32 fmt)
 {
-    fprintf(fh, "P%d\n%d %d\n%d\n", fmt, pm.width, pm.height, pm.maxval);
+    if (pm.full_width) {
+        fprintf(fh, "P%d\n%s%d %d %d %d\n%d %d\n%d\n", fmt, REGION_COMMENT, pm.x_offset,
+                pm.y_offset, pm.full_width, pm.full_height, pm.width, pm.height, pm.maxval);
+    } else {
+        fprintf(fh, "P%d\n%d %d\n%d\n", fmt, pm.width, pm.height, pm.maxval);
+    }
 }
 
 /*
@@ -203,7 +236,16 @@ void write_p3_pixmap(struct ppm_pixmap pm, FILE *fh)
  */
 void write_p6_pixmap(struct ppm_pixmap pm, FILE *fh)
 {
-    fwrite(pm.pixmap, 1, sizeof(struct pixel) * pm.width * pm.height, fh);
+    write_p6_rows(pm, fh, 0, pm.height);
+}
+
+/*
+ * Writes rows y0 up to y1 of a P6 PPM pixmap, for streaming an image out
+ * as it's produced
+ */
+void write_p6_rows(struct ppm_pixmap pm, FILE *fh, u32 y0, u32 y1)
+{
+    fwrite(&pm.pixmap[y0 * pm.width], 1, sizeof(struct pixel) * pm.width * (y1 - y0), fh);
 }
 
 /*
@@ -0,0 +1,244 @@
+#include "raster.h"
+
+#include <stdlib.h>
+
+bool project_volume(v3 center, double radius, struct camera camera, struct pixmap image,
+                    struct tile_rect *pixels)
+{
+    // Primary rays only ever travel towards -z
+    if (center.z - radius > 0) {
+        return false;
+    }
+
+    pixels->x0 = 0;
+    pixels->y0 = 0;
+    pixels->x1 = image.width;
+    pixels->y1 = image.height;
+
+    // Volumes reaching the camera plane project unboundedly, keep the whole
+    // screen for those
+    if (center.z + radius >= -1e-6) {
+        return true;
+    }
+
+    // Project the corners of the box around the volume onto the image plane
+    // at z = -1
+    double px0 = INFINITY, px1 = -INFINITY;
+    double py0 = INFINITY, py1 = -INFINITY;
+    for (int corner = 0; corner < 8; corner++) {
+        double x = center.x + (corner & 1 ? radius : -radius);
+        double y = center.y + (corner & 2 ? radius : -radius);
+        double z = center.z + (corner & 4 ? radius : -radius);
+        px0 = fmin(px0, x / -z);
+        px1 = fmax(px1, x / -z);
+        py0 = fmin(py0, y / -z);
+        py1 = fmax(py1, y / -z);
+    }
+
+    // Invert the pixel center mapping of primary_ray(), padded by a pixel
+    double pixel_width = camera.width / image.width;
+    double pixel_height = camera.height / image.height;
+    double j0 = floor((px0 + camera.width * 0.5) / pixel_width - 0.5) - 1;
+    double j1 = ceil((px1 + camera.width * 0.5) / pixel_width - 0.5) + 1;
+    double i0 = floor((camera.height * 0.5 - py1) / pixel_height - 0.5) - 1;
+    double i1 = ceil((camera.height * 0.5 - py0) / pixel_height - 0.5) + 1;
+
+    if (j1 < 0 || i1 < 0 || j0 >= image.width || i0 >= image.height) {
+        return false;
+    }
+    pixels->x0 = j0 > 0 ? j0 : 0;
+    pixels->y0 = i0 > 0 ? i0 : 0;
+    pixels->x1 = j1 + 1 < image.width ? j1 + 1 : image.width;
+    pixels->y1 = i1 + 1 < image.height ? i1 + 1 : image.height;
+    return true;
+}
+
+// Id of the n-th object, counting spheres first and then instances
+static inline u32 candidate_id(struct scene *scene, u32 n)
+{
+    return n < scene->num_spheres ? n : (n - scene->num_spheres) | CANDIDATE_INSTANCE;
+}
+
+// Bounding sphere of candidate `id`
+static void candidate_volume(struct scene *scene, u32 id, v3 *center, double *radius)
+{
+    if (id & CANDIDATE_INSTANCE) {
+        struct instance *instance = &scene->instances[id & ~CANDIDATE_INSTANCE];
+        struct aabb box = aabb_translate(scene->groups[instance->group].bounds,
+                                         instance->translation);
+        v3 diagonal;
+        v3_add(center, box.min, box.max);
+        v3_scale(center, *center, 0.5);
+        v3_sub(&diagonal, box.max, box.min);
+        *radius = 0.5 * v3_magnitude(diagonal);
+    } else {
+        *center = scene->spheres[id].pos;
+        *radius = scene->spheres[id].rad;
+    }
+}
+
+// Tiles the screen bounds of candidate `id` overlap, false if it is off screen
+static bool candidate_tiles(struct scene *scene, struct pixmap image, u32 id,
+                            struct tile_rect *tiles)
+{
+    struct tile_rect pixels;
+    v3 center;
+    double radius;
+
+    candidate_volume(scene, id, &center, &radius);
+    if (!project_volume(center, radius, scene->cameras[0], image, &pixels)) {
+        return false;
+    }
+
+    tiles->x0 = pixels.x0 / TILE_SIZE;
+    tiles->y0 = pixels.y0 / TILE_SIZE;
+    tiles->x1 = (pixels.x1 - 1) / TILE_SIZE + 1;
+    tiles->y1 = (pixels.y1 - 1) / TILE_SIZE + 1;
+    return true;
+}
+
+/*
+ * Two passes over the objects: the first counts the candidates of every
+ * tile, the second fills them in. Objects are visited in scene order so
+ * every list keeps the order a full intersection test would use.
+ */
+void rasterize_candidates(struct scene *scene, struct pixmap image,
+                          struct tile_candidates *candidates)
+{
+    u32 count = num_tiles(image);
+    u32 across = tiles_across(image);
+    u32 num_ids = scene->num_spheres + scene->num_instances;
+    u32 *cursor = calloc(count + 1, sizeof(u32));
+
+    candidates->offsets = calloc(count + 1, sizeof(u32));
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (u32 n = 0; n < num_ids; n++) {
+            u32 id = candidate_id(scene, n);
+            struct tile_rect tiles;
+            if (!candidate_tiles(scene, image, id, &tiles)) {
+                continue;
+            }
+
+            for (int ty = tiles.y0; ty < tiles.y1; ty++) {
+                for (int tx = tiles.x0; tx < tiles.x1; tx++) {
+                    u32 tile = ty * across + tx;
+                    if (pass == 0) {
+                        candidates->offsets[tile + 1]++;
+                    } else {
+                        candidates->ids[cursor[tile]++] = id;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (u32 tile = 0; tile < count; tile++) {
+                candidates->offsets[tile + 1] += candidates->offsets[tile];
+                cursor[tile] = candidates->offsets[tile];
+            }
+            candidates->ids = malloc(sizeof(u32) * (candidates->offsets[count] + 1));
+        }
+    }
+
+    free(cursor);
+}
+
+/*
+ * The primary rays of a tile all pass through the tile's rectangle on the
+ * image plane, so they stay inside the pyramid spanned by the camera origin
+ * and that rectangle. Its four side planes go through the origin; a bounding
+ * sphere completely outside one of them can't be hit by any of the rays.
+ */
+struct tile_frustum {
+    v3 planes[4];
+};
+
+static struct tile_frustum tile_frustum(struct camera camera, struct pixmap image,
+                                        struct tile_rect rect)
+{
+    struct tile_frustum result = {0};
+    double pixel_width = camera.width / image.width;
+    double pixel_height = camera.height / image.height;
+
+    // Edges of the tile on the image plane at z = -1, see primary_ray()
+    double left = -camera.width * 0.5 + pixel_width * rect.x0;
+    double right = -camera.width * 0.5 + pixel_width * rect.x1;
+    double top = camera.height * 0.5 - pixel_height * rect.y0;
+    double bottom = camera.height * 0.5 - pixel_height * rect.y1;
+
+    // Inward facing normals, points inside have x / -z between left and
+    // right and y / -z between bottom and top
+    v3 planes[4] = {
+        {1, 0, left},
+        {-1, 0, -right},
+        {0, 1, bottom},
+        {0, -1, -top}
+    };
+    for (int p = 0; p < 4; p++) {
+        v3_normalize(&result.planes[p], planes[p]);
+    }
+    return result;
+}
+
+static inline bool frustum_overlaps(struct tile_frustum *frustum, v3 center, double radius)
+{
+    // Padded so rounding can't cull a sphere a ray would still hit
+    double padded = radius * (1 + 1e-6) + 1e-6;
+    for (int p = 0; p < 4; p++) {
+        if (v3_dot(frustum->planes[p], center) < -padded) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The candidates of every tile are appended in scene order, so the lists
+ * come out in the same layout rasterize_candidates() produces.
+ */
+void cull_candidates(struct scene *scene, struct pixmap image,
+                     struct tile_candidates *candidates)
+{
+    u32 count = num_tiles(image);
+    u32 num_ids = scene->num_spheres + scene->num_instances;
+    u32 capacity = num_ids + 1;
+    v3 *centers = malloc(sizeof(v3) * capacity);
+    double *radii = malloc(sizeof(double) * capacity);
+
+    for (u32 n = 0; n < num_ids; n++) {
+        candidate_volume(scene, candidate_id(scene, n), &centers[n], &radii[n]);
+    }
+
+    candidates->offsets = malloc(sizeof(u32) * (count + 1));
+    candidates->ids = malloc(sizeof(u32) * capacity);
+    candidates->offsets[0] = 0;
+
+    u32 used = 0;
+    for (u32 tile = 0; tile < count; tile++) {
+        struct tile_frustum frustum = tile_frustum(scene->cameras[0], image,
+                                                   get_tile_rect(image, tile));
+        for (u32 n = 0; n < num_ids; n++) {
+            if (!frustum_overlaps(&frustum, centers[n], radii[n])) {
+                continue;
+            }
+            if (used == capacity) {
+                capacity *= 2;
+                candidates->ids = realloc(candidates->ids, sizeof(u32) * capacity);
+            }
+            candidates->ids[used++] = candidate_id(scene, n);
+        }
+        candidates->offsets[tile + 1] = used;
+    }
+
+    free(centers);
+    free(radii);
+}
+
+void free_candidates(struct tile_candidates *candidates)
+{
+    free(candidates->offsets);
+    free(candidates->ids);
+    candidates->offsets = NULL;
+    candidates->ids = NULL;
+}
@@ -1,111 +1,153 @@
 #include "ppmrw.h"
 #include "raycast.h"
+#include "intersect.h"
 #include "csv_parser.h"
+#include "tonemap.h"
+#include "server.h"
+#include "incremental.h"
+#include "split.h"
+#include "raster.h"
+#include "traversal.h"
+#include "perf.h"
+#include "deadline.h"
+#include "trace.h"
+#include "heatmap.h"
+#include "numa.h"
+#include "tilecache.h"
+#include "encode.h"
+#include "cloud.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-struct intersect_data {
-    double t;
-    v3 point;
-    v3 normal;
-    color3f diffuse;
-    color3f specular;
-};
-
-// Useful message and quit function
-static void die(const char *reason, ...)
-{
-    va_list args;
-    va_start(args, reason);
-    vfprintf(stderr, reason, args);
-    fprintf(stderr, "\n");
-    va_end(args);
-    exit(EXIT_FAILURE);
-}
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-// Clean-up
-static inline void free_scene(struct scene *scene)
+// Frees everything the scene owns and leaves it empty
+void clear_scene(struct scene *scene)
 {
     free(scene->spheres);
     free(scene->planes);
     free(scene->cameras);
     free(scene->lights);
-    free(scene);
+    free(scene->materials);
+    for (u32 i = 0; i < scene->num_groups; i++) {
+        free(scene->groups[i].spheres);
+        bvh_free(&scene->groups[i].bvh);
+    }
+    free(scene->groups);
+    free(scene->instances);
+    bvh_free(&scene->instance_bvh);
+    for (u32 i = 0; i < scene->num_meshes; i++) {
+        unload_mesh(&scene->meshes[i]);
+    }
+    free(scene->meshes);
+    for (u32 i = 0; i < scene->num_clouds; i++) {
+        unload_cloud(&scene->clouds[i]);
+    }
+    free(scene->clouds);
+    cloud_cache_release(scene->cloud_cache);
+    memset(scene, 0, sizeof(struct scene));
 }
 
-// Checks the spheres for intersection
-static double sphere_intersection_check(struct sphere *sphere, v3 ro, v3 rd)
+// Clean-up
+void free_scene(struct scene *scene)
 {
-    // This vector represents the vector from the origin to the sphere
-    v3 sphere_vec;
-    v3_sub(&sphere_vec, ro, sphere->pos);
-
-    double b = 2 * (rd.x * sphere_vec.x + rd.y * sphere_vec.y + rd.z * sphere_vec.z);
-    double c = sphere_vec.x*sphere_vec.x + sphere_vec.y*sphere_vec.y +
-               sphere_vec.z*sphere_vec.z - sphere->rad*sphere->rad;
-
-    double disc = b*b - 4*c;
-
-    if (disc < 0.00001) {
-        return -1;
-    }
-
-    double sqrt_disc = sqrt(disc);
-    // neither t0 or t1 can be < 0
-    // also t0 will always be the closest point because it does the "-"
-    double t0 = (-b - sqrt_disc) / 2;
-    double t1 = (-b + sqrt_disc) / 2;
+    clear_scene(scene);
+    free(scene);
+}
 
-    if (t0 < 0) {
-        if(t1 < 0) {
-            return -1;
-        } else {
-            return t1;
-        }
-    } else {
-        return t0;
+static void *copy_array(const void *array, size_t size, bool huge_pages)
+{
+    void *result = malloc(size ? size : 1);
+    if (huge_pages && size >= HUGE_PAGE_SIZE) {
+        advise_huge_pages(result, size);
     }
+    memcpy(result, array, size);
+    return result;
 }
 
-// Checks planes for intersection
-static double plane_intersection_check(struct plane *plane, v3 ro, v3 rd)
+static void copy_bvh(struct bvh *dest, struct bvh *src, u32 num_indices, bool huge_pages)
 {
-    v3 norm = plane->norm;
-    v3 pos = plane->pos;
-    // This vector represents the vector from the origin to the plane
-    v3 plane_vec;
+    dest->nodes = copy_array(src->nodes, sizeof(struct bvh_node) * src->num_nodes, huge_pages);
+    dest->indices = copy_array(src->indices, sizeof(u32) * num_indices, huge_pages);
+}
 
-    v3_sub(&plane_vec, pos, ro);
-    double vo = v3_dot(plane_vec, norm);
-    double vd = v3_dot(norm, rd);
+struct scene *copy_scene(struct scene *scene, bool huge_pages)
+{
+    struct scene *result = malloc(sizeof(struct scene));
+    *result = *scene;
+    result->materials = copy_array(scene->materials, sizeof(struct material) *
+                                   scene->num_materials, huge_pages);
+    result->lights = copy_array(scene->lights, sizeof(struct light) * scene->num_lights,
+                                huge_pages);
+    result->spheres = copy_array(scene->spheres, sizeof(struct sphere) * scene->num_spheres,
+                                 huge_pages);
+    result->planes = copy_array(scene->planes, sizeof(struct plane) * scene->num_planes,
+                                huge_pages);
+    result->cameras = copy_array(scene->cameras, sizeof(struct camera) * scene->num_cameras,
+                                 huge_pages);
+    result->instances = copy_array(scene->instances, sizeof(struct instance) *
+                                   scene->num_instances, huge_pages);
+    copy_bvh(&result->instance_bvh, &scene->instance_bvh, scene->num_instances, huge_pages);
 
-    if (vd > 0.00001) {
-        return -1;
+    result->groups = copy_array(scene->groups, sizeof(struct group) * scene->num_groups,
+                                huge_pages);
+    for (u32 i = 0; i < scene->num_groups; i++) {
+        struct group *group = &result->groups[i];
+        group->spheres = copy_array(group->spheres, sizeof(struct sphere) * group->num_spheres,
+                                    huge_pages);
+        copy_bvh(&group->bvh, &scene->groups[i].bvh, group->num_spheres, huge_pages);
     }
 
-    // do I need to negate here? doesn't seem like it...
-    double t = vo / vd;
-
-    if (t < 0) {
-        return -1;
+    // Mesh files are copied into anonymous mappings, so unload_mesh() can
+    // release copies and originals alike
+    result->meshes = copy_array(scene->meshes, sizeof(struct mesh) * scene->num_meshes,
+                                huge_pages);
+    for (u32 i = 0; i < scene->num_meshes; i++) {
+        struct mesh *mesh = &result->meshes[i];
+        mesh->mapping = mmap(NULL, mesh->mapping_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (huge_pages && mesh->mapping_size >= HUGE_PAGE_SIZE) {
+            advise_huge_pages(mesh->mapping, mesh->mapping_size);
+        }
+        memcpy(mesh->mapping, scene->meshes[i].mapping, mesh->mapping_size);
+        mesh->vertices = (const float *)((u8 *)mesh->mapping +
+                                         ((u8 *)scene->meshes[i].vertices -
+                                          (u8 *)scene->meshes[i].mapping));
+        mesh->indices = (const u32 *)(mesh->vertices + 3 * mesh->num_vertices);
+        copy_bvh(&mesh->bvh, &scene->meshes[i].bvh, mesh->num_triangles, huge_pages);
     }
 
-    return t;
+    // Copies share the cluster pages, which aren't placed on any node
+    result->clouds = malloc(sizeof(struct cloud) * (scene->num_clouds + 1));
+    for (u32 i = 0; i < scene->num_clouds; i++) {
+        copy_cloud(&result->clouds[i], &scene->clouds[i]);
+    }
+    if (scene->cloud_cache) {
+        cloud_cache_retain(scene->cloud_cache);
+    }
+    return result;
 }
 
-static inline double angular_attenuation(struct light *light, v3 intersection_point)
+KERNEL double angular_attenuation(struct light *light, v3 intersection_point, u32 features)
 {
-    if (light->theta) {
+    if ((features & FEATURE_SPOTLIGHTS) && light->theta) {
         color3f result = {0};
         v3 light_vec = {0};
 
         v3_sub(&light_vec, light->pos, intersection_point);
         v3_normalize(&light_vec, light_vec);
-        v3_normalize(&light->direction, light->direction);
 
         double cosalpha = v3_dot(light->direction, light_vec);
 
@@ -124,7 +166,8 @@ static inline double angular_attenuation(struct light *light, v3 intersection_po
 
 #define SHININESS 20
 
-static inline color3f specular_reflection(struct light *light, struct intersect_data intersect, v3 rd)
+KERNEL color3f specular_reflection(struct light *light, struct material *material,
+                                   struct intersect_data intersect, v3 rd)
 {
     color3f result = {0};
     v3 light_vec = {0};
@@ -143,19 +186,19 @@ static inline color3f specular_reflection(struct light *light, struct intersect_
 
     if (view_angle > 0 && light_angle > 0) {
         double shininess_factor = pow(view_angle, SHININESS);
-        result.r = intersect.specular.r * light->color.r * shininess_factor;
-        result.g = intersect.specular.g * light->color.g * shininess_factor;
-        result.b = intersect.specular.b * light->color.b * shininess_factor;
+        result.r = material->specular.r * light->color.r * shininess_factor;
+        result.g = material->specular.g * light->color.g * shininess_factor;
+        result.b = material->specular.b * light->color.b * shininess_factor;
     }
     return result;
 }
 
-static inline double radial_attenuation(struct light *light, v3 intersection_point)
+KERNEL double radial_attenuation(struct light *light, v3 intersection_point, u32 features)
 {
     double dist = v3_distance(light->pos, intersection_point);
 
     // if light is a spotlight
-    if (light->theta) {
+    if ((features & FEATURE_SPOTLIGHTS) && light->theta) {
         return 1.0;
     }
 
@@ -167,7 +210,8 @@ static inline double radial_attenuation(struct light *light, v3 intersection_poi
     }
 }
 
-static inline color3f diffuse_reflection(struct light *light, struct intersect_data intersect)
+KERNEL color3f diffuse_reflection(struct light *light, struct material *material,
+                                  struct intersect_data intersect)
 {
     color3f result = {0};
     v3 light_vec = {0};
@@ -177,201 +221,2020 @@ static inline color3f diffuse_reflection(struct light *light, struct intersect_d
     double costheta = v3_dot(intersect.normal, light_vec);
 
     if (costheta > 0) {
-        result.r = (intersect.diffuse.r * light->color.r) * costheta;
-        result.g = (intersect.diffuse.g * light->color.g) * costheta;
-        result.b = (intersect.diffuse.b * light->color.b) * costheta;
+        result.r = (material->diffuse.r * light->color.r) * costheta;
+        result.g = (material->diffuse.g * light->color.g) * costheta;
+        result.b = (material->diffuse.b * light->color.b) * costheta;
         return result;
     } else {
         return result;
     }
 }
 
-static inline v3 get_intersection_point(v3 ro, v3 rd, double t)
+static inline v3 get_sphere_normal(v3 intersection_point, v3 sphere_center)
 {
     v3 result = {0};
-    result.x = ro.x + rd.x*t;
-    result.y = ro.y + rd.y*t;
-    result.z = ro.z + rd.z*t;
+    v3_sub(&result, intersection_point, sphere_center);
+    v3_normalize(&result, result);
     return result;
 }
 
-static inline v3 get_sphere_normal(v3 intersection_point, v3 sphere_center)
+// Finds the nearest sphere of a group hit by a ray given in group space.
+// With any_hit set, returns as soon as some sphere is hit instead.
+static double group_intersect(struct group *group, v3 ro, v3 rd, v3 inv_rd,
+                              double nearest, bool any_hit, struct sphere **hit)
 {
-    v3 result = {0};
-    v3_sub(&result, intersection_point, sphere_center);
+    u32 stack[BVH_MAX_DEPTH];
+    u32 top = 0;
+    stack[top++] = 0;
+
+    while (top) {
+        struct bvh_node *node = &group->bvh.nodes[stack[--top]];
+        if (!aabb_ray_hit(&node->bounds, ro, inv_rd, nearest)) {
+            continue;
+        }
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                struct sphere *sphere = &group->spheres[group->bvh.indices[i]];
+                double t = sphere_intersection_check(sphere, ro, rd);
+                if (t > 0 && t < nearest) {
+                    nearest = t;
+                    *hit = sphere;
+                    if (any_hit) {
+                        return nearest;
+                    }
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return nearest;
+}
+
+// Walks the top level hierarchy and descends into the group of every
+// instance whose bounds the ray passes through
+static double instance_intersect(struct scene *scene, v3 ro, v3 rd, double nearest, bool any_hit,
+                                 struct sphere **hit, struct instance **hit_instance)
+{
+    struct bvh *tlas = &scene->instance_bvh;
+    v3 inv_rd = {1 / rd.x, 1 / rd.y, 1 / rd.z};
+    u32 stack[BVH_MAX_DEPTH];
+    u32 top = 0;
+
+    if (!tlas->num_nodes) {
+        return nearest;
+    }
+    stack[top++] = 0;
+
+    while (top) {
+        struct bvh_node *node = &tlas->nodes[stack[--top]];
+        if (!aabb_ray_hit(&node->bounds, ro, inv_rd, nearest)) {
+            continue;
+        }
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                struct instance *instance = &scene->instances[tlas->indices[i]];
+                struct group *group = &scene->groups[instance->group];
+                struct sphere *sphere = NULL;
+                v3 local_ro;
+
+                v3_sub(&local_ro, ro, instance->translation);
+                nearest = group_intersect(group, local_ro, rd, inv_rd, nearest, any_hit, &sphere);
+                if (sphere) {
+                    *hit = sphere;
+                    *hit_instance = instance;
+                    if (any_hit) {
+                        return nearest;
+                    }
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return nearest;
+}
+
+KERNEL double mesh_triangle_check(struct mesh *mesh, u32 triangle, struct triangle_ray *ray, v3 ro)
+{
+    const u32 *index = &mesh->indices[3 * triangle];
+    return triangle_intersection_check(ray, ro, mesh_vertex(mesh, index[0]),
+                                       mesh_vertex(mesh, index[1]), mesh_vertex(mesh, index[2]));
+}
+
+// Finds the nearest triangle of a mesh hit by a ray given in mesh space.
+// With any_hit set, returns as soon as some triangle is hit instead.
+static double mesh_intersect(struct mesh *mesh, struct triangle_ray *ray, v3 ro, v3 inv_rd,
+                             double nearest, bool any_hit, u32 *hit)
+{
+    u32 stack[BVH_MAX_DEPTH];
+    u32 top = 0;
+
+    if (!mesh->bvh.num_nodes) {
+        return nearest;
+    }
+    stack[top++] = 0;
+
+    while (top) {
+        struct bvh_node *node = &mesh->bvh.nodes[stack[--top]];
+        if (!aabb_ray_hit(&node->bounds, ro, inv_rd, nearest)) {
+            continue;
+        }
+
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; i++) {
+                u32 triangle = mesh->bvh.indices[i];
+                double t = mesh_triangle_check(mesh, triangle, ray, ro);
+                if (t > 0 && t < nearest) {
+                    nearest = t;
+                    *hit = triangle;
+                }
+            }
+            if (any_hit && nearest < INFINITY) {
+                return nearest;
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return nearest;
+}
+
+// Tests the meshes of the scene, each in its own space
+static double meshes_intersect(struct scene *scene, v3 ro, v3 rd, double nearest, bool any_hit,
+                               struct mesh **hit_mesh, u32 *hit_triangle)
+{
+    struct triangle_ray ray = triangle_ray(rd);
+    v3 inv_rd = {1 / rd.x, 1 / rd.y, 1 / rd.z};
+
+    for (u32 i = 0; i < scene->num_meshes; i++) {
+        struct mesh *mesh = &scene->meshes[i];
+        double previous = nearest;
+        v3 local_ro;
+
+        v3_sub(&local_ro, ro, mesh->translation);
+        nearest = mesh_intersect(mesh, &ray, local_ro, inv_rd, nearest, any_hit, hit_triangle);
+        if (nearest < previous) {
+            *hit_mesh = mesh;
+            if (any_hit) {
+                return nearest;
+            }
+        }
+    }
+    return nearest;
+}
+
+// Unit normal of a mesh triangle, facing the side the ray came from
+static v3 triangle_normal(struct mesh *mesh, u32 triangle, v3 rd)
+{
+    const u32 *index = &mesh->indices[3 * triangle];
+    v3 a = mesh_vertex(mesh, index[0]);
+    v3 ab, ac, result;
+
+    v3_sub(&ab, mesh_vertex(mesh, index[1]), a);
+    v3_sub(&ac, mesh_vertex(mesh, index[2]), a);
+    v3_cross(&result, ab, ac);
     v3_normalize(&result, result);
+    if (v3_dot(result, rd) > 0) {
+        v3_scale(&result, result, -1);
+    }
     return result;
 }
 
-static inline v3 apply_epsilon(struct intersect_data intersect)
+// The object a ray hit. Objects are tested in this order, planes first, and
+// only nearer hits are recorded, so the last kind set is the nearest.
+struct hit_object {
+    struct plane *plane;
+    struct sphere *sphere;
+    // Set when the sphere belongs to this instance's group
+    struct instance *instance;
+    struct mesh *mesh;
+    u32 triangle;
+    // Particles are copied out of their page, which can be evicted
+    bool cloud;
+    struct sphere particle;
+};
+
+// Fills in the hit record for the nearest object found by a ray
+KERNEL struct intersect_data resolve_hit(v3 ro, v3 rd, double nearest, struct hit_object *hit)
 {
-    v3 result = {0};
-    v3 epsilon = {0};
-    v3_scale(&epsilon, intersect.normal, 0.1);
-    v3_add(&result, intersect.point, epsilon);
+    struct intersect_data result = {0};
+
+    if (hit->cloud) {
+        result.t = nearest;
+        result.point = get_intersection_point(ro, rd, nearest);
+        result.normal = get_sphere_normal(result.point, hit->particle.pos);
+        result.material = hit->particle.material;
+    } else if (hit->mesh) {
+        result.t = nearest;
+        result.point = get_intersection_point(ro, rd, nearest);
+        result.normal = triangle_normal(hit->mesh, hit->triangle, rd);
+        result.material = hit->mesh->material;
+    } else if (hit->sphere) {
+        v3 center = hit->sphere->pos;
+        if (hit->instance) {
+            v3_add(&center, center, hit->instance->translation);
+        }
+        result.t = nearest;
+        result.point = get_intersection_point(ro, rd, nearest);
+        result.normal = get_sphere_normal(result.point, center);
+        result.material = hit->sphere->material;
+    } else if (hit->plane) {
+        result.t = nearest;
+        result.point = get_intersection_point(ro, rd, nearest);
+        result.normal = hit->plane->norm;
+        result.material = hit->plane->material;
+    }
     return result;
 }
 
-static struct intersect_data ray_intersect(struct scene *scene, v3 ro, v3 rd)
+// Tests the clouds, paging in their clusters as needed
+KERNEL double nearest_particle(struct scene *scene, v3 ro, v3 rd, double nearest, bool any_hit,
+                               struct hit_object *hit)
 {
-    struct intersect_data result = {0};
+    if (scene->num_clouds) {
+        double t = clouds_intersect(scene, ro, rd, nearest, any_hit, &hit->particle);
+        if (t < nearest) {
+            hit->cloud = true;
+            return t;
+        }
+    }
+    return nearest;
+}
+
+// Finds the nearest object other than the clouds hit by the ray
+KERNEL double nearest_object(struct scene *scene, v3 ro, v3 rd, u32 features,
+                             struct hit_object *hit)
+{
+    double nearest = INFINITY;
     double t;
+
     // Check for plane intersections
-    for (int plane_index = 0; plane_index < scene->num_planes; plane_index++) {
+    for (int plane_index = 0; (features & FEATURE_PLANES) && plane_index < scene->num_planes;
+         plane_index++) {
         struct plane *plane = &scene->planes[plane_index];
         t = plane_intersection_check(plane, ro, rd);
-        if (t > 0) {
-            result.t = t;
-            result.point = get_intersection_point(ro, rd, t);
-            result.normal = plane->norm;
-            result.diffuse = plane->diffuse;
-            result.specular = plane->specular;
+        if (t > 0 && t < nearest) {
+            nearest = t;
+            hit->plane = plane;
         }
     }
     // Check for sphere intersections
     for (int sphere_index = 0; sphere_index < scene->num_spheres; sphere_index++) {
         struct sphere *sphere = &scene->spheres[sphere_index];
         t = sphere_intersection_check(sphere, ro, rd);
-        if (t > 0) {
-            result.t = t;
-            result.point = get_intersection_point(ro, rd, t);
-            result.normal = get_sphere_normal(result.point, sphere->pos);
-            result.diffuse = sphere->diffuse;
-            result.specular = sphere->specular;
+        if (t > 0 && t < nearest) {
+            nearest = t;
+            hit->sphere = sphere;
         }
     }
-    return result;
+    // Check the instanced groups
+    struct sphere *instanced_sphere = NULL;
+    struct instance *instance = NULL;
+    nearest = instance_intersect(scene, ro, rd, nearest, false, &instanced_sphere, &instance);
+    if (instanced_sphere) {
+        hit->sphere = instanced_sphere;
+        hit->instance = instance;
+    }
+    // Check the meshes
+    return meshes_intersect(scene, ro, rd, nearest, false, &hit->mesh, &hit->triangle);
 }
 
-static color3f raycast(struct scene *scene, v3 ro, v3 rd)
+// Finds the nearest object hit by the ray, t is left at 0 on a miss
+KERNEL struct intersect_data nearest_hit(struct scene *scene, v3 ro, v3 rd, u32 features)
 {
-    struct intersect_data intersection = ray_intersect(scene, ro, rd);
+    struct hit_object hit = {0};
+    double nearest = nearest_object(scene, ro, rd, features, &hit);
+    nearest = nearest_particle(scene, ro, rd, nearest, false, &hit);
+    return resolve_hit(ro, rd, nearest, &hit);
+}
 
-    struct intersect_data light_intersect = {0};
-    v3 adjusted_intersect = {0};
+struct intersect_data ray_intersect(struct scene *scene, v3 ro, v3 rd)
+{
+    return nearest_hit(scene, ro, rd, FEATURES_ALL);
+}
+
+// Like nearest_object(), but only tests the planes, the given candidates
+// (see raster.h) and the meshes. Candidates are in scene order, spheres
+// first, so the nearest hit is picked the same way as with the full test.
+KERNEL double candidate_object(struct scene *scene, u32 *ids, u32 count, v3 ro, v3 rd,
+                               u32 features, struct hit_object *hit)
+{
+    v3 inv_rd = {1 / rd.x, 1 / rd.y, 1 / rd.z};
+    double nearest = INFINITY;
+    double t;
+
+    for (int plane_index = 0; (features & FEATURE_PLANES) && plane_index < scene->num_planes;
+         plane_index++) {
+        struct plane *plane = &scene->planes[plane_index];
+        t = plane_intersection_check(plane, ro, rd);
+        if (t > 0 && t < nearest) {
+            nearest = t;
+            hit->plane = plane;
+        }
+    }
+
+    for (u32 n = 0; n < count; n++) {
+        if (ids[n] & CANDIDATE_INSTANCE) {
+            struct instance *instance = &scene->instances[ids[n] & ~CANDIDATE_INSTANCE];
+            struct sphere *sphere = NULL;
+            v3 local_ro;
+
+            v3_sub(&local_ro, ro, instance->translation);
+            nearest = group_intersect(&scene->groups[instance->group], local_ro, rd, inv_rd,
+                                      nearest, false, &sphere);
+            if (sphere) {
+                hit->sphere = sphere;
+                hit->instance = instance;
+            }
+        } else {
+            struct sphere *sphere = &scene->spheres[ids[n]];
+            t = sphere_intersection_check(sphere, ro, rd);
+            if (t > 0 && t < nearest) {
+                nearest = t;
+                hit->sphere = sphere;
+                hit->instance = NULL;
+            }
+        }
+    }
+    return meshes_intersect(scene, ro, rd, nearest, false, &hit->mesh, &hit->triangle);
+}
+
+// Nearest object other than the clouds hit by a primary ray of the given
+// tile
+KERNEL double primary_object(struct scene *scene, struct tile_candidates *candidates, u32 tile,
+                             v3 ro, v3 rd, u32 features, struct hit_object *hit)
+{
+    if (!candidates) {
+        return nearest_object(scene, ro, rd, features, hit);
+    }
+    u32 first = candidates->offsets[tile];
+    return candidate_object(scene, &candidates->ids[first], candidates->offsets[tile + 1] - first,
+                            ro, rd, features, hit);
+}
+
+// Nearest hit of a primary ray of the given tile
+KERNEL struct intersect_data primary_intersect(struct scene *scene,
+                                              struct tile_candidates *candidates,
+                                              u32 tile, v3 ro, v3 rd, u32 features)
+{
+    struct hit_object hit = {0};
+    double nearest = primary_object(scene, candidates, tile, ro, rd, features, &hit);
+    nearest = nearest_particle(scene, ro, rd, nearest, false, &hit);
+    return resolve_hit(ro, rd, nearest, &hit);
+}
+
+/*
+ * Shadow occluder cache
+ * =====================
+ * Neighbouring pixels are almost always shadowed by the same object, so
+ * the object that blocked the last shadow ray towards each light is tested
+ * first. Only lit pixels and cache misses pay for the full search. Whether a
+ * light is blocked only depends on there being some hit, so this gives the
+ * same answer as the nearest hit search.
+ */
+
+// Per render, so every thread rendering keeps its own
+struct shadow_cache {
+    // Previews can skip shadow rays altogether and treat every light as visible
+    bool skip;
+    struct hit_object *occluders;
+    u64 rays;
+    u64 blocked;
+    u64 hits;
+};
+
+KERNEL bool occluder_hit(struct hit_object *occluder, v3 ro, v3 rd)
+{
+    if (occluder->plane) {
+        return plane_intersection_check(occluder->plane, ro, rd) > 0;
+    } else if (occluder->sphere) {
+        if (occluder->instance) {
+            v3_sub(&ro, ro, occluder->instance->translation);
+        }
+        return sphere_intersection_check(occluder->sphere, ro, rd) > 0;
+    } else if (occluder->mesh) {
+        struct triangle_ray ray = triangle_ray(rd);
+        v3_sub(&ro, ro, occluder->mesh->translation);
+        return mesh_triangle_check(occluder->mesh, occluder->triangle, &ray, ro) > 0;
+    } else if (occluder->cloud) {
+        return sphere_intersection_check(&occluder->particle, ro, rd) > 0;
+    }
+    return false;
+}
+
+// Any hit search over the whole scene, records the blocker in occluder.
+// The clouds are left out unless clouds is set.
+KERNEL bool find_occluder(struct scene *scene, v3 ro, v3 rd, struct hit_object *occluder,
+                          u32 features, bool clouds)
+{
+    struct hit_object result = {0};
+
+    for (int plane_index = 0; (features & FEATURE_PLANES) && plane_index < scene->num_planes;
+         plane_index++) {
+        if (plane_intersection_check(&scene->planes[plane_index], ro, rd) > 0) {
+            result.plane = &scene->planes[plane_index];
+            *occluder = result;
+            return true;
+        }
+    }
+    for (int sphere_index = 0; sphere_index < scene->num_spheres; sphere_index++) {
+        if (sphere_intersection_check(&scene->spheres[sphere_index], ro, rd) > 0) {
+            result.sphere = &scene->spheres[sphere_index];
+            *occluder = result;
+            return true;
+        }
+    }
+    instance_intersect(scene, ro, rd, INFINITY, true, &result.sphere, &result.instance);
+    if (result.sphere) {
+        *occluder = result;
+        return true;
+    }
+    meshes_intersect(scene, ro, rd, INFINITY, true, &result.mesh, &result.triangle);
+    if (result.mesh) {
+        *occluder = result;
+        return true;
+    }
+    if (clouds && nearest_particle(scene, ro, rd, INFINITY, true, &result) < INFINITY) {
+        *occluder = result;
+        return true;
+    }
+    return false;
+}
+
+static void init_shadow_cache(struct shadow_cache *cache, struct scene *scene, bool skip)
+{
+    cache->skip = skip;
+    cache->occluders = calloc(scene->num_lights + 1, sizeof(struct hit_object));
+    cache->rays = 0;
+    cache->blocked = 0;
+    cache->hits = 0;
+}
+
+// Whether the shadow ray towards light light_index is blocked, by anything
+// but the clouds unless clouds is set
+KERNEL bool shadowed(struct scene *scene, struct shadow_cache *cache, int light_index,
+                     v3 ro, v3 rd, u32 features, bool clouds)
+{
+    if (!cache) {
+        return nearest_hit(scene, ro, rd, features).t != 0;
+    } else if (cache->skip) {
+        return false;
+    }
+
+    struct hit_object *occluder = &cache->occluders[light_index];
+    cache->rays++;
+    if (occluder_hit(occluder, ro, rd)) {
+        cache->blocked++;
+        cache->hits++;
+        return true;
+    }
+    if (find_occluder(scene, ro, rd, occluder, features, clouds)) {
+        cache->blocked++;
+        return true;
+    }
+    return false;
+}
+
+// Direction and origin of the shadow ray from a hit towards a light
+KERNEL v3 shadow_ray(struct light *light, struct intersect_data *intersection, v3 *ro)
+{
     v3 light_ray = {0};
+    v3_sub(&light_ray, light->pos, intersection->point);
+    v3_normalize(&light_ray, light_ray);
+    *ro = apply_epsilon(*intersection);
+    return light_ray;
+}
+
+// Adds the contribution of a light that can see the hit
+KERNEL void add_light(struct scene *scene, struct light *light,
+                      struct intersect_data *intersection, v3 rd, color3f *color, u32 features)
+{
+    // Materials are only looked up once the nearest hit is known
+    struct material *material = &scene->materials[intersection->material];
 
-    color3f final_color = {0};
     color3f ambient = {.03, .03, .03};
     color3f diffuse_color = {0};
     color3f specular_color = {0};
     double rad_factor = 1;
     double ang_factor = 1;
 
-    for (int light_index = 0; light_index < scene->num_lights; light_index++) {
-        struct light *light = &scene->lights[light_index];
+    rad_factor = radial_attenuation(light, intersection->point, features);
+    ang_factor = angular_attenuation(light, intersection->point, features);
+    diffuse_color = diffuse_reflection(light, material, *intersection);
+    // Without any specular material the reflection would be zero anyway
+    if (features & FEATURE_SPECULAR) {
+        specular_color = specular_reflection(light, material, *intersection, rd);
+    }
 
-        v3_sub(&light_ray, light->pos, intersection.point);
-        v3_normalize(&light_ray, light_ray);
-        adjusted_intersect = apply_epsilon(intersection);
-        light_intersect = ray_intersect(scene, adjusted_intersect, light_ray);
+    color->r += ang_factor * rad_factor * (diffuse_color.r + specular_color.r) + ambient.r;
+    color->g += ang_factor * rad_factor * (diffuse_color.g + specular_color.g) + ambient.g;
+    color->b += ang_factor * rad_factor * (diffuse_color.b + specular_color.b) + ambient.b;
+}
 
-        if (light_intersect.t == 0) {
-            rad_factor = radial_attenuation(light, intersection.point);
-            ang_factor = angular_attenuation(light, intersection.point);
-            diffuse_color = diffuse_reflection(light, intersection);
-            specular_color = specular_reflection(light, intersection, rd);
+// Adds the contribution of one light to a hit, if the light can see it
+KERNEL void shade_light(struct scene *scene, struct shadow_cache *cache, int light_index,
+                        struct intersect_data *intersection, v3 rd, color3f *color, u32 features)
+{
+    struct light *light = &scene->lights[light_index];
+    v3 adjusted_intersect = {0};
+    v3 light_ray = shadow_ray(light, intersection, &adjusted_intersect);
 
-            final_color.r += ang_factor * rad_factor * (diffuse_color.r + specular_color.r) + ambient.r;
-            final_color.g += ang_factor * rad_factor * (diffuse_color.g + specular_color.g) + ambient.g;
-            final_color.b += ang_factor * rad_factor * (diffuse_color.b + specular_color.b) + ambient.b;
-        }
+    if (!shadowed(scene, cache, light_index, adjusted_intersect, light_ray, features, true)) {
+        add_light(scene, light, intersection, rd, color, features);
     }
-    return final_color;
 }
 
-// Popualtes a pixmap with the pixel colors it found via intersecton tests
-void render_scene(struct scene *scene, struct pixmap image)
+KERNEL color3f shade(struct scene *scene, struct shadow_cache *cache,
+                     struct intersect_data *intersection, v3 rd, u32 features)
 {
-    if (!scene->cameras) {
-        free(image.pixels);
-        free_scene(scene);
-        die("Error: no camera was defined by the CSV file!");
+    color3f final_color = {0};
+
+    for (int light_index = 0; light_index < scene->num_lights; light_index++) {
+        shade_light(scene, cache, light_index, intersection, rd, &final_color, features);
     }
-    // Only 1 camera is supported ATM
+    return final_color;
+}
+
+color3f raycast(struct scene *scene, v3 ro, v3 rd)
+{
+    struct intersect_data intersection = ray_intersect(scene, ro, rd);
+    return shade(scene, NULL, &intersection, rd, FEATURES_ALL);
+}
+
+// Colors stay linear and unclamped until the tonemapping pass. The HDR
+// buffer only covers the rendered window of the image.
+static inline void store_pixel(float *hdr, struct tile_rect window, int i, int j, color3f color)
+{
+    float *texel = &hdr[3 * ((i - window.y0) * (window.x1 - window.x0) + (j - window.x0))];
+    texel[0] = color.r;
+    texel[1] = color.g;
+    texel[2] = color.b;
+}
+
+/*
+ * Deferred shading
+ * ================
+ * The image is processed in tiles. A visibility pass stores the nearest hit
+ * of every primary ray of the tile in a G-buffer, then the lighting pass
+ * walks the G-buffer once per light so that all shadow rays towards one
+ * light are traced back to back. Lights are accumulated in the same order as
+ * raycast() does, so both paths produce identical pixels.
+ */
+struct gbuffer {
+    // Position in the traversal order of the pixel in each slot
+    u16 visits[TILE_SIZE * TILE_SIZE];
+    struct intersect_data hits[TILE_SIZE * TILE_SIZE];
+    v3 rays[TILE_SIZE * TILE_SIZE];
+    color3f colors[TILE_SIZE * TILE_SIZE];
+};
+
+// Everything the tile renderers need for one render
+struct render_context {
+    struct scene *scene;
+    struct pixmap image;
+    struct tile_rect window;
+    float *hdr;
+    // Only allocated for deferred and wavefront rendering
+    struct gbuffer *gbuffer;
+    struct wavefront *wavefront;
+    // Primary visibility candidates, NULL to trace every object
+    struct tile_candidates *candidates;
+    struct traversal traversal;
+    struct shadow_cache shadows;
+    // Per pixel costs of the window, NULL unless they are recorded
+    struct pixel_cost *cost;
+};
+
+// Pixel (i, j) visited at position k of the tile's traversal, false when
+// the tile is clipped and doesn't have that pixel
+KERNEL bool visit_pixel(struct render_context *context, struct tile_rect rect, int k,
+                        int *i, int *j)
+{
+    *i = rect.y0 + context->traversal.pixel_y[k];
+    *j = rect.x0 + context->traversal.pixel_x[k];
+    return *i < rect.y1 && *j < rect.x1;
+}
+
+KERNEL void render_tile_deferred(struct render_context *context, u32 tile, struct tile_rect rect,
+                                 u32 features)
+{
+    struct scene *scene = context->scene;
+    struct gbuffer *gbuffer = context->gbuffer;
     struct camera camera = scene->cameras[0];
-    double pixel_width = camera.width / image.width;
-    double pixel_height = camera.height / image.height;
-    double focal_point = -1;
+    int count = 0;
+    int i, j;
+    v3 ro = {0};
+
+    // Visibility pass
+    for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++) {
+        if (!visit_pixel(context, rect, k, &i, &j)) {
+            continue;
+        }
+        int index = count++;
+        v3 rd = primary_ray(camera, context->image, i, j);
+        gbuffer->visits[index] = k;
+        gbuffer->rays[index] = rd;
+        gbuffer->hits[index] = primary_intersect(scene, context->candidates, tile, ro, rd,
+                                                 features);
+        gbuffer->colors[index] = (color3f){0};
+    }
+
+    // Lighting pass
+    for (int light_index = 0; light_index < scene->num_lights; light_index++) {
+        for (int index = 0; index < count; index++) {
+            shade_light(scene, &context->shadows, light_index, &gbuffer->hits[index],
+                        gbuffer->rays[index], &gbuffer->colors[index], features);
+        }
+    }
+
+    for (int index = 0; index < count; index++) {
+        visit_pixel(context, rect, gbuffer->visits[index], &i, &j);
+        store_pixel(context->hdr, context->window, i, j, gbuffer->colors[index]);
+    }
+}
 
-    v3 center = {0, 0, focal_point};
+KERNEL void render_tile_forward(struct render_context *context, u32 tile, struct tile_rect rect,
+                                u32 features)
+{
+    struct scene *scene = context->scene;
+    struct camera camera = scene->cameras[0];
+    struct intersect_data intersection;
     v3 ro = {0};
     v3 rd = {0};
-    v3 p = {0};
+    color3f color;
+    int i, j;
+
+    for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++) {
+        if (!visit_pixel(context, rect, k, &i, &j)) {
+            continue;
+        }
+        rd = primary_ray(camera, context->image, i, j);
+        intersection = primary_intersect(scene, context->candidates, tile, ro, rd, features);
+        color = shade(scene, &context->shadows, &intersection, rd, features);
+        store_pixel(context->hdr, context->window, i, j, color);
+    }
+}
 
+/*
+ * Render cost
+ * ===========
+ * Forward rendering that times every pixel and counts the shadow rays it
+ * fires, for heatmaps of where the render time goes. Kept separate from
+ * render_tile_forward() so normal renders don't pay for the bookkeeping.
+ */
+static inline u64 cycle_count(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+KERNEL void render_tile_costed(struct render_context *context, u32 tile, struct tile_rect rect,
+                               u32 features)
+{
+    struct scene *scene = context->scene;
+    struct camera camera = scene->cameras[0];
+    struct tile_rect window = context->window;
+    struct intersect_data intersection;
+    v3 ro = {0};
+    v3 rd = {0};
     color3f color;
+    int i, j;
+
+    for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++) {
+        if (!visit_pixel(context, rect, k, &i, &j)) {
+            continue;
+        }
+        u64 rays = context->shadows.rays;
+        u64 start = cycle_count();
+        rd = primary_ray(camera, context->image, i, j);
+        intersection = primary_intersect(scene, context->candidates, tile, ro, rd, features);
+        color = shade(scene, &context->shadows, &intersection, rd, features);
+
+        struct pixel_cost *cost =
+            &context->cost[(i - window.y0) * (window.x1 - window.x0) + (j - window.x0)];
+        cost->cycles = cycle_count() - start;
+        cost->shadow_rays = context->shadows.rays - rays;
+        cost->material = intersection.t ? intersection.material : COST_MISS;
+        store_pixel(context->hdr, window, i, j, color);
+    }
+}
+
+/*
+ * Wavefront rendering
+ * ===================
+ * Instead of following each pixel through all of its rays, the rays of a
+ * tile are kept in structure of arrays queues and pushed through one stage
+ * at a time: generate, intersect, then per light spawn shadow rays, sort
+ * them by direction, trace them and accumulate the lights that got through.
+ * Every stage runs a tight loop over one queue, and a queue holds at most one
+ * tile of rays so the whole wavefront stays in L2. Lights are accumulated in
+ * the same order as raycast() does, so the pixels are identical.
+ *
+ * Clouds are traced once the other objects are done, the whole queue at a
+ * time as a batch sorted by cluster (see cloud.h), so that every cluster
+ * the tile's rays reach is paged in once per stage instead of once per ray.
+ */
+#define WAVEFRONT_CAPACITY (TILE_SIZE * TILE_SIZE)
+
+// Bins used to sort shadow rays: 4 steps along each direction component
+#define WAVEFRONT_BINS 64
+
+struct ray_queue {
+    double ox[WAVEFRONT_CAPACITY], oy[WAVEFRONT_CAPACITY], oz[WAVEFRONT_CAPACITY];
+    double dx[WAVEFRONT_CAPACITY], dy[WAVEFRONT_CAPACITY], dz[WAVEFRONT_CAPACITY];
+    // Slot of the primary ray the ray belongs to
+    u32 slot[WAVEFRONT_CAPACITY];
+    u32 count;
+};
+
+struct wavefront {
+    // Position in the traversal order of each primary ray's pixel
+    u16 visits[WAVEFRONT_CAPACITY];
+    struct ray_queue primary;
+    struct ray_queue shadow;
+    struct ray_queue sorted;
+    struct intersect_data hits[WAVEFRONT_CAPACITY];
+    color3f colors[WAVEFRONT_CAPACITY];
+    u8 blocked[WAVEFRONT_CAPACITY];
+    // Only allocated when the scene has clouds
+    struct cloud_ray *cloud_rays;
+    struct cloud_batch cloud_batch;
+};
+
+static inline void push_ray(struct ray_queue *queue, v3 ro, v3 rd, u32 slot)
+{
+    u32 n = queue->count++;
+    queue->ox[n] = ro.x;
+    queue->oy[n] = ro.y;
+    queue->oz[n] = ro.z;
+    queue->dx[n] = rd.x;
+    queue->dy[n] = rd.y;
+    queue->dz[n] = rd.z;
+    queue->slot[n] = slot;
+}
+
+static inline u32 direction_bin(double x, double y, double z)
+{
+    u32 bx = (u32)fmin((x + 1) * 2, 3);
+    u32 by = (u32)fmin((y + 1) * 2, 3);
+    u32 bz = (u32)fmin((z + 1) * 2, 3);
+    return (bx << 4) | (by << 2) | bz;
+}
+
+// Counting sort of a queue by direction bin, so that rays heading the same
+// way are traced back to back
+static void sort_rays(struct ray_queue *queue, struct ray_queue *sorted)
+{
+    u32 offsets[WAVEFRONT_BINS + 1] = {0};
+    u8 bins[WAVEFRONT_CAPACITY];
+
+    for (u32 n = 0; n < queue->count; n++) {
+        bins[n] = direction_bin(queue->dx[n], queue->dy[n], queue->dz[n]);
+        offsets[bins[n] + 1]++;
+    }
+    for (u32 bin = 0; bin < WAVEFRONT_BINS; bin++) {
+        offsets[bin + 1] += offsets[bin];
+    }
+    for (u32 n = 0; n < queue->count; n++) {
+        u32 to = offsets[bins[n]]++;
+        sorted->ox[to] = queue->ox[n];
+        sorted->oy[to] = queue->oy[n];
+        sorted->oz[to] = queue->oz[n];
+        sorted->dx[to] = queue->dx[n];
+        sorted->dy[to] = queue->dy[n];
+        sorted->dz[to] = queue->dz[n];
+        sorted->slot[to] = queue->slot[n];
+    }
+    sorted->count = queue->count;
+}
+
+KERNEL void render_tile_wavefront(struct render_context *context, u32 tile, struct tile_rect rect,
+                                  u32 features)
+{
+    struct scene *scene = context->scene;
+    struct wavefront *wavefront = context->wavefront;
+    struct ray_queue *primary = &wavefront->primary;
+    struct camera camera = scene->cameras[0];
+    v3 origin = {0};
+    int i, j;
+
+    // Generate
+    primary->count = 0;
+    for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++) {
+        if (visit_pixel(context, rect, k, &i, &j)) {
+            wavefront->visits[primary->count] = k;
+            push_ray(primary, origin, primary_ray(camera, context->image, i, j), primary->count);
+        }
+    }
+
+    // Intersect
+    for (u32 n = 0; n < primary->count; n++) {
+        v3 ro = {primary->ox[n], primary->oy[n], primary->oz[n]};
+        v3 rd = {primary->dx[n], primary->dy[n], primary->dz[n]};
+        struct hit_object hit = {0};
+        double nearest = primary_object(scene, context->candidates, tile, ro, rd, features, &hit);
+        wavefront->hits[n] = resolve_hit(ro, rd, nearest, &hit);
+        wavefront->colors[n] = (color3f){0};
+        if (scene->num_clouds) {
+            wavefront->cloud_rays[n] = (struct cloud_ray){ro, rd, nearest};
+        }
+    }
+    if (scene->num_clouds) {
+        trace_cloud_batch(scene, &wavefront->cloud_batch, wavefront->cloud_rays, primary->count,
+                          false);
+        for (u32 n = 0; n < primary->count; n++) {
+            struct cloud_ray *ray = &wavefront->cloud_rays[n];
+            if (ray->found) {
+                struct hit_object hit = {.cloud = true, .particle = ray->hit};
+                wavefront->hits[n] = resolve_hit(ray->ro, ray->rd, ray->nearest, &hit);
+            }
+        }
+    }
+
+    // Shadow rays that get past everything else go through the clouds as a
+    // batch, unless shadows are skipped altogether
+    bool batch_clouds = scene->num_clouds && !context->shadows.skip;
+    for (int light_index = 0; light_index < scene->num_lights; light_index++) {
+        struct light *light = &scene->lights[light_index];
+        struct ray_queue *shadow = &wavefront->sorted;
 
-    for (int i = 0; i < image.height; i++) {
-        for (int j = 0; j < image.width; j++) {
-        p.x = center.x - camera.width*0.5 + pixel_width * (j + 0.5);
-        // Make the +Y axis be "up" by negating it
-        p.y = -(center.y - camera.height*0.5 + pixel_height * (i + 0.5));
-        p.z = center.z;
-        v3_normalize(&rd, p);
+        // Spawn shadow rays, misses included just like raycast() does
+        wavefront->shadow.count = 0;
+        for (u32 n = 0; n < primary->count; n++) {
+            v3 ro;
+            v3 rd = shadow_ray(light, &wavefront->hits[n], &ro);
+            push_ray(&wavefront->shadow, ro, rd, n);
+        }
+        sort_rays(&wavefront->shadow, shadow);
 
-        color = raycast(scene, ro, rd);
+        // Trace shadows
+        for (u32 n = 0; n < shadow->count; n++) {
+            v3 ro = {shadow->ox[n], shadow->oy[n], shadow->oz[n]};
+            v3 rd = {shadow->dx[n], shadow->dy[n], shadow->dz[n]};
+            bool blocked = shadowed(scene, &context->shadows, light_index, ro, rd, features,
+                                    !batch_clouds);
+            wavefront->blocked[shadow->slot[n]] = blocked;
+            if (batch_clouds) {
+                wavefront->cloud_rays[n] = (struct cloud_ray){ro, rd, INFINITY, .found = blocked};
+            }
+        }
+        if (batch_clouds) {
+            trace_cloud_batch(scene, &wavefront->cloud_batch, wavefront->cloud_rays,
+                              shadow->count, true);
+            for (u32 n = 0; n < shadow->count; n++) {
+                struct cloud_ray *ray = &wavefront->cloud_rays[n];
+                if (ray->found && !wavefront->blocked[shadow->slot[n]]) {
+                    wavefront->blocked[shadow->slot[n]] = true;
+                    context->shadows.blocked++;
+                    context->shadows.occluders[light_index] =
+                        (struct hit_object){.cloud = true, .particle = ray->hit};
+                }
+            }
+        }
 
-        image.pixels[i * image.width + j].r = 255 * clamp01(color.r);
-        image.pixels[i * image.width + j].g = 255 * clamp01(color.g);
-        image.pixels[i * image.width + j].b = 255 * clamp01(color.b);
+        // Accumulate
+        for (u32 n = 0; n < primary->count; n++) {
+            if (!wavefront->blocked[n]) {
+                v3 rd = {primary->dx[n], primary->dy[n], primary->dz[n]};
+                add_light(scene, light, &wavefront->hits[n], rd, &wavefront->colors[n], features);
+            }
         }
     }
+
+    for (u32 n = 0; n < primary->count; n++) {
+        visit_pixel(context, rect, wavefront->visits[n], &i, &j);
+        store_pixel(context->hdr, context->window, i, j, wavefront->colors[n]);
+    }
 }
 
-int main(int argc, char **argv)
+/*
+ * One variant of each tile renderer per feature set (see enum
+ * scene_features), indexed by the set.
+ */
+typedef void (*tile_kernel)(struct render_context *context, u32 tile, struct tile_rect rect);
+
+#define SPECIALIZE(render, features)                                                     \
+    static void render##_##features(struct render_context *context, u32 tile,            \
+                                    struct tile_rect rect)                               \
+    {                                                                                    \
+        render(context, tile, rect, features);                                           \
+    }
+
+#define SPECIALIZE_ALL(render)                                                           \
+    SPECIALIZE(render, 0) SPECIALIZE(render, 1) SPECIALIZE(render, 2)                    \
+    SPECIALIZE(render, 3) SPECIALIZE(render, 4) SPECIALIZE(render, 5)                    \
+    SPECIALIZE(render, 6) SPECIALIZE(render, 7)                                          \
+    static const tile_kernel render##_kernels[FEATURES_ALL + 1] = {                      \
+        render##_0, render##_1, render##_2, render##_3,                                  \
+        render##_4, render##_5, render##_6, render##_7                                   \
+    };
+
+SPECIALIZE_ALL(render_tile_forward)
+SPECIALIZE_ALL(render_tile_deferred)
+SPECIALIZE_ALL(render_tile_wavefront)
+SPECIALIZE_ALL(render_tile_costed)
+
+// Features the scene actually uses
+static u32 scene_features(struct scene *scene)
 {
-    if (argc != 5) {
-        die("Usage:\t%s [width] [height] [input] [output]", argv[0]);
+    u32 features = scene->num_planes ? FEATURE_PLANES : 0;
+
+    for (u32 i = 0; i < scene->num_lights; i++) {
+        if (scene->lights[i].theta) {
+            features |= FEATURE_SPOTLIGHTS;
+        }
+    }
+    for (u32 i = 0; i < scene->num_materials; i++) {
+        color3f specular = scene->materials[i].specular;
+        if (specular.r || specular.g || specular.b) {
+            features |= FEATURE_SPECULAR;
+        }
     }
+    return features;
+}
 
-    FILE *input, *output;
-    s32 width = atoi(argv[1]);
-    s32 height = atoi(argv[2]);
-    char *infn = argv[3];
-    char *outfn = argv[4];
+/*
+ * Threads
+ * =======
+ * The traversal order is cut into one band of consecutive tiles per
+ * thread. A thread renders its own band first and then helps with the
+ * others, taking tiles through each band's atomic cursor. With several
+ * threads every tile is tonemapped by the thread that rendered it, so the
+ * rows of both buffers are first touched, and so placed in memory, by the
+ * thread that renders them. With options.numa the threads are also pinned
+ * to CPUs round robin and read a copy of the scene local to their node.
+ */
+struct tile_band {
+    u32 next;
+    u32 end;
+};
 
-    if (width < 0 || height < 0) {
-        die("Error: invalid dimensions for output image (%d %d)!", width, height);
+// Everything the threads of one render share
+struct render_job {
+    struct render_options options;
+    // Copied into every thread's context
+    struct render_context shared;
+    tile_kernel render_tile;
+    bool tonemap_tiles;
+    struct tonemap_curve curve;
+    u32 num_objects;
+    struct tile_band *bands;
+    u32 num_bands;
+    struct cpu_topology topology;
+    // Per node copies of the scene, NULL where threads use the original
+    struct scene *replicas[MAX_NUMA_NODES];
+    // options.tile_cache, unless costs are recorded, and the keys of its
+    // tiles
+    struct tile_cache *cache;
+    struct tile_keys keys;
+    // Tiles left in each row of tiles, and the first row not handed to
+    // options.band_done yet, only tracked when that is set
+    u32 *tiles_left;
+    u32 next_row;
+    u32 num_rows;
+    pthread_mutex_t band_lock;
+};
+
+struct render_thread {
+    pthread_t thread;
+    struct render_job *job;
+    u32 index;
+    struct render_context context;
+    struct render_stats stats;
+};
+
+// Counts a tile as done, and hands every band of rows that is now complete
+// to options.band_done. Bands go out in order, so the thread completing a
+// row may also hand out the rows below it that finished earlier.
+static void complete_tile(struct render_job *job, struct render_context *context, u32 tile)
+{
+    struct tile_rect window = context->window;
+    u32 row = tile / tiles_across(context->image);
+    if (__atomic_sub_fetch(&job->tiles_left[row], 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    pthread_mutex_lock(&job->band_lock);
+    while (job->next_row < job->num_rows &&
+           !__atomic_load_n(&job->tiles_left[job->next_row], __ATOMIC_ACQUIRE)) {
+        int y0 = job->next_row * TILE_SIZE;
+        int y1 = y0 + TILE_SIZE;
+        y0 = y0 > window.y0 ? y0 : window.y0;
+        y1 = y1 < window.y1 ? y1 : window.y1;
+        if (y0 < y1) {
+            job->options.band_done(job->options.band_user, y0 - window.y0, y1 - window.y0);
+        }
+        job->next_row++;
+    }
+    pthread_mutex_unlock(&job->band_lock);
+}
+
+// Renders tile n of the traversal order, unless it's masked out or outside
+// the window
+static void render_nth_tile(struct render_job *job, struct render_context *context, u32 n,
+                            struct render_stats *stats)
+{
+    struct render_options *options = &job->options;
+    struct tile_rect window = context->window;
+    struct tile_candidates *candidates = context->candidates;
+    u32 tile = context->traversal.tiles[n];
+
+    // Tiles stay aligned to the full image, clipped to the window
+    struct tile_rect rect = get_tile_rect(context->image, tile);
+    rect.x0 = rect.x0 > window.x0 ? rect.x0 : window.x0;
+    rect.y0 = rect.y0 > window.y0 ? rect.y0 : window.y0;
+    rect.x1 = rect.x1 < window.x1 ? rect.x1 : window.x1;
+    rect.y1 = rect.y1 < window.y1 ? rect.y1 : window.y1;
+    if ((options->tile_mask && !options->tile_mask[tile]) ||
+        rect.x0 >= rect.x1 || rect.y0 >= rect.y1) {
+        if (job->tiles_left) {
+            complete_tile(job, context, tile);
+        }
+        return;
+    }
+
+    u32 stride = window.x1 - window.x0;
+    float *texels = &context->hdr[3 * ((rect.y0 - window.y0) * stride + (rect.x0 - window.x0))];
+    u64 key = 0;
+    u64 span = trace_begin();
+    if (job->cache) {
+        key = tile_key(&job->keys, context->scene, context->image, rect);
+    }
+    if (job->cache && tile_cache_load(job->cache, key, texels, rect.x1 - rect.x0,
+                                      rect.y1 - rect.y0, stride)) {
+        trace_end_arg("cached tile", "tile", tile, span);
+        stats->cached_tiles++;
+    } else {
+        job->render_tile(context, tile, rect);
+        if (job->cache) {
+            tile_cache_store(job->cache, key, texels, rect.x1 - rect.x0, rect.y1 - rect.y0,
+                             stride);
+        }
+        trace_end_arg("tile", "tile", tile, span);
+        stats->tiles++;
+        stats->objects += job->num_objects;
+        stats->candidates += candidates ?
+                             candidates->offsets[tile + 1] - candidates->offsets[tile] :
+                             job->num_objects;
+    }
+
+    // Skipped tiles keep their pixels, so tonemap just this one
+    if (job->tonemap_tiles) {
+        for (int i = rect.y0; i < rect.y1; i++) {
+            u32 offset = (i - window.y0) * (window.x1 - window.x0) + (rect.x0 - window.x0);
+            tonemap(&context->hdr[3 * offset], &context->image.pixels[offset],
+                    rect.x1 - rect.x0, &job->curve);
+        }
+    }
+    if (job->tiles_left) {
+        complete_tile(job, context, tile);
+    }
+}
+
+static void *render_thread_main(void *arg)
+{
+    struct render_thread *thread = arg;
+    struct render_job *job = thread->job;
+    struct render_context *context = &thread->context;
+    struct scene *scene = job->shared.scene;
+
+    if (job->options.numa && job->num_bands > 1) {
+        u32 cpu = thread->index % job->topology.num_cpus;
+        u32 node = job->topology.nodes[cpu];
+        if (pin_thread(job->topology.cpus[cpu]) && job->replicas[node]) {
+            scene = job->replicas[node];
+        }
+    }
+
+    // Allocated after pinning, so they land on the thread's node
+    *context = job->shared;
+    context->scene = scene;
+    context->gbuffer = job->options.deferred ? malloc(sizeof(struct gbuffer)) : NULL;
+    context->wavefront = job->options.wavefront ? malloc(sizeof(struct wavefront)) : NULL;
+    if (context->wavefront) {
+        context->wavefront->cloud_rays = scene->num_clouds ?
+                                         malloc(sizeof(struct cloud_ray) * WAVEFRONT_CAPACITY) :
+                                         NULL;
+        memset(&context->wavefront->cloud_batch, 0, sizeof(struct cloud_batch));
+    }
+    init_shadow_cache(&context->shadows, scene, job->options.skip_shadows);
+
+    for (u32 b = 0; b < job->num_bands; b++) {
+        struct tile_band *band = &job->bands[(thread->index + b) % job->num_bands];
+        u32 n;
+        while ((n = __atomic_fetch_add(&band->next, 1, __ATOMIC_RELAXED)) < band->end) {
+            render_nth_tile(job, context, n, &thread->stats);
+        }
+    }
+    return NULL;
+}
+
+// Renders the tiles on options.threads threads, or on the calling thread
+// when there is just one, and adds up their counters in stats
+static void render_tiles(struct render_job *job, struct render_stats *stats)
+{
+    u32 num_threads = job->options.threads > 1 ? job->options.threads : 1;
+    u32 num_tiles = job->shared.traversal.num_tiles;
+    struct render_thread *threads = calloc(num_threads, sizeof(struct render_thread));
+
+    job->num_bands = num_threads;
+    job->bands = malloc(sizeof(struct tile_band) * num_threads);
+    for (u32 b = 0; b < num_threads; b++) {
+        job->bands[b].next = (u64)num_tiles * b / num_threads;
+        job->bands[b].end = (u64)num_tiles * (b + 1) / num_threads;
+    }
+
+    for (u32 t = 0; t < num_threads; t++) {
+        threads[t].job = job;
+        threads[t].index = t;
+    }
+    if (num_threads == 1) {
+        render_thread_main(&threads[0]);
+    } else {
+        for (u32 t = 0; t < num_threads; t++) {
+            pthread_create(&threads[t].thread, NULL, render_thread_main, &threads[t]);
+        }
+        for (u32 t = 0; t < num_threads; t++) {
+            pthread_join(threads[t].thread, NULL);
+        }
+    }
+
+    for (u32 t = 0; t < num_threads; t++) {
+        struct render_context *context = &threads[t].context;
+        stats->tiles += threads[t].stats.tiles;
+        stats->cached_tiles += threads[t].stats.cached_tiles;
+        stats->objects += threads[t].stats.objects;
+        stats->candidates += threads[t].stats.candidates;
+        stats->shadow_rays += context->shadows.rays;
+        stats->shadow_rays_blocked += context->shadows.blocked;
+        stats->shadow_cache_hits += context->shadows.hits;
+        free(context->shadows.occluders);
+        free(context->gbuffer);
+        if (context->wavefront) {
+            free(context->wavefront->cloud_rays);
+            free_cloud_batch(&context->wavefront->cloud_batch);
+        }
+        free(context->wavefront);
+    }
+    stats->threads = num_threads;
+    free(job->bands);
+    free(threads);
+}
+
+// Popualtes a pixmap with the pixel colors it found via intersecton tests,
+// false when the scene has no camera to render from
+bool render_scene(struct scene *scene, struct pixmap image, struct render_options options)
+{
+    if (!scene->num_cameras) {
+        return false;
+    } else if (options.deadline_ms) {
+        render_with_deadline(scene, image, options);
+        return true;
+    }
+    struct tile_rect window = render_window(image, options);
+    u32 window_width = window.x1 - window.x0;
+    u32 window_pixels = window_width * (window.y1 - window.y0);
+    float *hdr = malloc(sizeof(float) * 3 * window_pixels);
+    struct tile_candidates culled = {0};
+    struct render_stats stats = {0};
+    struct timespec start, end;
+    struct perf_counters counters;
+    u64 counts[PERF_NUM_COUNTERS];
+
+    if (options.huge_pages && sizeof(float) * 3 * window_pixels >= HUGE_PAGE_SIZE) {
+        advise_huge_pages(hdr, sizeof(float) * 3 * window_pixels);
+    }
+
+    struct render_job job = {0};
+    struct render_context *context = &job.shared;
+    job.options = options;
+    job.num_objects = scene->num_spheres + scene->num_instances;
+    job.tonemap_tiles = options.tile_mask || options.threads > 1 || options.band_done;
+    tonemap_prepare(&job.curve, options.tonemap);
+    job.cache = options.cost ? NULL : options.tile_cache;
+    context->scene = scene;
+    context->image = image;
+    context->window = window;
+    context->hdr = hdr;
+    init_traversal(&context->traversal, image, options.order);
+    context->cost = options.cost;
+    for (u32 n = 0; context->cost && n < window_pixels; n++) {
+        context->cost[n] = (struct pixel_cost){0, 0, COST_MISS};
+    }
+
+    stats.kernel = options.generic_kernel ? FEATURES_ALL : scene_features(scene);
+    job.render_tile = context->cost ? render_tile_costed_kernels[stats.kernel] :
+                      options.wavefront ? render_tile_wavefront_kernels[stats.kernel] :
+                      options.deferred ? render_tile_deferred_kernels[stats.kernel] :
+                      render_tile_forward_kernels[stats.kernel];
+
+    // Counters are only opened when someone looks at them
+    stats.have_cache_misses = options.stats && perf_start(&counters);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    u64 render_span = trace_begin();
+    u64 span = trace_begin();
+    if (options.primary == PRIMARY_RASTER) {
+        rasterize_candidates(scene, image, &culled);
+        context->candidates = &culled;
+    } else if (options.primary == PRIMARY_FRUSTUM) {
+        cull_candidates(scene, image, &culled);
+        context->candidates = &culled;
+    }
+    if (context->candidates) {
+        trace_end("cull", span);
+    }
+
+    stats.numa_nodes = 1;
+    if (options.numa && options.threads > 1) {
+        span = trace_begin();
+        read_topology(&job.topology);
+        stats.numa_nodes = replicate_scene(scene, &job.topology, options.huge_pages,
+                                           job.replicas);
+        trace_end_arg("replicate scene", "nodes", stats.numa_nodes, span);
+    }
+
+    struct cloud_cache_stats clouds_before = {0};
+    if (scene->cloud_cache) {
+        if (options.cloud_budget) {
+            cloud_cache_set_budget(scene->cloud_cache, options.cloud_budget);
+        }
+        cloud_cache_stats(scene->cloud_cache, &clouds_before);
+    }
+
+    if (job.cache) {
+        span = trace_begin();
+        prepare_tile_keys(&job.keys, scene, image, options.skip_shadows);
+        trace_end("hash scene", span);
+    }
+
+    if (options.band_done) {
+        job.num_rows = (image.height + TILE_SIZE - 1) / TILE_SIZE;
+        job.tiles_left = malloc(sizeof(u32) * job.num_rows);
+        for (u32 row = 0; row < job.num_rows; row++) {
+            job.tiles_left[row] = tiles_across(image);
+        }
+        pthread_mutex_init(&job.band_lock, NULL);
+    }
+
+    render_tiles(&job, &stats);
+    if (job.cache) {
+        if (stats.tiles) {
+            span = trace_begin();
+            tile_cache_trim(job.cache);
+            trace_end("trim tile cache", span);
+        }
+        free_tile_keys(&job.keys);
+    }
+
+    if (!job.tonemap_tiles) {
+        span = trace_begin();
+        tonemap(hdr, image.pixels, window_pixels, &job.curve);
+        trace_end("tonemap", span);
+    }
+    trace_end("render", render_span);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (stats.have_cache_misses) {
+        perf_stop(&counters, counts);
+        memcpy(stats.cache_misses, counts, sizeof(stats.cache_misses));
+        stats.branches = counts[PERF_BRANCHES];
+        stats.branch_misses = counts[PERF_BRANCH_MISSES];
+    }
+    stats.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (scene->cloud_cache) {
+        struct cloud_cache_stats clouds;
+        cloud_cache_stats(scene->cloud_cache, &clouds);
+        stats.cluster_page_ins = clouds.page_ins - clouds_before.page_ins;
+        stats.cluster_page_hits = clouds.page_hits - clouds_before.page_hits;
+        stats.cluster_bytes_read = clouds.bytes_read - clouds_before.bytes_read;
+        stats.cluster_peak_bytes = clouds.peak_bytes;
+        stats.cluster_budget = clouds.budget;
+    }
+
+    if (options.numa && options.threads > 1) {
+        for (u32 node = 0; node < MAX_NUMA_NODES; node++) {
+            if (job.replicas[node]) {
+                free_scene(job.replicas[node]);
+            }
+        }
+        free_topology(&job.topology);
+    }
+    if (job.tiles_left) {
+        pthread_mutex_destroy(&job.band_lock);
+        free(job.tiles_left);
+    }
+    free_traversal(&context->traversal);
+    free_candidates(&culled);
+    free(hdr);
+    if (options.stats) {
+        *options.stats = stats;
+    }
+    return true;
+}
+
+/*
+ * ---- Command line front end ----
+ * Left out of the library build (see libraycast.h), which reports errors
+ * to its caller instead of exiting.
+ */
+#ifndef RAYCAST_LIBRARY
+// Useful message and quit function
+static void die(const char *reason, ...)
+{
+    va_list args;
+    va_start(args, reason);
+    vfprintf(stderr, reason, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+static void usage(const char *program)
+{
+    die("Usage:\t%s [options] [width] [height] [input] [output]\n"
+        "\t\t\tinput and output can be - for standard input and output, output\n"
+        "\t\t\tis written as QOI or PNG when it ends in .qoi or .png\n"
+        "Options:\n"
+        "\t--deferred\tshade tiles from a G-buffer, one light at a time\n"
+        "\t--wavefront\trender tiles as queues of rays processed stage by stage\n"
+        "\t--primary MODE\tfind primary hits by tracing every object (trace, default), only\n"
+        "\t\t\tthe objects rasterized into the tile (raster) or only the objects\n"
+        "\t\t\toverlapping the tile's frustum (frustum)\n"
+        "\t--order ORDER\trender tiles and their pixels in scanline (default), morton or\n"
+        "\t\t\thilbert order\n"
+        "\t--kernel KERNEL\tshade with the kernel specialized for the scene's features\n"
+        "\t\t\t(specialized, default) or the one handling every feature (generic)\n"
+        "\t--threads N\trender tiles on N threads (default 1)\n"
+        "\t--numa\t\tpin the threads to CPUs and copy the scene to every NUMA node\n"
+        "\t--huge-pages\tuse transparent huge pages for the framebuffer and scene copies\n"
+        "\t--deadline-ms MS\tlower the resolution, and at worst skip shadows, to finish in MS\n"
+        "\t--stats\t\tprint render time, cull ratios, shadow cache, cache miss and branch\n"
+        "\t\t\tcounts\n"
+        "\t--heatmap FILE\twrite the cycles each pixel took as a false color image to FILE,\n"
+        "\t\t\tand its raw cycle, shadow ray and material counts to FILE.counts\n"
+        "\t--tile-cache DIR\treuse tiles rendered by earlier runs from DIR, and add new ones\n"
+        "\t--tile-cache-mb MB\tdelete the least recently used tiles past MB (default 1024)\n"
+        "\t--cloud-memory MB\tkeep at most MB of cloud clusters in memory (default 256)\n"
+        "\t--trace FILE\twrite load, build, tile and write spans as Chrome trace JSON (the\n"
+        "\t\t\tdaemon writes it on SIGUSR1)\n"
+        "\t--exposure EV\tscale colors by 2^EV before tonemapping\n"
+        "\t--gamma G\tencode colors with a 1/G power curve\n"
+        "\t--srgb\t\tencode colors with the sRGB transfer curve\n"
+        "\t--serve SOCKET\trun as a render daemon on a Unix socket (no positional arguments)\n"
+        "\t--workers N\trender threads of the daemon (default 1)\n"
+        "\t--queue N\tconnections the daemon queues before answering busy (default 16)\n"
+        "\t--max-scenes N\tscenes the daemon keeps resident (default 8)\n"
+        "\t--previous-scene FILE\n"
+        "\t--previous-image FILE\n"
+        "\t\t\tre-render only the tiles that changed since FILE was rendered\n"
+        "\t--region X0,Y0,X1,Y1\n"
+        "\t\t\trender only this window into a partial image carrying its offset\n"
+        "\t--split N\trender in N worker processes on balanced regions\n"
+        "\t--stitch\tassemble partial images: %s --stitch [output] [partial ...]",
+        program, program);
+}
+
+// Long option identifiers, kept out of the range of short options
+enum {
+    OPT_DEFERRED = 256,
+    OPT_EXPOSURE,
+    OPT_GAMMA,
+    OPT_SRGB,
+    OPT_SERVE,
+    OPT_WORKERS,
+    OPT_QUEUE,
+    OPT_MAX_SCENES,
+    OPT_PREVIOUS_SCENE,
+    OPT_PREVIOUS_IMAGE,
+    OPT_REGION,
+    OPT_SPLIT,
+    OPT_STITCH,
+    OPT_PRIMARY,
+    OPT_STATS,
+    OPT_WAVEFRONT,
+    OPT_ORDER,
+    OPT_DEADLINE,
+    OPT_KERNEL,
+    OPT_TRACE,
+    OPT_HEATMAP,
+    OPT_THREADS,
+    OPT_NUMA,
+    OPT_HUGE_PAGES,
+    OPT_TILE_CACHE,
+    OPT_TILE_CACHE_MB,
+    OPT_CLOUD_MEMORY
+};
+
+// Parses a scene from a pipe while it arrives. Pipes can't be read with
+// get_file_contents(), which seeks to find the size.
+static int stream_scene(int fd, struct scene *scene)
+{
+    struct scene_stream stream;
+    char chunk[1 << 16];
+    ssize_t size;
+
+    scene_stream_init(&stream);
+    while ((size = read(fd, chunk, sizeof(chunk))) > 0 || (size < 0 && errno == EINTR)) {
+        if (size > 0) {
+            scene_stream_feed(&stream, chunk, size);
+        }
+    }
+    return scene_stream_finish(&stream, scene);
+}
+
+// Reads a CSV file, or standard input for "-", and builds the scene it
+// describes
+static struct scene *load_scene(const char *path)
+{
+    if (strcmp(path, "-") == 0) {
+        u64 span = trace_begin();
+        struct scene *scene = malloc(sizeof(struct scene));
+        int status = stream_scene(STDIN_FILENO, scene);
+        trace_end("stream scene", span);
+        if (status != SCENE_SUCCESS) {
+            die("Error: %s (standard input)!", scene_status_message(status));
+        }
+        return scene;
     }
 
-    input = fopen(infn, "r");
+    FILE *input = fopen(path, "r");
     if (!input) {
-        die("Error: failed to open input file (%s)!", infn);
+        die("Error: failed to open input file (%s)!", path);
     }
 
     // Reads the entire file into memory
+    u64 span = trace_begin();
     struct file_contents fc = get_file_contents(input);
     fclose(input);
+    trace_end("read scene", span);
 
     // Get a scene with arrays of spheres and planes to render
+    span = trace_begin();
     struct scene *scene = malloc(sizeof(struct scene));
-    construct_scene(&fc, scene);
+    int status = construct_scene(&fc, scene);
     free(fc.memory);
+    trace_end("parse scene", span);
+    if (status != SCENE_SUCCESS) {
+        die("Error: %s (%s)!", scene_status_message(status), path);
+    }
+    return scene;
+}
 
-    struct pixmap image = {0};
-    image.width = width;
-    image.height = height;
-    image.pixels = malloc(sizeof(pixel) * width * height);
+/*
+ * Seeds the image with the previous render and limits rendering to the
+ * tiles that can have changed since. Returns the tile mask.
+ */
+static u8 *prepare_incremental(struct scene *scene, struct pixmap image,
+                               const char *scene_path, const char *image_path)
+{
+    FILE *input = fopen(image_path, "r");
+    if (!input) {
+        die("Error: failed to open previous image (%s)!", image_path);
+    }
+    struct file_contents fc = get_file_contents(input);
+    fclose(input);
+
+    struct ppm_pixmap pm = {0};
+    int status = init_ppm_pixmap(&pm, &fc);
+    free(fc.memory);
+    if (status != INIT_SUCCESS) {
+        handle_init_error_code(status);
+        exit(EXIT_FAILURE);
+    } else if (pm.width != image.width || pm.height != image.height) {
+        die("Error: previous image is %dx%d, not %dx%d!", pm.width, pm.height,
+            image.width, image.height);
+    }
+    memcpy(image.pixels, pm.pixmap, sizeof(pixel) * image.width * image.height);
+    free(pm.pixmap);
+
+    struct scene *previous = load_scene(scene_path);
+    u8 *mask = malloc(num_tiles(image));
+    u32 dirty = find_dirty_tiles(previous, scene, image, mask);
+    free_scene(previous);
 
-    // This gets us a pixmap populated with all the colored pixels
-    render_scene(scene, image);
+    fprintf(stderr, "Incremental: re-rendering %u of %u tiles\n", dirty, num_tiles(image));
+    return mask;
+}
 
-    // I should create a function for this in ppmrw...
+// P6 image of the rendered window
+static struct ppm_pixmap window_pixmap(struct pixmap image, struct tile_rect window, bool partial)
+{
     struct ppm_pixmap pm = {0};
     pm.format = P6_PPM;
-    pm.width = image.width;
-    pm.height = image.height;
+    pm.width = window.x1 - window.x0;
+    pm.height = window.y1 - window.y0;
     pm.maxval = 255;
     pm.pixmap = image.pixels;
 
-    // Write the P6 PPM pixmap
-    output = fopen(outfn, "w");
-    write_ppm_header(pm, output, pm.format);
-    write_p6_pixmap(pm, output);
+    // Crops record where they belong in the full image. So do --region
+    // renders that happen to cover all of it, since they get stitched.
+    if (partial || pm.width != image.width || pm.height != image.height) {
+        pm.x_offset = window.x0;
+        pm.y_offset = window.y0;
+        pm.full_width = image.width;
+        pm.full_height = image.height;
+    }
+    return pm;
+}
+
+// Writes the rendered window of the image in the format of the path's
+// extension, or as P6 to standard output for "-". Encoding stats go to
+// encoded when it's set.
+static void write_image(const char *path, struct pixmap image, struct tile_rect window,
+                        bool partial, struct encode_stats *encoded)
+{
+    struct ppm_pixmap pm = window_pixmap(image, window, partial);
+
+    u64 span = trace_begin();
+    bool piped = strcmp(path, "-") == 0;
+    FILE *output = piped ? stdout : fopen(path, "w");
+    if (!output) {
+        die("Error: failed to open output file (%s)!", path);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool written = write_encoded_image(pm, output, piped ? FORMAT_PPM : image_format(path),
+                                       cpus > 0 ? cpus : 1, encoded);
+    if ((piped ? fflush(output) : fclose(output)) || !written) {
+        die("Error: failed to write output file (%s)!", path);
+    }
+    trace_end("write image", span);
+}
+
+// Streams the image to standard output band by band as render_scene()
+// finishes them (see render_options.band_done)
+static void write_band(void *user, u32 y0, u32 y1)
+{
+    struct ppm_pixmap *pm = user;
+    u64 span = trace_begin();
+    write_p6_rows(*pm, stdout, y0, y1);
+    fflush(stdout);
+    trace_end_arg("write band", "rows", y1 - y0, span);
+}
+
+// Writes the pixel costs as a false color image to path, and their raw
+// counts to path.counts
+static void write_heatmap(const char *path, struct pixel_cost *costs, struct pixmap image,
+                          struct tile_rect window)
+{
+    u32 count = (window.x1 - window.x0) * (window.y1 - window.y0);
+    struct pixmap heatmap = image;
+    heatmap.pixels = malloc(sizeof(pixel) * count);
+    heatmap_colors(costs, count, heatmap.pixels);
+    write_image(path, heatmap, window, false, NULL);
+    free(heatmap.pixels);
+
+    char *counts_path = malloc(strlen(path) + sizeof(".counts"));
+    sprintf(counts_path, "%s.counts", path);
+    if (!write_cost_counts(counts_path, costs, window)) {
+        die("Error: failed to write pixel costs (%s)!", counts_path);
+    }
+
+    fprintf(stderr, "Heatmap: %llu cycles per pixel median, %llu at the 99th percentile, "
+            "counts in %s\n", (unsigned long long)cycles_percentile(costs, count, 0.5),
+            (unsigned long long)cycles_percentile(costs, count, 0.99), counts_path);
+    free(counts_path);
+}
+
+// Assembles partial images from --region renders into one image
+static int stitch(char *outfn, char **parts, int num_parts)
+{
+    struct pixmap image = {0};
+
+    if (!format_supported(image_format(outfn))) {
+        die("Error: PNG output needs a build with zlib!");
+    }
+    for (int i = 0; i < num_parts; i++) {
+        FILE *input = fopen(parts[i], "r");
+        if (!input) {
+            die("Error: failed to open partial image (%s)!", parts[i]);
+        }
+
+        // The first part tells how large the full image is
+        if (!image.pixels) {
+            struct file_contents fc = get_file_contents(input);
+            struct ppm_pixmap pm = {0};
+            int status = init_ppm_pixmap(&pm, &fc);
+            free(fc.memory);
+            free(pm.pixmap);
+            if (status != INIT_SUCCESS || !pm.full_width) {
+                die("Error: %s is not a partial image!", parts[i]);
+            }
+            image.width = pm.full_width;
+            image.height = pm.full_height;
+            image.pixels = calloc(image.width * image.height, sizeof(pixel));
+        }
+        fclose(input);
+
+        if (!stitch_region(image, parts[i])) {
+            die("Error: %s doesn't belong to a %dx%d image!", parts[i], image.width, image.height);
+        }
+    }
+
+    struct tile_rect whole = {0, 0, image.width, image.height};
+    write_image(outfn, image, whole, false, NULL);
+    free(image.pixels);
+    return 0;
+}
+
+static void print_stats(struct render_stats *stats)
+{
+    fprintf(stderr, "Rendered %u tiles in %.1f ms\n", stats->tiles, stats->seconds * 1e3);
+    if (stats->cached_tiles) {
+        fprintf(stderr, "Tile cache: %u tiles reused\n", stats->cached_tiles);
+    }
+    if (stats->cluster_page_ins || stats->cluster_page_hits) {
+        fprintf(stderr, "Clouds: %llu clusters paged in (%.1f MB read), %.1f%% of cluster visits "
+                "resident, pages peaked at %.1f of %.1f MB\n",
+                (unsigned long long)stats->cluster_page_ins, stats->cluster_bytes_read * 1e-6,
+                100.0 * stats->cluster_page_hits /
+                (stats->cluster_page_ins + stats->cluster_page_hits),
+                stats->cluster_peak_bytes * 1e-6, stats->cluster_budget * 1e-6);
+    }
+    if (stats->threads > 1) {
+        fprintf(stderr, "Threads: %u, scene on %u NUMA node%s\n", stats->threads,
+                stats->numa_nodes, stats->numa_nodes == 1 ? "" : "s");
+    }
+    fprintf(stderr, "Shading kernel: spotlights %s, specular %s, planes %s\n",
+            stats->kernel & FEATURE_SPOTLIGHTS ? "on" : "off",
+            stats->kernel & FEATURE_SPECULAR ? "on" : "off",
+            stats->kernel & FEATURE_PLANES ? "on" : "off");
+    if (stats->objects) {
+        fprintf(stderr, "Primary visibility: %llu of %llu object tests kept, %.1f%% culled\n",
+                (unsigned long long)stats->candidates, (unsigned long long)stats->objects,
+                100.0 * (stats->objects - stats->candidates) / stats->objects);
+    }
+    if (stats->shadow_rays_blocked) {
+        fprintf(stderr, "Shadow cache: %llu of %llu shadow rays blocked, %.1f%% of those by the "
+                "last occluder\n",
+                (unsigned long long)stats->shadow_rays_blocked, (unsigned long long)stats->shadow_rays,
+                100.0 * stats->shadow_cache_hits / stats->shadow_rays_blocked);
+    }
+    if (stats->have_cache_misses) {
+        fprintf(stderr, "Cache misses: L1D %llu, L2 %llu, LLC %llu\n",
+                (unsigned long long)stats->cache_misses[PERF_L1D_MISSES],
+                (unsigned long long)stats->cache_misses[PERF_L2_MISSES],
+                (unsigned long long)stats->cache_misses[PERF_LLC_MISSES]);
+        fprintf(stderr, "Branches: %llu, %llu mispredicted\n",
+                (unsigned long long)stats->branches, (unsigned long long)stats->branch_misses);
+    } else {
+        fprintf(stderr, "Cache misses: perf counters unavailable\n");
+    }
+}
+
+// Parses a strictly positive integer option or dies
+static u32 positive_option(const char *name, const char *value)
+{
+    s32 result = atoi(value);
+    if (result <= 0) {
+        die("Error: invalid value for --%s (%s)!", name, value);
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    struct render_options options = {0};
+    struct render_stats stats = {0};
+    struct server_options server = {1, 16, 8};
+    char *socket_path = NULL;
+    char *previous_scene = NULL;
+    char *previous_image = NULL;
+    char *region = NULL;
+    u32 split = 0;
+    char *trace_path = NULL;
+    char *heatmap_path = NULL;
+    char *tile_cache_dir = NULL;
+    u32 tile_cache_mb = TILE_CACHE_DEFAULT_MB;
+    struct tile_cache tile_cache;
+    bool stitching = false;
+    static struct option long_options[] = {
+        {"deferred", no_argument, NULL, OPT_DEFERRED},
+        {"exposure", required_argument, NULL, OPT_EXPOSURE},
+        {"gamma", required_argument, NULL, OPT_GAMMA},
+        {"srgb", no_argument, NULL, OPT_SRGB},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"queue", required_argument, NULL, OPT_QUEUE},
+        {"max-scenes", required_argument, NULL, OPT_MAX_SCENES},
+        {"previous-scene", required_argument, NULL, OPT_PREVIOUS_SCENE},
+        {"previous-image", required_argument, NULL, OPT_PREVIOUS_IMAGE},
+        {"region", required_argument, NULL, OPT_REGION},
+        {"split", required_argument, NULL, OPT_SPLIT},
+        {"stitch", no_argument, NULL, OPT_STITCH},
+        {"primary", required_argument, NULL, OPT_PRIMARY},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"wavefront", no_argument, NULL, OPT_WAVEFRONT},
+        {"order", required_argument, NULL, OPT_ORDER},
+        {"deadline-ms", required_argument, NULL, OPT_DEADLINE},
+        {"kernel", required_argument, NULL, OPT_KERNEL},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"heatmap", required_argument, NULL, OPT_HEATMAP},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"numa", no_argument, NULL, OPT_NUMA},
+        {"huge-pages", no_argument, NULL, OPT_HUGE_PAGES},
+        {"tile-cache", required_argument, NULL, OPT_TILE_CACHE},
+        {"tile-cache-mb", required_argument, NULL, OPT_TILE_CACHE_MB},
+        {"cloud-memory", required_argument, NULL, OPT_CLOUD_MEMORY},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_DEFERRED:
+            options.deferred = true;
+            break;
+        case OPT_EXPOSURE:
+            options.tonemap.exposure = atof(optarg);
+            break;
+        case OPT_GAMMA:
+            options.tonemap.curve = TRANSFER_GAMMA;
+            options.tonemap.gamma = atof(optarg);
+            if (options.tonemap.gamma <= 0) {
+                die("Error: invalid gamma (%s)!", optarg);
+            }
+            break;
+        case OPT_SRGB:
+            options.tonemap.curve = TRANSFER_SRGB;
+            break;
+        case OPT_SERVE:
+            socket_path = optarg;
+            break;
+        case OPT_WORKERS:
+            server.workers = positive_option("workers", optarg);
+            break;
+        case OPT_QUEUE:
+            server.queue_size = positive_option("queue", optarg);
+            break;
+        case OPT_MAX_SCENES:
+            server.max_scenes = positive_option("max-scenes", optarg);
+            break;
+        case OPT_PREVIOUS_SCENE:
+            previous_scene = optarg;
+            break;
+        case OPT_PREVIOUS_IMAGE:
+            previous_image = optarg;
+            break;
+        case OPT_REGION:
+            region = optarg;
+            break;
+        case OPT_SPLIT:
+            split = positive_option("split", optarg);
+            break;
+        case OPT_STITCH:
+            stitching = true;
+            break;
+        case OPT_PRIMARY:
+            if (strcmp(optarg, "trace") == 0) {
+                options.primary = PRIMARY_TRACE;
+            } else if (strcmp(optarg, "raster") == 0) {
+                options.primary = PRIMARY_RASTER;
+            } else if (strcmp(optarg, "frustum") == 0) {
+                options.primary = PRIMARY_FRUSTUM;
+            } else {
+                die("Error: unknown primary visibility mode (%s)!", optarg);
+            }
+            break;
+        case OPT_STATS:
+            options.stats = &stats;
+            break;
+        case OPT_WAVEFRONT:
+            options.wavefront = true;
+            break;
+        case OPT_ORDER:
+            if (strcmp(optarg, "scanline") == 0) {
+                options.order = ORDER_SCANLINE;
+            } else if (strcmp(optarg, "morton") == 0) {
+                options.order = ORDER_MORTON;
+            } else if (strcmp(optarg, "hilbert") == 0) {
+                options.order = ORDER_HILBERT;
+            } else {
+                die("Error: unknown traversal order (%s)!", optarg);
+            }
+            break;
+        case OPT_DEADLINE:
+            options.deadline_ms = positive_option("deadline-ms", optarg);
+            break;
+        case OPT_KERNEL:
+            if (strcmp(optarg, "specialized") == 0) {
+                options.generic_kernel = false;
+            } else if (strcmp(optarg, "generic") == 0) {
+                options.generic_kernel = true;
+            } else {
+                die("Error: unknown shading kernel (%s)!", optarg);
+            }
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_HEATMAP:
+            heatmap_path = optarg;
+            break;
+        case OPT_THREADS:
+            options.threads = positive_option("threads", optarg);
+            break;
+        case OPT_NUMA:
+            options.numa = true;
+            break;
+        case OPT_HUGE_PAGES:
+            options.huge_pages = true;
+            break;
+        case OPT_TILE_CACHE:
+            tile_cache_dir = optarg;
+            break;
+        case OPT_TILE_CACHE_MB:
+            tile_cache_mb = positive_option("tile-cache-mb", optarg);
+            break;
+        case OPT_CLOUD_MEMORY:
+            options.cloud_budget = (u64)positive_option("cloud-memory", optarg) << 20;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (trace_path) {
+        trace_start();
+    }
+    if (tile_cache_dir) {
+        if (!tile_cache_open(&tile_cache, tile_cache_dir, (u64)tile_cache_mb << 20)) {
+            die("Error: can't use tile cache directory (%s)!", tile_cache_dir);
+        }
+        options.tile_cache = &tile_cache;
+    }
+
+    if (socket_path) {
+        if (argc != optind) {
+            usage(argv[0]);
+        }
+        server.render = options;
+        server.trace_path = trace_path;
+        return serve(socket_path, server) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (stitching) {
+        if (argc - optind < 2) {
+            usage(argv[0]);
+        }
+        return stitch(argv[optind], &argv[optind + 1], argc - optind - 1);
+    }
+
+    if (argc - optind != 4) {
+        usage(argv[0]);
+    }
+
+    s32 width = atoi(argv[optind]);
+    s32 height = atoi(argv[optind + 1]);
+    char *infn = argv[optind + 2];
+    char *outfn = argv[optind + 3];
+
+    if (width < 0 || height < 0) {
+        die("Error: invalid dimensions for output image (%d %d)!", width, height);
+    }
+
+    if (!previous_scene != !previous_image) {
+        die("Error: --previous-scene and --previous-image must be given together!");
+    } else if (previous_scene && (region || split)) {
+        die("Error: incremental rendering can't be combined with --region or --split!");
+    } else if (region && split) {
+        die("Error: --region and --split can't be combined!");
+    } else if (options.deadline_ms && (previous_scene || region || split)) {
+        die("Error: --deadline-ms can't be combined with incremental rendering, --region or --split!");
+    } else if (options.deferred && options.wavefront) {
+        die("Error: --deferred and --wavefront can't be combined!");
+    } else if (heatmap_path && (options.deferred || options.wavefront || options.deadline_ms ||
+                                split || tile_cache_dir)) {
+        die("Error: --heatmap can't be combined with --deferred, --wavefront, --deadline-ms, "
+            "--split or --tile-cache!");
+    } else if (split && strcmp(infn, "-") == 0) {
+        die("Error: --split workers can't read the scene from standard input!");
+    } else if (!format_supported(image_format(outfn)) ||
+               (heatmap_path && !format_supported(image_format(heatmap_path)))) {
+        die("Error: PNG output needs a build with zlib!");
+    } else if (region && (image_format(outfn) != FORMAT_PPM ||
+                          (heatmap_path && image_format(heatmap_path) != FORMAT_PPM))) {
+        die("Error: --region images must be PPM, the only format that records the crop!");
+    }
+
+    if (region) {
+        struct tile_rect *r = &options.region;
+        if (sscanf(region, "%d,%d,%d,%d", &r->x0, &r->y0, &r->x1, &r->y1) != 4 ||
+            r->x0 < 0 || r->y0 < 0 || r->x1 > width || r->y1 > height ||
+            r->x0 >= r->x1 || r->y0 >= r->y1) {
+            die("Error: invalid region (%s) for a %dx%d image!", region, width, height);
+        }
+    }
+
+    struct scene *scene = load_scene(infn);
+    if (!scene->num_cameras) {
+        free_scene(scene);
+        die("Error: no camera was defined by the CSV file!");
+    }
+
+    struct pixmap image = {0};
+    image.width = width;
+    image.height = height;
+    struct tile_rect window = render_window(image, options);
+    size_t image_size = sizeof(pixel) * (window.x1 - window.x0) * (window.y1 - window.y0);
+    image.pixels = malloc(image_size);
+    // Left untouched until the render threads write their tiles
+    if (options.huge_pages && image_size >= HUGE_PAGE_SIZE) {
+        advise_huge_pages(image.pixels, image_size);
+    }
+    if (heatmap_path) {
+        options.cost = malloc(sizeof(struct pixel_cost) * (window.x1 - window.x0) *
+                              (window.y1 - window.y0));
+    }
+
+    if (previous_scene) {
+        options.tile_mask = prepare_incremental(scene, image, previous_scene, previous_image);
+    }
+
+    // Piped output goes out band by band while the rest is still rendering.
+    // Split and deadline renders only have the final image at the very end.
+    bool streaming = strcmp(outfn, "-") == 0 && !split && !options.deadline_ms;
+    struct ppm_pixmap streamed = window_pixmap(image, window, region != NULL);
+    if (streaming) {
+        write_ppm_header(streamed, stdout, streamed.format);
+        options.band_done = write_band;
+        options.band_user = &streamed;
+    }
+
+    if (split) {
+        // Workers get the same options, minus --split itself and --trace,
+        // which only traces this process
+        char **args = malloc(sizeof(char *) * optind);
+        u32 num_args = 0;
+        for (int i = 1; i < optind; i++) {
+            if (strcmp(argv[i], "--split") == 0 || strcmp(argv[i], "--trace") == 0) {
+                i++;
+            } else if (strncmp(argv[i], "--split=", 8) != 0 &&
+                       strncmp(argv[i], "--trace=", 8) != 0) {
+                args[num_args++] = argv[i];
+            }
+        }
+
+        struct tile_rect *regions = malloc(sizeof(struct tile_rect) * split);
+        u32 count = balance_regions(scene, image, split, regions);
+        if (!run_region_workers(args, num_args, infn, image, regions, count)) {
+            die("Error: split render failed!");
+        }
+        free(regions);
+        free(args);
+    } else {
+        // This gets us a pixmap populated with all the colored pixels
+        bool print = options.stats != NULL;
+        if (options.deadline_ms) {
+            options.stats = &stats;
+        }
+        render_scene(scene, image, options);
+        if (options.deadline_ms) {
+            struct quality_level quality = quality_levels[stats.quality_level];
+            fprintf(stderr, "Deadline: quality level %u (1/%u resolution%s), estimated %.1f ms, "
+                    "took %.1f ms\n", stats.quality_level, quality.divisor,
+                    quality.shadows ? "" : ", no shadows", stats.estimated_seconds * 1e3,
+                    stats.seconds * 1e3);
+        }
+        if (print) {
+            print_stats(&stats);
+        }
+    }
+
+    if (!streaming) {
+        struct encode_stats encoded;
+        write_image(outfn, image, window, region != NULL, &encoded);
+        if (options.stats && encoded.format != FORMAT_PPM) {
+            fprintf(stderr, "Encoded %s: %.2f MB to %.2f MB (%.2f:1) in %.1f ms, %.0f MB/s\n",
+                    format_name(encoded.format), encoded.raw_bytes * 1e-6,
+                    encoded.encoded_bytes * 1e-6,
+                    (double)encoded.raw_bytes / encoded.encoded_bytes, encoded.seconds * 1e3,
+                    encoded.raw_bytes * 1e-6 / encoded.seconds);
+        }
+    } else if (fflush(stdout) || ferror(stdout)) {
+        die("Error: failed to write the image to standard output!");
+    }
+    if (heatmap_path) {
+        write_heatmap(heatmap_path, options.cost, image, window);
+    }
+    if (trace_path && !trace_write(trace_path)) {
+        die("Error: failed to write trace (%s)!", trace_path);
+    }
 
     // Clean up
-    fclose(output);
+    free(options.tile_mask);
+    free(options.cost);
     free(image.pixels);
     free_scene(scene);
     return 0;
 }
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Small test client for the render daemon (raycast --serve). Asks for a
+ * render by scene hash first and only uploads the CSV when the daemon
+ * doesn't have the scene resident yet.
+ */
+
+#include "ppmrw.h"
+#include "server.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char *status_names[] = {
+    "ok",
+    "scene not found",
+    "bad request",
+    "bad scene",
+    "busy"
+};
+
+static bool write_full(int fd, const void *buffer, size_t size)
+{
+    const u8 *bytes = buffer;
+    while (size) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static int connect_to(const char *socket_path)
+{
+    struct sockaddr_un address = {0};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Error: failed to connect to %s (%s)!\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Sends one request and copies the image that comes back into the output
+ * file. Returns the status the daemon answered with.
+ */
+static u32 request_render(const char *socket_path, struct render_request request,
+                          struct file_contents *scene, FILE *output)
+{
+    struct render_response response = {0};
+    int fd = connect_to(socket_path);
+
+    if (!write_full(fd, &request, sizeof(request)) ||
+        (request.scene_size && !write_full(fd, scene->memory, scene->size)) ||
+        read(fd, &response, sizeof(response)) != sizeof(response) ||
+        response.magic != RENDER_RESPONSE_MAGIC) {
+        fprintf(stderr, "Error: the render daemon hung up!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (response.status == RENDER_OK) {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, n, output);
+        }
+    }
+
+    close(fd);
+    return response.status;
+}
+
+int main(int argc, char **argv)
+{
+    struct render_request request = {0};
+    int arg = 1;
+
+    if (argc > 2 && strcmp(argv[1], "--camera") == 0) {
+        if (sscanf(argv[2], "%lf,%lf", &request.camera_width, &request.camera_height) != 2) {
+            fprintf(stderr, "Error: invalid camera size (%s)!\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        arg = 3;
+    }
+
+    if (argc - arg != 5) {
+        fprintf(stderr, "Usage: %s [--camera width,height] [socket] [width] [height] [input] [output]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char *socket_path = argv[arg];
+    s32 width = atoi(argv[arg + 1]);
+    s32 height = atoi(argv[arg + 2]);
+    char *infn = argv[arg + 3];
+    char *outfn = argv[arg + 4];
+
+    FILE *input = fopen(infn, "r");
+    if (!input) {
+        fprintf(stderr, "Error: failed to open input file (%s)!\n", infn);
+        exit(EXIT_FAILURE);
+    }
+    struct file_contents scene = get_file_contents(input);
+    fclose(input);
+
+    FILE *output = fopen(outfn, "w");
+    if (!output) {
+        fprintf(stderr, "Error: failed to open output file (%s)!\n", outfn);
+        exit(EXIT_FAILURE);
+    }
+
+    request.magic = RENDER_REQUEST_MAGIC;
+    request.width = width;
+    request.height = height;
+    request.scene_hash = hash_bytes(FNV_OFFSET_BASIS, scene.memory, scene.size);
+
+    u32 status = request_render(socket_path, request, &scene, output);
+    if (status == RENDER_SCENE_NOT_FOUND) {
+        request.scene_size = scene.size;
+        status = request_render(socket_path, request, &scene, output);
+    }
+
+    fclose(output);
+    free(scene.memory);
+
+    if (status != RENDER_OK) {
+        fprintf(stderr, "Error: render failed (%s)!\n",
+                status < sizeof(status_names) / sizeof(*status_names) ? status_names[status] : "unknown");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
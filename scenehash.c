@@ -0,0 +1,104 @@
+#include "scenehash.h"
+#include "hash.h"
+#include "cloud.h"
+
+#include <stdlib.h>
+
+u64 hash_material(u64 hash, struct material *material)
+{
+    hash = hash_bytes(hash, &material->color, sizeof(material->color));
+    hash = hash_bytes(hash, &material->diffuse, sizeof(material->diffuse));
+    hash = hash_bytes(hash, &material->specular, sizeof(material->specular));
+    hash = hash_bytes(hash, &material->reflectivity, sizeof(material->reflectivity));
+    hash = hash_bytes(hash, &material->refractivity, sizeof(material->refractivity));
+    hash = hash_bytes(hash, &material->ior, sizeof(material->ior));
+    return hash;
+}
+
+u64 hash_sphere(u64 hash, struct scene *scene, struct sphere *sphere)
+{
+    hash = hash_bytes(hash, &sphere->pos, sizeof(sphere->pos));
+    hash = hash_bytes(hash, &sphere->rad, sizeof(sphere->rad));
+    return hash_material(hash, &scene->materials[sphere->material]);
+}
+
+// Misses are shaded with the first material at the origin, so that
+// material matters to every pixel. Meshes are hashed by the contents of
+// their files, wherever they live. Clouds aren't read whole, their file is
+// identified by its size, modification time and cluster table instead.
+u64 hash_scene_globals(u64 hash, struct scene *scene)
+{
+    if (scene->num_cameras) {
+        hash = hash_bytes(hash, &scene->cameras[0], sizeof(struct camera));
+    }
+    hash = hash_bytes(hash, scene->lights, sizeof(struct light) * scene->num_lights);
+    if (scene->num_materials) {
+        hash = hash_material(hash, &scene->materials[0]);
+    }
+    for (u32 i = 0; i < scene->num_planes; i++) {
+        struct plane *plane = &scene->planes[i];
+        hash = hash_bytes(hash, &plane->pos, sizeof(plane->pos));
+        hash = hash_bytes(hash, &plane->norm, sizeof(plane->norm));
+        hash = hash_material(hash, &scene->materials[plane->material]);
+    }
+    for (u32 i = 0; i < scene->num_meshes; i++) {
+        struct mesh *mesh = &scene->meshes[i];
+        hash = hash_bytes(hash, &mesh->translation, sizeof(mesh->translation));
+        hash = hash_material(hash, &scene->materials[mesh->material]);
+        hash = hash_bytes(hash, mesh->mapping, mesh->mapping_size);
+    }
+    for (u32 i = 0; i < scene->num_clouds; i++) {
+        struct cloud *cloud = &scene->clouds[i];
+        hash = hash_bytes(hash, &cloud->translation, sizeof(cloud->translation));
+        hash = hash_material(hash, &scene->materials[cloud->material]);
+        hash = hash_bytes(hash, &cloud->file_size, sizeof(cloud->file_size));
+        hash = hash_bytes(hash, &cloud->file_mtime, sizeof(cloud->file_mtime));
+        hash = hash_bytes(hash, cloud->clusters,
+                          sizeof(struct cloud_cluster) * cloud->num_clusters);
+    }
+    return hash;
+}
+
+struct volume volume_from_aabb(struct aabb box)
+{
+    struct volume result = {0};
+    v3 diagonal;
+    v3_add(&result.center, box.min, box.max);
+    v3_scale(&result.center, result.center, 0.5);
+    v3_sub(&diagonal, box.max, box.min);
+    result.radius = 0.5 * v3_magnitude(diagonal);
+    return result;
+}
+
+// Instances are keyed by their translation and the contents of their group
+struct object_key *object_keys(struct scene *scene)
+{
+    u32 count = scene->num_spheres + scene->num_instances;
+    struct object_key *keys = malloc(sizeof(struct object_key) * (count + 1));
+    struct object_key *key = keys;
+
+    for (u32 i = 0; i < scene->num_spheres; i++, key++) {
+        struct sphere *sphere = &scene->spheres[i];
+        key->hash = hash_sphere(FNV_OFFSET_BASIS, scene, sphere);
+        key->bounds.center = sphere->pos;
+        key->bounds.radius = sphere->rad;
+    }
+
+    u64 *group_hashes = malloc(sizeof(u64) * (scene->num_groups + 1));
+    for (u32 i = 0; i < scene->num_groups; i++) {
+        struct group *group = &scene->groups[i];
+        group_hashes[i] = FNV_OFFSET_BASIS;
+        for (u32 j = 0; j < group->num_spheres; j++) {
+            group_hashes[i] = hash_sphere(group_hashes[i], scene, &group->spheres[j]);
+        }
+    }
+    for (u32 i = 0; i < scene->num_instances; i++, key++) {
+        struct instance *instance = &scene->instances[i];
+        struct group *group = &scene->groups[instance->group];
+        key->hash = hash_bytes(group_hashes[instance->group], &instance->translation,
+                               sizeof(instance->translation));
+        key->bounds = volume_from_aabb(aabb_translate(group->bounds, instance->translation));
+    }
+    free(group_hashes);
+    return keys;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Render benchmark: renders every scene with the given binary and prints
+# the best wall time out of BENCH_RUNS runs, followed by the total.
+#
+#   scripts/bench.sh ./raycast [scene.csv ...]
+#
+# BENCH_SIZE (default "640 480"), BENCH_RUNS (default 3) and BENCH_ARGS
+# (extra renderer options) can be set in the environment.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv ...]" >&2
+    exit 1
+fi
+
+binary=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/../scenes/*.csv
+fi
+
+size=${BENCH_SIZE:-640 480}
+runs=${BENCH_RUNS:-3}
+total=0
+
+for scene in "$@"; do
+    best=
+    run=0
+    while [ $run -lt "$runs" ]; do
+        start=$(date +%s%N)
+        # shellcheck disable=SC2086
+        "$binary" $BENCH_ARGS $size "$scene" /dev/null || exit 1
+        end=$(date +%s%N)
+        elapsed=$(( (end - start) / 1000 ))
+        if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+            best=$elapsed
+        fi
+        run=$((run + 1))
+    done
+    total=$((total + best))
+    printf "%-24s %10d.%03d ms\n" "$(basename "$scene")" $((best / 1000)) $((best % 1000))
+done
+
+printf "%-24s %10d.%03d ms\n" "total" $((total / 1000)) $((total % 1000))
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""Writes particles to the clustered cloud format (see cloud.h).
+
+    scripts/cloud.py particles.txt model.cloud
+    scripts/cloud.py --random COUNT [--seed SEED] model.cloud
+
+Particles are read one per line as x, y, z and radius, separated by commas
+or spaces, with # starting a comment. --random instead scatters COUNT
+particles through a unit ball, denser towards its center.
+
+Particles are sorted along a Morton curve through their centers and cut
+into clusters of CLUSTER_SIZE consecutive ones, so each cluster covers a
+compact region. Cluster bounds are rounded outwards to floats so they
+always contain their particles.
+"""
+
+import argparse
+import math
+import random
+import struct
+import sys
+
+CLOUD_MAGIC = 0x554F4C43
+CLOUD_VERSION = 1
+CLOUD_PAGE_SIZE = 4096
+CLUSTER_SIZE = 1024
+MORTON_BITS = 21
+
+
+def to_float(value):
+    return struct.unpack("<f", struct.pack("<f", value))[0]
+
+
+def float_step(value, up):
+    """The float next to value towards +inf when up, -inf otherwise."""
+    bits = struct.unpack("<i", struct.pack("<f", value))[0]
+    if value == 0:
+        return to_float(1e-45 if up else -1e-45)
+    if (value > 0) == up:
+        bits += 1
+    else:
+        bits -= 1
+    return struct.unpack("<f", struct.pack("<i", bits))[0]
+
+
+def float_down(value):
+    result = to_float(value)
+    return float_step(result, False) if result > value else result
+
+
+def float_up(value):
+    result = to_float(value)
+    return float_step(result, True) if result < value else result
+
+
+def read_particles(path):
+    particles = []
+    with open(path) as text:
+        for number, line in enumerate(text, 1):
+            fields = line.split("#")[0].replace(",", " ").split()
+            if not fields:
+                continue
+            if len(fields) != 4:
+                sys.exit(f"Error: {path}:{number} isn't x, y, z, radius!")
+            particles.append(tuple(to_float(float(x)) for x in fields))
+    return particles
+
+
+def random_particles(count, seed):
+    generator = random.Random(seed)
+    particles = []
+    while len(particles) < count:
+        x, y, z = (generator.uniform(-1, 1) for _ in range(3))
+        distance = math.sqrt(x * x + y * y + z * z)
+        # Rejection sampling, keeping points with a falloff from the center
+        if distance > 1 or generator.random() > 1 - distance * distance:
+            continue
+        radius = generator.uniform(0.004, 0.012)
+        particles.append(tuple(to_float(v) for v in (x, y, z, radius)))
+    return particles
+
+
+def spread(value):
+    """Interleaves the low MORTON_BITS bits of value with two zero bits."""
+    result = 0
+    for bit in range(MORTON_BITS):
+        result |= ((value >> bit) & 1) << (3 * bit)
+    return result
+
+
+def morton_sort(particles):
+    lo = [min(p[k] for p in particles) for k in range(3)]
+    hi = [max(p[k] for p in particles) for k in range(3)]
+    scale = [((1 << MORTON_BITS) - 1) / (hi[k] - lo[k]) if hi[k] > lo[k] else 0
+             for k in range(3)]
+
+    def code(p):
+        x, y, z = (int((p[k] - lo[k]) * scale[k]) for k in range(3))
+        return spread(x) | spread(y) << 1 | spread(z) << 2
+
+    particles.sort(key=code)
+
+
+def write_cloud(path, particles):
+    clusters = [particles[i:i + CLUSTER_SIZE] for i in range(0, len(particles), CLUSTER_SIZE)]
+    table_end = 24 + 40 * len(clusters)
+    offset = (table_end + CLOUD_PAGE_SIZE - 1) // CLOUD_PAGE_SIZE * CLOUD_PAGE_SIZE
+    offsets = []
+    for cluster in clusters:
+        offsets.append(offset)
+        size = 16 * len(cluster)
+        offset += (size + CLOUD_PAGE_SIZE - 1) // CLOUD_PAGE_SIZE * CLOUD_PAGE_SIZE
+
+    with open(path, "wb") as cloud:
+        cloud.write(struct.pack("<4IQ", CLOUD_MAGIC, CLOUD_VERSION, len(clusters), 0,
+                                len(particles)))
+        for cluster, cluster_offset in zip(clusters, offsets):
+            low = [float_down(min(p[k] - p[3] for p in cluster)) for k in range(3)]
+            high = [float_up(max(p[k] + p[3] for p in cluster)) for k in range(3)]
+            cloud.write(struct.pack("<6fQ2I", *low, *high, cluster_offset, len(cluster), 0))
+        for cluster, cluster_offset in zip(clusters, offsets):
+            cloud.write(b"\0" * (cluster_offset - cloud.tell()))
+            for particle in cluster:
+                cloud.write(struct.pack("<4f", *particle))
+    return len(clusters)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Writes particles to the cloud format.")
+    parser.add_argument("--random", type=int, metavar="COUNT",
+                        help="scatter COUNT particles through a unit ball instead")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("paths", nargs="+", metavar="path",
+                        help="[input.txt] output.cloud")
+    args = parser.parse_args()
+    if len(args.paths) != (1 if args.random else 2):
+        parser.error("expected an input and an output file, or --random and an output file")
+
+    if args.random:
+        particles = random_particles(args.random, args.seed)
+    else:
+        particles = read_particles(args.paths[0])
+    if not particles:
+        sys.exit("Error: no particles!")
+    morton_sort(particles)
+    num_clusters = write_cloud(args.paths[-1], particles)
+    print(f"{args.paths[-1]}: {len(particles)} particles, {num_clusters} clusters")
+
+
+if __name__ == "__main__":
+    main()
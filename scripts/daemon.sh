@@ -0,0 +1,57 @@
+#!/bin/sh
+# Render daemon check: uploads scenes cut short in the middle of a value to
+# one daemon, each of which has to be answered with an error, then renders
+# a valid scene through the same daemon and compares it against a direct
+# render.
+#
+#   scripts/daemon.sh ./raycast ./raycast-client [scene.csv]
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 [binary] [client] [scene.csv]" >&2
+    exit 1
+fi
+
+binary=$1
+client=$2
+scene=${3:-"$(dirname "$0")"/../test.csv}
+output=$(mktemp -d)
+socket=$output/raycast.sock
+
+"$binary" --serve "$socket" 2>"$output/daemon" &
+daemon=$!
+trap 'kill $daemon 2>/dev/null; rm -rf "$output"' EXIT
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$socket" ] && break
+    sleep 0.5
+done
+
+failed=0
+for line in "sphere, radius: 1, position: [0" "sphere, radius: 1, position: [0, 1" \
+            "plane, normal: [0, 1" "light, color: [1, 1" "sphere, radius"; do
+    printf 'camera, width: 2, height: 2\n%s' "$line" >"$output/truncated.csv"
+    "$client" "$socket" 32 32 "$output/truncated.csv" "$output/image.ppm" 2>"$output/stderr"
+    status=$?
+    if [ $status -eq 0 ] || ! grep -q "bad scene" "$output/stderr"; then
+        echo "FAIL: \"$line\" wasn't rejected as a bad scene (exit $status)"
+        cat "$output/stderr"
+        failed=1
+    fi
+done
+
+if ! kill -0 $daemon 2>/dev/null; then
+    echo "FAIL: the daemon exited"
+    cat "$output/daemon"
+    exit 1
+fi
+
+"$binary" 64 48 "$scene" "$output/direct.ppm"
+if ! "$client" "$socket" 64 48 "$scene" "$output/served.ppm"; then
+    echo "FAIL: the daemon didn't render $scene"
+    failed=1
+elif ! cmp -s "$output/direct.ppm" "$output/served.ppm"; then
+    echo "FAIL: the daemon rendered $scene differently"
+    failed=1
+fi
+[ $failed -eq 0 ] && echo "Daemon rejected every malformed scene and kept serving"
+exit $failed
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""Converts a Wavefront OBJ file to the binary mesh format (see mesh.h).
+
+    scripts/obj2mesh.py model.obj model.mesh
+
+Only vertex positions (v) and faces (f) are read. Polygons are split into
+triangle fans, and negative (relative) face indices are supported.
+"""
+
+import struct
+import sys
+
+MESH_MAGIC = 0x4853454D
+MESH_VERSION = 1
+
+
+def read_obj(path):
+    vertices = []
+    triangles = []
+    with open(path) as obj:
+        for number, line in enumerate(obj, 1):
+            fields = line.split()
+            if not fields:
+                continue
+            if fields[0] == "v":
+                vertices.append(tuple(float(x) for x in fields[1:4]))
+            elif fields[0] == "f":
+                face = []
+                for field in fields[1:]:
+                    index = int(field.split("/")[0])
+                    index = index - 1 if index > 0 else len(vertices) + index
+                    if not 0 <= index < len(vertices):
+                        sys.exit(f"Error: {path}:{number} references a missing vertex!")
+                    face.append(index)
+                for k in range(1, len(face) - 1):
+                    triangles.append((face[0], face[k], face[k + 1]))
+    return vertices, triangles
+
+
+def write_mesh(path, vertices, triangles):
+    with open(path, "wb") as mesh:
+        mesh.write(struct.pack("<4I", MESH_MAGIC, MESH_VERSION, len(vertices), len(triangles)))
+        for vertex in vertices:
+            mesh.write(struct.pack("<3f", *vertex))
+        for triangle in triangles:
+            mesh.write(struct.pack("<3I", *triangle))
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(f"Usage: {sys.argv[0]} [input.obj] [output.mesh]")
+    vertices, triangles = read_obj(sys.argv[1])
+    write_mesh(sys.argv[2], vertices, triangles)
+    print(f"{sys.argv[2]}: {len(vertices)} vertices, {len(triangles)} triangles")
+
+
+if __name__ == "__main__":
+    main()
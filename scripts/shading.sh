@@ -0,0 +1,49 @@
+#!/bin/sh
+# Shading kernel benchmark: renders every scene with the kernel specialized
+# for its features and with the generic one, and prints the best render
+# time out of BENCH_RUNS runs along with the branch counts reported by
+# --stats (when perf counters are available).
+#
+#   scripts/shading.sh ./raycast [scene.csv ...]
+#
+# BENCH_SIZE (default "640 480"), BENCH_RUNS (default 3) and BENCH_ARGS
+# (extra renderer options) can be set in the environment.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv ...]" >&2
+    exit 1
+fi
+
+binary=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/../scenes/*.csv
+fi
+
+size=${BENCH_SIZE:-640 480}
+runs=${BENCH_RUNS:-3}
+
+printf "%-20s %-12s %-22s %12s %14s %14s\n" "scene" "kernel" "features" "time" "branches" "mispredicted"
+for scene in "$@"; do
+    for kernel in generic specialized; do
+        run=0
+        while [ $run -lt "$runs" ]; do
+            # shellcheck disable=SC2086
+            "$binary" --stats --kernel $kernel $BENCH_ARGS $size "$scene" /dev/null 2>&1 || exit 1
+            run=$((run + 1))
+        done | awk -v scene="$(basename "$scene")" -v kernel=$kernel '
+            /^Rendered/ { ms = $(NF - 1); if (best == "" || ms < best) best = ms }
+            /^Shading kernel/ {
+                features = ""
+                if ($4 == "on,") features = features "spot "
+                if ($6 == "on,") features = features "spec "
+                if ($8 == "on") features = features "planes"
+                if (features == "") features = "-"
+            }
+            /^Branches/ { branches = $2; missed = $3; sub(",", "", branches) }
+            END {
+                if (branches == "") { branches = missed = "n/a" }
+                printf "%-20s %-12s %-22s %9s ms %14s %14s\n", scene, kernel, features, best, branches, missed
+            }'
+    done
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Image size check: renders test.csv at empty, single pixel and partial
+# tile sizes in every traversal order and rendering mode, and writes each
+# format, failing on any crash or error exit.
+#
+#   scripts/sizes.sh ./raycast [scene.csv]
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv]" >&2
+    exit 1
+fi
+
+binary=$1
+scene=${2:-"$(dirname "$0")"/../test.csv}
+output=$(mktemp -d)
+trap 'rm -rf "$output"' EXIT
+
+failed=0
+for size in "0 0" "0 10" "10 0" "1 1" "1 40" "40 1" "33 65"; do
+    for args in "" "--order morton" "--order hilbert" "--wavefront" "--deferred" \
+                "--threads 3" "--primary raster"; do
+        for format in ppm qoi png; do
+            # shellcheck disable=SC2086
+            "$binary" $args $size "$scene" "$output/image.$format" 2>"$output/stderr"
+            status=$?
+            # PNG output is left out of builds without zlib
+            if [ $status -ne 0 ] && ! grep -q "needs a build with zlib" "$output/stderr"; then
+                echo "FAIL: $binary $args $size $scene image.$format (exit $status)"
+                cat "$output/stderr"
+                failed=1
+            fi
+        done
+    done
+done
+[ $failed -eq 0 ] && echo "All sizes rendered"
+exit $failed
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs the render benchmark for a baseline binary and every variant given
+# after it, then reports each variant's total time and speedup.
+#
+#   scripts/speedup.sh ./raycast ./raycast-lto ./raycast-pgo
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 [baseline] [variant ...]" >&2
+    exit 1
+fi
+
+bench="$(dirname "$0")/bench.sh"
+
+total_us() {
+    "$bench" "$1" | awk '$1 == "total" { split($2, t, "."); print t[1] * 1000 + t[2] }'
+}
+
+baseline=$(total_us "$1") || exit 1
+report() {
+    awk -v name="$1" -v time="$2" -v base="$baseline" \
+        'BEGIN { printf "%-24s %10.3f %7.2fx\n", name, time / 1000, base / time }'
+}
+
+printf "%-24s %10s %8s\n" "binary" "total ms" "speedup"
+report "$(basename "$1")" "$baseline"
+shift
+
+for variant in "$@"; do
+    time=$(total_us "$variant") || exit 1
+    report "$(basename "$variant")" "$time"
+done
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Split render check: renders a scene with --split into one band, several
+# bands, more bands than rows and empty images, and compares each against a
+# render in a single process, failing on any difference or error exit.
+#
+#   scripts/split.sh ./raycast [scene.csv]
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv]" >&2
+    exit 1
+fi
+
+binary=$1
+scene=${2:-"$(dirname "$0")"/../test.csv}
+output=$(mktemp -d)
+trap 'rm -rf "$output"' EXIT
+
+failed=0
+for case in "1 64 48" "3 10 5" "2 64 48" "4 33 65" "16 40 9" "2 10 0" "2 0 10" "2 0 0"; do
+    set -- $case
+    count=$1
+    size="$2 $3"
+    # shellcheck disable=SC2086
+    "$binary" $size "$scene" "$output/direct.ppm"
+    # shellcheck disable=SC2086
+    "$binary" --split $count $size "$scene" "$output/split.ppm" 2>"$output/stderr"
+    status=$?
+    if [ $status -ne 0 ]; then
+        echo "FAIL: $binary --split $count $size $scene (exit $status)"
+        cat "$output/stderr"
+        failed=1
+    elif ! cmp -s "$output/direct.ppm" "$output/split.ppm"; then
+        echo "FAIL: $binary --split $count $size $scene differs from a single process render"
+        failed=1
+    fi
+done
+[ $failed -eq 0 ] && echo "All split renders match"
+exit $failed
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Threading benchmark: renders every scene on one thread, then on
+# BENCH_THREADS threads unpinned, pinned with a copy of the scene per NUMA
+# node (--numa), and additionally with transparent huge pages
+# (--huge-pages). Prints the best render time out of BENCH_RUNS runs, the
+# speedup over one thread and the LLC misses reported by --stats (when
+# perf counters are available).
+#
+#   scripts/threads.sh ./raycast [scene.csv ...]
+#
+# BENCH_SIZE (default "640 480"), BENCH_RUNS (default 3), BENCH_THREADS
+# (default: every CPU) and BENCH_ARGS (extra renderer options) can be set
+# in the environment.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv ...]" >&2
+    exit 1
+fi
+
+binary=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/../scenes/*.csv
+fi
+
+size=${BENCH_SIZE:-640 480}
+runs=${BENCH_RUNS:-3}
+threads=${BENCH_THREADS:-$(nproc)}
+nodes=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+echo "$threads threads, $nodes NUMA node(s)"
+
+printf "%-20s %-32s %12s %9s %14s\n" "scene" "mode" "time" "speedup" "LLC misses"
+for scene in "$@"; do
+    base=""
+    for mode in "1" "$threads" "$threads --numa" "$threads --numa --huge-pages"; do
+        run=0
+        result=$(while [ $run -lt "$runs" ]; do
+            # shellcheck disable=SC2086
+            "$binary" --stats --threads $mode $BENCH_ARGS $size "$scene" /dev/null 2>&1 || exit 1
+            run=$((run + 1))
+        done | awk '
+            /^Rendered/ { ms = $(NF - 1); if (best == "" || ms < best) best = ms }
+            /^Cache misses: L1D/ { llc = $NF }
+            END { print best, (llc == "" ? "n/a" : llc) }') || exit 1
+        ms=${result% *}
+        llc=${result#* }
+        base=${base:-$ms}
+        printf "%-20s %-32s %9s ms %8sx %14s\n" "$(basename "$scene")" "--threads $mode" \
+            "$ms" "$(awk -v a="$base" -v b="$ms" 'BEGIN { printf "%.2f", a / b }')" "$llc"
+    done
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Traversal order benchmark: renders every scene in scanline, Morton and
+# Hilbert order and prints the render time and the L1D, L2 and LLC miss
+# counts reported by --stats (when perf counters are available).
+#
+#   scripts/traversal.sh ./raycast [scene.csv ...]
+#
+# BENCH_SIZE (default "640 480") and BENCH_ARGS (extra renderer options)
+# can be set in the environment.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [binary] [scene.csv ...]" >&2
+    exit 1
+fi
+
+binary=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/../scenes/*.csv
+fi
+
+size=${BENCH_SIZE:-640 480}
+
+printf "%-20s %-9s %12s %14s %14s %14s\n" "scene" "order" "time" "L1D misses" "L2 misses" "LLC misses"
+for scene in "$@"; do
+    for order in scanline morton hilbert; do
+        # shellcheck disable=SC2086
+        stats=$("$binary" --stats --order $order $BENCH_ARGS $size "$scene" /dev/null 2>&1) || exit 1
+        echo "$stats" | awk -v scene="$(basename "$scene")" -v order=$order '
+            /^Rendered/ { time = $(NF - 1) " ms" }
+            /^Cache misses: L1D/ { l1 = $4; l2 = $6; llc = $8; sub(",", "", l1); sub(",", "", l2) }
+            END {
+                if (l1 == "") { l1 = l2 = llc = "n/a" }
+                printf "%-20s %-9s %12s %14s %14s %14s\n", scene, order, time, l1, l2, llc
+            }'
+    done
+done
@@ -0,0 +1,381 @@
+#include "server.h"
+#include "csv_parser.h"
+#include "hash.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct scene_entry {
+    u64 hash;
+    struct scene *scene;
+    u32 refs;
+    u64 last_used;
+};
+
+struct server {
+    int listen_fd;
+    struct server_options options;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+    // Bounded queue of accepted connections waiting for a worker
+    int *queue;
+    u32 queue_head;
+    u32 queue_count;
+
+    // Resident scenes. Room is left for one extra scene per worker, since
+    // every scene in use stays resident until it is released.
+    struct scene_entry *scenes;
+    u32 num_scenes;
+    u64 clock;
+};
+
+static bool read_full(int fd, void *buffer, size_t size)
+{
+    u8 *bytes = buffer;
+    while (size) {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buffer, size_t size)
+{
+    const u8 *bytes = buffer;
+    while (size) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void send_status(int fd, enum render_status status)
+{
+    struct render_response response = {RENDER_RESPONSE_MAGIC, status};
+    write_full(fd, &response, sizeof(response));
+}
+
+/*
+ * Scene cache
+ * ===========
+ * All functions expect server->lock to be held.
+ */
+static struct scene_entry *find_scene(struct server *server, u64 hash)
+{
+    for (u32 i = 0; i < server->num_scenes; i++) {
+        if (server->scenes[i].hash == hash) {
+            return &server->scenes[i];
+        }
+    }
+    return NULL;
+}
+
+// Drops least recently used scenes nobody is rendering until under the limit
+static void evict_scenes(struct server *server, u32 limit)
+{
+    while (server->num_scenes > limit) {
+        struct scene_entry *victim = NULL;
+        for (u32 i = 0; i < server->num_scenes; i++) {
+            struct scene_entry *entry = &server->scenes[i];
+            if (!entry->refs && (!victim || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (!victim) {
+            return;
+        }
+        free_scene(victim->scene);
+        *victim = server->scenes[--server->num_scenes];
+    }
+}
+
+static struct scene *acquire_scene(struct server *server, u64 hash)
+{
+    struct scene_entry *entry = find_scene(server, hash);
+    if (!entry) {
+        return NULL;
+    }
+    entry->refs++;
+    entry->last_used = server->clock++;
+    return entry->scene;
+}
+
+// Makes a freshly built scene resident and takes a reference on it. If
+// another worker got there first, ours is dropped in favour of theirs.
+static struct scene *insert_scene(struct server *server, u64 hash, struct scene *scene)
+{
+    struct scene *existing = acquire_scene(server, hash);
+    if (existing) {
+        free_scene(scene);
+        return existing;
+    }
+
+    evict_scenes(server, server->options.max_scenes - 1);
+    struct scene_entry *entry = &server->scenes[server->num_scenes++];
+    entry->hash = hash;
+    entry->scene = scene;
+    entry->refs = 1;
+    entry->last_used = server->clock++;
+    return scene;
+}
+
+static void release_scene(struct server *server, u64 hash)
+{
+    struct scene_entry *entry = find_scene(server, hash);
+    entry->refs--;
+    evict_scenes(server, server->options.max_scenes);
+}
+
+/*
+ * Request handling
+ * ================
+ */
+static bool valid_request(struct render_request *request)
+{
+    return request->magic == RENDER_REQUEST_MAGIC &&
+           request->width > 0 && request->width <= MAX_REQUEST_DIMENSION &&
+           request->height > 0 && request->height <= MAX_REQUEST_DIMENSION &&
+           request->scene_size <= MAX_REQUEST_SCENE_SIZE;
+}
+
+// Reads the uploaded CSV and builds a scene from it, NULL if the upload is
+// incomplete, doesn't match the hash it was sent with or isn't a valid
+// scene (reported in status)
+static struct scene *receive_scene(int fd, struct render_request *request, u32 *status)
+{
+    struct file_contents fc = {0};
+    fc.size = request->scene_size;
+    fc.memory = malloc(fc.size);
+
+    if (!read_full(fd, fc.memory, fc.size) ||
+        hash_bytes(FNV_OFFSET_BASIS, fc.memory, fc.size) != request->scene_hash) {
+        free(fc.memory);
+        *status = RENDER_BAD_REQUEST;
+        return NULL;
+    }
+
+    struct scene *scene = malloc(sizeof(struct scene));
+    int result = construct_scene(&fc, scene);
+    free(fc.memory);
+    if (result != SCENE_SUCCESS) {
+        free(scene);
+        *status = RENDER_BAD_SCENE;
+        return NULL;
+    }
+    return scene;
+}
+
+static void handle_connection(struct server *server, int fd)
+{
+    struct render_request request;
+    if (!read_full(fd, &request, sizeof(request)) || !valid_request(&request)) {
+        send_status(fd, RENDER_BAD_REQUEST);
+        return;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    struct scene *scene = acquire_scene(server, request.scene_hash);
+    pthread_mutex_unlock(&server->lock);
+
+    if (!scene && !request.scene_size) {
+        send_status(fd, RENDER_SCENE_NOT_FOUND);
+        return;
+    } else if (!scene) {
+        u32 status;
+        u64 span = trace_begin();
+        struct scene *uploaded = receive_scene(fd, &request, &status);
+        trace_end("receive scene", span);
+        if (!uploaded) {
+            send_status(fd, status);
+            return;
+        }
+        pthread_mutex_lock(&server->lock);
+        scene = insert_scene(server, request.scene_hash, uploaded);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    // Render through a shallow copy so the camera can be overridden
+    // without touching the shared scene
+    struct scene view = *scene;
+    struct camera camera = {request.camera_width, request.camera_height};
+    if (camera.width > 0 && camera.height > 0) {
+        view.cameras = &camera;
+        view.num_cameras = 1;
+    }
+
+    struct pixmap image = {0};
+    if (view.num_cameras) {
+        image.width = request.width;
+        image.height = request.height;
+        image.pixels = malloc(sizeof(pixel) * image.width * image.height);
+        render_scene(&view, image, server->options.render);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    release_scene(server, request.scene_hash);
+    pthread_mutex_unlock(&server->lock);
+
+    if (!image.pixels) {
+        send_status(fd, RENDER_BAD_SCENE);
+        return;
+    }
+
+    struct ppm_pixmap pm = {0};
+    pm.format = P6_PPM;
+    pm.width = image.width;
+    pm.height = image.height;
+    pm.maxval = 255;
+    pm.pixmap = image.pixels;
+
+    u64 span = trace_begin();
+    send_status(fd, RENDER_OK);
+    FILE *output = fdopen(dup(fd), "w");
+    if (output) {
+        write_ppm_header(pm, output, pm.format);
+        write_p6_pixmap(pm, output);
+        fclose(output);
+    }
+    trace_end("send image", span);
+    free(image.pixels);
+}
+
+static void *worker_main(void *arg)
+{
+    struct server *server = arg;
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->queue_count) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % server->options.queue_size;
+        server->queue_count--;
+        pthread_mutex_unlock(&server->lock);
+
+        u64 span = trace_begin();
+        handle_connection(server, fd);
+        close(fd);
+        trace_end("request", span);
+    }
+    return NULL;
+}
+
+static volatile sig_atomic_t trace_requested;
+
+static void request_trace(int signal)
+{
+    (void)signal;
+    trace_requested = 1;
+}
+
+// Writes the trace from the accept loop, outside the signal handler
+static void dump_trace(const char *path)
+{
+    trace_requested = 0;
+    if (trace_write(path)) {
+        fprintf(stderr, "Trace written to %s\n", path);
+    } else {
+        fprintf(stderr, "Error: failed to write trace (%s)!\n", path);
+    }
+}
+
+/*
+ * Listens on the socket and renders requests until the process is killed.
+ * Only returns on setup errors. With a trace path, SIGUSR1 writes out the
+ * spans recorded so far.
+ */
+int serve(const char *socket_path, struct server_options options)
+{
+    struct server server = {0};
+    struct sockaddr_un address = {0};
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path is too long (%s)!\n", socket_path);
+        return -1;
+    }
+
+    // Clients hanging up early must not take the daemon down with them
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (server.listen_fd < 0 ||
+        bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server.listen_fd, options.queue_size) < 0) {
+        fprintf(stderr, "Error: failed to listen on %s (%s)!\n", socket_path, strerror(errno));
+        return -1;
+    }
+
+    server.options = options;
+    // Workers render concurrently, so they don't share a stats block
+    server.options.render.stats = NULL;
+    server.queue = malloc(sizeof(int) * options.queue_size);
+    server.scenes = malloc(sizeof(struct scene_entry) * (options.max_scenes + options.workers));
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    // Workers inherit a mask blocking SIGUSR1, so it always interrupts
+    // accept() below. No SA_RESTART, or accept() would just resume.
+    sigset_t usr1, previous;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    if (options.trace_path) {
+        struct sigaction action = {0};
+        action.sa_handler = request_trace;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+    pthread_sigmask(SIG_BLOCK, &usr1, &previous);
+    for (u32 i = 0; i < options.workers; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker_main, &server);
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    while (true) {
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (trace_requested) {
+            dump_trace(options.trace_path);
+        }
+        if (fd < 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&server.lock);
+        if (server.queue_count == options.queue_size) {
+            pthread_mutex_unlock(&server.lock);
+            send_status(fd, RENDER_BUSY);
+            close(fd);
+            continue;
+        }
+        u32 tail = (server.queue_head + server.queue_count) % options.queue_size;
+        server.queue[tail] = fd;
+        server.queue_count++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+    return 0;
+}
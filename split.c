@@ -0,0 +1,162 @@
+#include "split.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static inline double elapsed_seconds(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/*
+ * Estimates the cost of every band of rows by timing a sparse sample of its
+ * pixels (one row per band, every 8th pixel), then cuts the image where the
+ * running cost crosses each multiple of total / count.
+ */
+u32 balance_regions(struct scene *scene, struct pixmap image, u32 count,
+                    struct tile_rect *regions)
+{
+    u32 num_bands = (image.height + SPLIT_ROW_GRANULARITY - 1) / SPLIT_ROW_GRANULARITY;
+    if (!image.width || !num_bands) {
+        return 0;
+    }
+    double *costs = malloc(sizeof(double) * num_bands);
+    double total = 0;
+    v3 ro = {0};
+
+    for (u32 band = 0; band < num_bands; band++) {
+        struct timespec start, end;
+        int row = band * SPLIT_ROW_GRANULARITY + SPLIT_ROW_GRANULARITY / 2;
+        row = row < image.height ? row : image.height - 1;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < image.width; j += 8) {
+            raycast(scene, ro, primary_ray(scene->cameras[0], image, row, j));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        costs[band] = elapsed_seconds(start, end);
+        total += costs[band];
+    }
+
+    if (count > num_bands) {
+        count = num_bands;
+    }
+
+    u32 region = 0;
+    u32 band = 0;
+    double running = 0;
+    for (region = 0; region < count; region++) {
+        regions[region].x0 = 0;
+        regions[region].x1 = image.width;
+        regions[region].y0 = band * SPLIT_ROW_GRANULARITY;
+
+        // Leave at least one band for every region still to come
+        double target = total * (region + 1) / count;
+        do {
+            running += costs[band++];
+        } while (band < num_bands - (count - region - 1) && running < target);
+
+        regions[region].y1 = band * SPLIT_ROW_GRANULARITY;
+    }
+    regions[count - 1].y1 = image.height;
+
+    free(costs);
+    return count;
+}
+
+bool stitch_region(struct pixmap image, const char *path)
+{
+    FILE *input = fopen(path, "r");
+    if (!input) {
+        return false;
+    }
+    struct file_contents fc = get_file_contents(input);
+    fclose(input);
+
+    struct ppm_pixmap pm = {0};
+    int status = init_ppm_pixmap(&pm, &fc);
+    free(fc.memory);
+    if (status != INIT_SUCCESS) {
+        handle_init_error_code(status);
+        return false;
+    }
+
+    bool fits = pm.full_width == image.width && pm.full_height == image.height &&
+                pm.x_offset + pm.width <= image.width && pm.y_offset + pm.height <= image.height;
+    if (fits) {
+        for (u32 i = 0; i < pm.height; i++) {
+            memcpy(&image.pixels[(pm.y_offset + i) * image.width + pm.x_offset],
+                   &pm.pixmap[i * pm.width], sizeof(pixel) * pm.width);
+        }
+    }
+    free(pm.pixmap);
+    return fits;
+}
+
+bool run_region_workers(char **args, u32 num_args, const char *input, struct pixmap image,
+                        struct tile_rect *regions, u32 count)
+{
+    char (*paths)[32] = malloc(sizeof(*paths) * count);
+    pid_t *workers = malloc(sizeof(pid_t) * count);
+    bool success = true;
+
+    for (u32 r = 0; r < count; r++) {
+        strcpy(paths[r], "/tmp/raycast-regionXXXXXX");
+        int fd = mkstemp(paths[r]);
+        if (fd < 0) {
+            fprintf(stderr, "Error: failed to create a temporary file for a region!\n");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+
+        // args --region x0,y0,x1,y1 width height input partial
+        char spec[64], width[16], height[16];
+        snprintf(spec, sizeof(spec), "%d,%d,%d,%d", regions[r].x0, regions[r].y0,
+                 regions[r].x1, regions[r].y1);
+        snprintf(width, sizeof(width), "%u", image.width);
+        snprintf(height, sizeof(height), "%u", image.height);
+
+        char **argv = malloc(sizeof(char *) * (num_args + 8));
+        u32 argc = 0;
+        argv[argc++] = "raycast";
+        for (u32 i = 0; i < num_args; i++) {
+            argv[argc++] = args[i];
+        }
+        argv[argc++] = "--region";
+        argv[argc++] = spec;
+        argv[argc++] = width;
+        argv[argc++] = height;
+        argv[argc++] = (char *)input;
+        argv[argc++] = paths[r];
+        argv[argc] = NULL;
+
+        workers[r] = fork();
+        if (workers[r] == 0) {
+            execv("/proc/self/exe", argv);
+            _exit(127);
+        }
+        free(argv);
+    }
+
+    for (u32 r = 0; r < count; r++) {
+        int status;
+        if (workers[r] < 0 || waitpid(workers[r], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Error: worker for rows %d-%d failed!\n", regions[r].y0, regions[r].y1);
+            success = false;
+        } else if (!stitch_region(image, paths[r])) {
+            fprintf(stderr, "Error: worker for rows %d-%d wrote an unusable image!\n",
+                    regions[r].y0, regions[r].y1);
+            success = false;
+        }
+        unlink(paths[r]);
+    }
+
+    free(workers);
+    free(paths);
+    return success;
+}
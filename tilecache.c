@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include "tilecache.h"
+#include "hash.h"
+#include "cloud.h"
+#include "raster.h"
+#include "scenehash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct tile_file_header {
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 width;
+    u32 height;
+};
+
+struct tile_object {
+    u64 hash;
+    struct volume bounds;
+    // Pixels its bounds project to, empty when no primary ray reaches it
+    struct tile_rect pixels;
+};
+
+// Lines through the light whose direction is within spread of axis or
+// -axis, which holds every shadow ray some receiver can send to it
+struct shadow_cone {
+    v3 light;
+    v3 axis;
+    double spread;
+};
+
+// Part of a plane the primary rays of a tile can hit: where the rays
+// through the tile's corner pixels hit it, and the directions it runs off
+// to infinity in
+struct plane_region {
+    v3 corners[4];
+    v3 directions[4];
+    u32 num_corners;
+    u32 num_directions;
+    // Every primary ray of the tile hits the plane
+    bool covers_tile;
+};
+
+/* ---- Keys ---- */
+
+static u64 hash_globals(struct scene *scene, struct pixmap image, bool skip_shadows)
+{
+    u32 version = TILE_CACHE_VERSION;
+    u64 hash = hash_bytes(FNV_OFFSET_BASIS, &version, sizeof(version));
+    hash = hash_bytes(hash, &image.width, sizeof(image.width));
+    hash = hash_bytes(hash, &image.height, sizeof(image.height));
+    hash = hash_bytes(hash, &skip_shadows, sizeof(skip_shadows));
+    return hash_scene_globals(hash, scene);
+}
+
+static void add_object(struct tile_object *object, u64 hash, struct volume bounds,
+                       struct scene *scene, struct pixmap image)
+{
+    object->hash = hash;
+    object->bounds = bounds;
+    if (!project_volume(bounds.center, bounds.radius, scene->cameras[0], image,
+                        &object->pixels)) {
+        object->pixels = (struct tile_rect){0};
+    }
+}
+
+// Meshes and clouds are hashed with the globals, but their bounds are still
+// needed to know which tiles can have primary hits on them
+static void add_surface(struct tile_object *object, struct aabb box, struct scene *scene,
+                        struct pixmap image)
+{
+    if (box.min.x > box.max.x) {
+        *object = (struct tile_object){0};
+    } else {
+        add_object(object, 0, volume_from_aabb(box), scene, image);
+    }
+}
+
+void prepare_tile_keys(struct tile_keys *keys, struct scene *scene, struct pixmap image,
+                       bool skip_shadows)
+{
+    keys->scene_hash = hash_globals(scene, image, skip_shadows);
+    keys->skip_shadows = skip_shadows;
+    keys->num_objects = scene->num_spheres + scene->num_instances;
+    keys->objects = malloc(sizeof(struct tile_object) * (keys->num_objects + 1));
+
+    struct object_key *objects = object_keys(scene);
+    for (u32 n = 0; n < keys->num_objects; n++) {
+        add_object(&keys->objects[n], objects[n].hash, objects[n].bounds, scene, image);
+    }
+    free(objects);
+
+    keys->num_surfaces = scene->num_meshes + scene->num_clouds;
+    keys->surfaces = malloc(sizeof(struct tile_object) * (keys->num_surfaces + 1));
+    for (u32 i = 0; i < scene->num_meshes; i++) {
+        struct mesh *mesh = &scene->meshes[i];
+        add_surface(&keys->surfaces[i], aabb_translate(mesh->bounds, mesh->translation),
+                    scene, image);
+    }
+    for (u32 i = 0; i < scene->num_clouds; i++) {
+        add_surface(&keys->surfaces[scene->num_meshes + i], scene->clouds[i].bounds, scene,
+                    image);
+    }
+
+    // Plane normals aren't normalized, and are what shadow rays are offset by
+    keys->shadow_offset = SHADOW_OFFSET;
+    for (u32 i = 0; i < scene->num_planes; i++) {
+        keys->shadow_offset = fmax(keys->shadow_offset,
+                                   SHADOW_OFFSET * v3_magnitude(scene->planes[i].norm));
+    }
+}
+
+void free_tile_keys(struct tile_keys *keys)
+{
+    free(keys->objects);
+    free(keys->surfaces);
+    keys->objects = NULL;
+    keys->surfaces = NULL;
+}
+
+static inline bool rects_overlap(struct tile_rect a, struct tile_rect b)
+{
+    return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+/*
+ * Primary rays pass through the pixel centers, so every one of them is a
+ * positive combination of the rays through the tile's corner pixels, and
+ * its hit with the plane is a convex combination of theirs. The region is
+ * the polygon between the corner hits, extended to infinity between two
+ * corners whose rays run towards and away from the plane. False when the
+ * plane passes through the camera, which leaves the region unbounded in
+ * every direction within it.
+ */
+static bool plane_region(struct plane *plane, struct camera camera, struct pixmap image,
+                         struct tile_rect rect, struct plane_region *region)
+{
+    int rows[4] = {rect.y0, rect.y0, rect.y1 - 1, rect.y1 - 1};
+    int columns[4] = {rect.x0, rect.x1 - 1, rect.x1 - 1, rect.x0};
+    v3 rays[4];
+    double slopes[4];
+    double height = v3_dot(plane->pos, plane->norm);
+    if (height == 0) {
+        return false;
+    }
+
+    region->num_corners = 0;
+    region->num_directions = 0;
+    region->covers_tile = true;
+    for (int k = 0; k < 4; k++) {
+        rays[k] = primary_ray(camera, image, rows[k], columns[k]);
+        slopes[k] = v3_dot(rays[k], plane->norm);
+        if (slopes[k] * height > 0) {
+            v3_scale(&region->corners[region->num_corners++], rays[k], height / slopes[k]);
+        }
+        // Same test as plane_intersection_check()
+        region->covers_tile &= slopes[k] * height > 0 && slopes[k] < -0.00001;
+    }
+    if (!region->num_corners) {
+        return true;
+    }
+
+    for (int k = 0; k < 4; k++) {
+        int next = (k + 1) % 4;
+        v3 direction = rays[k];
+        if (slopes[k] != 0) {
+            if (slopes[next] == 0 || (slopes[k] > 0) == (slopes[next] > 0)) {
+                continue;
+            }
+            v3 towards;
+            v3_scale(&direction, rays[k], fabs(slopes[next]));
+            v3_scale(&towards, rays[next], fabs(slopes[k]));
+            v3_add(&direction, direction, towards);
+        }
+        v3_normalize(&region->directions[region->num_directions++], direction);
+    }
+    return true;
+}
+
+// False when the receiver contains the light, so its rays can go anywhere
+static bool volume_cone(v3 light, struct volume receiver, struct shadow_cone *cone)
+{
+    double radius = padded(receiver.radius);
+    v3_sub(&cone->axis, receiver.center, light);
+    double distance = v3_magnitude(cone->axis);
+    if (distance <= radius) {
+        return false;
+    }
+    v3_scale(&cone->axis, cone->axis, 1 / distance);
+    cone->light = light;
+    cone->spread = asin(radius / distance);
+    return true;
+}
+
+/*
+ * Seen from the light, a convex region covers the directions towards its
+ * corners and the ones it runs off to infinity in, and everything between
+ * them. A cone around their mean holds all of them as long as they fit in
+ * a half space. False otherwise.
+ */
+static bool region_cone(v3 light, struct plane_region *region, struct shadow_cone *cone)
+{
+    v3 directions[8];
+    double radii[8];
+    u32 count = 0;
+    for (u32 k = 0; k < region->num_corners; k++) {
+        v3_sub(&directions[count], region->corners[k], light);
+        double distance = v3_magnitude(directions[count]);
+        if (distance <= padded(0)) {
+            return false;
+        }
+        v3_scale(&directions[count], directions[count], 1 / distance);
+        radii[count++] = asin(padded(0) / distance);
+    }
+    for (u32 k = 0; k < region->num_directions; k++) {
+        directions[count] = region->directions[k];
+        radii[count++] = 0;
+    }
+
+    v3 sum = {0};
+    for (u32 k = 0; k < count; k++) {
+        v3_add(&sum, sum, directions[k]);
+    }
+    double length = v3_magnitude(sum);
+    if (length < 1e-9) {
+        return false;
+    }
+    v3_scale(&cone->axis, sum, 1 / length);
+    cone->light = light;
+    cone->spread = 0;
+    for (u32 k = 0; k < count; k++) {
+        double cosine = v3_dot(cone->axis, directions[k]);
+        double angle = acos(cosine < 1 ? cosine : 1) + radii[k];
+        cone->spread = fmax(cone->spread, angle);
+    }
+    return cone->spread < PI / 2;
+}
+
+/*
+ * Whether a line in the cone can pass through the object. A shadow ray
+ * runs parallel to the line from its hit to the light, offset from it by
+ * the hit's normal, so the object is grown by that offset.
+ */
+static bool in_shadow_cone(struct shadow_cone *cone, struct volume object, double offset)
+{
+    v3 to_object;
+    v3_sub(&to_object, object.center, cone->light);
+    double distance = v3_magnitude(to_object);
+    double radius = padded(object.radius + offset);
+    if (distance <= radius) {
+        return true;
+    }
+
+    double spread = cone->spread + asin(radius / distance);
+    if (spread >= PI / 2) {
+        return true;
+    }
+    double cosine = fabs(v3_dot(cone->axis, to_object)) / distance;
+    return acos(cosine < 1 ? cosine : 1) <= spread;
+}
+
+/*
+ * Primary hits can only lie on the objects whose bounds project into the
+ * tile, on the part of a plane inside the tile's frustum, or at the origin
+ * for misses, and shadow rays leave from those hits. The objects either
+ * can reach cover everything the pixels depend on, and are found from
+ * bounds and projections alone, no rays are traced.
+ */
+u64 tile_key(struct tile_keys *keys, struct scene *scene, struct pixmap image,
+             struct tile_rect rect)
+{
+    u32 max_cones = scene->num_lights * (scene->num_planes + 2);
+    struct shadow_cone *cones = malloc(sizeof(struct shadow_cone) * (max_cones + 1));
+    struct plane_region *regions = malloc(sizeof(struct plane_region) * (scene->num_planes + 1));
+    u32 num_cones = 0;
+    // Set when some shadow ray of the tile can go in any direction
+    bool everywhere = false;
+
+    if (!keys->skip_shadows) {
+        // Objects that can be hit are merged into one receiver
+        struct aabb hits = aabb_empty();
+        bool any_hit = false;
+        for (u32 n = 0; n < keys->num_objects + keys->num_surfaces; n++) {
+            struct tile_object *object = n < keys->num_objects ?
+                &keys->objects[n] : &keys->surfaces[n - keys->num_objects];
+            if (rects_overlap(object->pixels, rect)) {
+                v3 extent = {object->bounds.radius, object->bounds.radius, object->bounds.radius};
+                struct aabb box;
+                v3_sub(&box.min, object->bounds.center, extent);
+                v3_add(&box.max, object->bounds.center, extent);
+                aabb_grow(&hits, box);
+                any_hit = true;
+            }
+        }
+
+        // Misses still shade, with shadow rays leaving the origin
+        bool any_miss = true;
+        for (u32 i = 0; i < scene->num_planes; i++) {
+            everywhere |= !plane_region(&scene->planes[i], scene->cameras[0], image, rect,
+                                        &regions[i]);
+            any_miss &= everywhere || !regions[i].covers_tile;
+        }
+
+        for (u32 l = 0; l < scene->num_lights && !everywhere; l++) {
+            v3 light = scene->lights[l].pos;
+            if (any_hit) {
+                everywhere |= !volume_cone(light, volume_from_aabb(hits), &cones[num_cones++]);
+            }
+            if (any_miss) {
+                struct volume origin = {{0, 0, 0}, 0};
+                everywhere |= !volume_cone(light, origin, &cones[num_cones++]);
+            }
+            for (u32 i = 0; i < scene->num_planes && !everywhere; i++) {
+                if (regions[i].num_corners) {
+                    everywhere |= !region_cone(light, &regions[i], &cones[num_cones++]);
+                }
+            }
+        }
+    }
+
+    u64 key = hash_bytes(keys->scene_hash, &rect, sizeof(rect));
+    for (u32 n = 0; n < keys->num_objects; n++) {
+        struct tile_object *object = &keys->objects[n];
+        bool relevant = everywhere || rects_overlap(object->pixels, rect);
+        for (u32 c = 0; !relevant && c < num_cones; c++) {
+            relevant = in_shadow_cone(&cones[c], object->bounds, keys->shadow_offset);
+        }
+        if (relevant) {
+            key = hash_bytes(key, &object->hash, sizeof(object->hash));
+        }
+    }
+    free(cones);
+    free(regions);
+    return key;
+}
+
+/* ---- Files ---- */
+
+// Leaves room in PATH_MAX for the longest name the cache creates, a tile
+// name plus the suffix of its temporary file
+#define TILE_NAME_ROOM 64
+
+bool tile_cache_open(struct tile_cache *cache, const char *dir, u64 max_bytes)
+{
+    if (strlen(dir) + TILE_NAME_ROOM >= sizeof(cache->dir)) {
+        return false;
+    } else if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info;
+    if (stat(dir, &info) < 0 || !S_ISDIR(info.st_mode)) {
+        return false;
+    }
+    strcpy(cache->dir, dir);
+    cache->max_bytes = max_bytes;
+    return true;
+}
+
+// Paths are never cut short, a cut one would name the wrong file. Every
+// function building one treats a path that doesn't fit as a miss, or
+// skips the file, even though tile_cache_open() leaves enough room.
+static bool join_path(struct tile_cache *cache, const char *name, char *path)
+{
+    int length = snprintf(path, PATH_MAX, "%s/%s", cache->dir, name);
+    return length >= 0 && length < PATH_MAX;
+}
+
+static bool tile_path(struct tile_cache *cache, u64 key, char *path)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tile", (unsigned long long)key);
+    return join_path(cache, name, path);
+}
+
+bool tile_cache_load(struct tile_cache *cache, u64 key, float *pixels, u32 width, u32 height,
+                     u32 stride)
+{
+    char path[PATH_MAX];
+    FILE *file = tile_path(cache, key, path) ? fopen(path, "rb") : NULL;
+    if (!file) {
+        return false;
+    }
+
+    struct tile_file_header header;
+    bool hit = fread(&header, sizeof(header), 1, file) == 1 &&
+               header.magic == TILE_CACHE_MAGIC && header.version == TILE_CACHE_VERSION &&
+               header.key == key && header.width == width && header.height == height;
+    for (u32 row = 0; hit && row < height; row++) {
+        hit = fread(&pixels[3 * row * stride], sizeof(float) * 3, width, file) == width;
+    }
+    // Marks the tile as recently used for tile_cache_trim()
+    if (hit) {
+        futimens(fileno(file), NULL);
+    }
+    fclose(file);
+    return hit;
+}
+
+// Written under a temporary name and renamed into place, so concurrent
+// renders sharing the cache never see a partial tile
+void tile_cache_store(struct tile_cache *cache, u64 key, const float *pixels, u32 width,
+                      u32 height, u32 stride)
+{
+    char path[PATH_MAX];
+    char temporary[PATH_MAX];
+    if (!tile_path(cache, key, path)) {
+        return;
+    }
+    int length = snprintf(temporary, PATH_MAX, "%s.%d.%ld", path, getpid(),
+                          syscall(SYS_gettid));
+    FILE *file = length >= 0 && length < PATH_MAX ? fopen(temporary, "wb") : NULL;
+    if (!file) {
+        return;
+    }
+
+    struct tile_file_header header = {TILE_CACHE_MAGIC, TILE_CACHE_VERSION, key, width, height};
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (u32 row = 0; written && row < height; row++) {
+        written = fwrite(&pixels[3 * row * stride], sizeof(float) * 3, width, file) == width;
+    }
+    if (fclose(file) == 0 && written) {
+        rename(temporary, path);
+    } else {
+        unlink(temporary);
+    }
+}
+
+struct cache_entry {
+    char name[32];
+    struct timespec used;
+    u64 size;
+};
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct timespec *ta = &((struct cache_entry *)a)->used;
+    const struct timespec *tb = &((struct cache_entry *)b)->used;
+    if (ta->tv_sec != tb->tv_sec) {
+        return ta->tv_sec < tb->tv_sec ? -1 : 1;
+    }
+    return ta->tv_nsec < tb->tv_nsec ? -1 : ta->tv_nsec > tb->tv_nsec;
+}
+
+void tile_cache_trim(struct tile_cache *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    if (!dir) {
+        return;
+    }
+
+    struct cache_entry *entries = NULL;
+    u32 count = 0;
+    u32 capacity = 0;
+    u64 total = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        size_t length = strlen(dirent->d_name);
+        char path[PATH_MAX];
+        struct stat info;
+        if (length < 5 || length >= sizeof(entries->name) ||
+            strcmp(dirent->d_name + length - 5, ".tile") != 0) {
+            continue;
+        }
+        if (!join_path(cache, dirent->d_name, path) || stat(path, &info) < 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            entries = realloc(entries, sizeof(struct cache_entry) * capacity);
+        }
+        strcpy(entries[count].name, dirent->d_name);
+        entries[count].used = info.st_mtim;
+        entries[count].size = info.st_size;
+        total += info.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cache->max_bytes) {
+        qsort(entries, count, sizeof(struct cache_entry), compare_entries);
+        for (u32 i = 0; i < count && total > cache->max_bytes; i++) {
+            char path[PATH_MAX];
+            if (join_path(cache, entries[i].name, path) && unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+}
@@ -0,0 +1,94 @@
+#include "tonemap.h"
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static float srgb_encode(float value)
+{
+    if (value <= 0.0031308f) {
+        return 12.92f * value;
+    }
+    return 1.055f * powf(value, 1 / 2.4f) - 0.055f;
+}
+
+static void build_curve_lut(u8 *lut, struct tonemap_options options)
+{
+    for (int i = 0; i < CURVE_LUT_SIZE; i++) {
+        float value = (float)i / (CURVE_LUT_SIZE - 1);
+        if (options.curve == TRANSFER_SRGB) {
+            value = srgb_encode(value);
+        } else {
+            value = powf(value, 1 / options.gamma);
+        }
+        lut[i] = 255 * value + 0.5f;
+    }
+}
+
+void tonemap_prepare(struct tonemap_curve *curve, struct tonemap_options options)
+{
+    curve->scale = exp2f(options.exposure);
+    curve->linear = options.curve == TRANSFER_LINEAR;
+    if (!curve->linear) {
+        build_curve_lut(curve->lut, options);
+    }
+}
+
+/*
+ * The linear curve matches the historical 255 * clamp01(c) conversion,
+ * truncating towards zero. The other curves quantize the clamped value to
+ * a lookup table index first, which keeps the pass free of pow() calls.
+ */
+void tonemap(float *hdr, pixel *pixels, u32 num_pixels, const struct tonemap_curve *curve)
+{
+    u8 *out = (u8 *)pixels;
+    u32 count = num_pixels * 3;
+    u32 i = 0;
+
+    float scale = curve->scale;
+    bool linear = curve->linear;
+    float range = linear ? 255 : CURVE_LUT_SIZE - 1;
+    const u8 *lut = curve->lut;
+
+#ifdef __SSE2__
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128 vrange = _mm_set1_ps(range);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1);
+
+    // 16 channels per iteration, so one full 16 byte store of packed u8
+    for (; i + 16 <= count; i += 16) {
+        __m128i q[4];
+        for (int k = 0; k < 4; k++) {
+            __m128 v = _mm_loadu_ps(&hdr[i + k * 4]);
+            v = _mm_mul_ps(v, vscale);
+            v = _mm_min_ps(_mm_max_ps(v, zero), one);
+            q[k] = _mm_cvttps_epi32(_mm_mul_ps(v, vrange));
+        }
+
+        if (linear) {
+            __m128i lo = _mm_packs_epi32(q[0], q[1]);
+            __m128i hi = _mm_packs_epi32(q[2], q[3]);
+            _mm_storeu_si128((__m128i *)&out[i], _mm_packus_epi16(lo, hi));
+        } else {
+            s32 index[16];
+            for (int k = 0; k < 4; k++) {
+                _mm_storeu_si128((__m128i *)&index[k * 4], q[k]);
+            }
+            for (int k = 0; k < 16; k++) {
+                out[i + k] = lut[index[k]];
+            }
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        float v = hdr[i] * scale;
+        // Written so that NaN ends up as zero, like the SIMD path
+        v = v > 0 ? (v < 1 ? v : 1) : 0;
+        s32 q = v * range;
+        out[i] = linear ? q : lut[q];
+    }
+}
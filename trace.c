@@ -0,0 +1,133 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct trace_span {
+    const char *name;
+    const char *arg_name;
+    u64 start;
+    u64 duration;
+    u32 arg;
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    u32 tid;
+    // Spans ever recorded, only written by the owning thread
+    u64 count;
+    struct trace_span spans[TRACE_BUFFER_SPANS];
+};
+
+bool trace_enabled;
+static u64 epoch;
+// Every thread's buffer, pushed once and never removed
+static struct trace_buffer *buffers;
+static __thread struct trace_buffer *local_buffer;
+
+static u64 monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_start(void)
+{
+    epoch = monotonic_ns() - 1;
+    trace_enabled = true;
+}
+
+u64 trace_now(void)
+{
+    return monotonic_ns() - epoch;
+}
+
+static struct trace_buffer *thread_buffer(void)
+{
+    if (!local_buffer) {
+        struct trace_buffer *buffer = calloc(1, sizeof(struct trace_buffer));
+        buffer->tid = syscall(SYS_gettid);
+        buffer->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &buffer->next, buffer, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        local_buffer = buffer;
+    }
+    return local_buffer;
+}
+
+void trace_record(const char *name, const char *arg_name, u32 arg, u64 start)
+{
+    u64 end = trace_now();
+    struct trace_buffer *buffer = thread_buffer();
+    u64 count = buffer->count;
+    struct trace_span *span = &buffer->spans[count % TRACE_BUFFER_SPANS];
+    span->name = name;
+    span->arg_name = arg_name;
+    span->start = start;
+    span->duration = end - start;
+    span->arg = arg;
+    // Publishes the span to a concurrent trace_write()
+    __atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies out a buffer's spans, oldest first. Its thread may keep recording
+ * meanwhile, so the count is checked again afterwards and the spans it
+ * overwrote during the copy (or was writing) are dropped. Returns the
+ * number of spans kept at the end of the copy.
+ */
+static u64 snapshot_buffer(struct trace_buffer *buffer, struct trace_span *spans, u64 *first)
+{
+    u64 end = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+    u64 begin = end > TRACE_BUFFER_SPANS ? end - TRACE_BUFFER_SPANS : 0;
+    for (u64 i = begin; i < end; i++) {
+        spans[i - begin] = buffer->spans[i % TRACE_BUFFER_SPANS];
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    u64 now = __atomic_load_n(&buffer->count, __ATOMIC_RELAXED);
+    u64 valid = now >= TRACE_BUFFER_SPANS ? now - TRACE_BUFFER_SPANS + 1 : 0;
+    *first = valid > begin ? valid - begin : 0;
+    return *first < end - begin ? end - begin - *first : 0;
+}
+
+bool trace_write(const char *path)
+{
+    FILE *output = fopen(path, "w");
+    if (!output) {
+        return false;
+    }
+
+    int pid = getpid();
+    struct trace_span *spans = malloc(sizeof(struct trace_span) * TRACE_BUFFER_SPANS);
+    fprintf(output, "{\"traceEvents\":[\n");
+    fprintf(output, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"raycast\"}}", pid);
+
+    struct trace_buffer *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for (; buffer; buffer = buffer->next) {
+        u64 first;
+        u64 count = snapshot_buffer(buffer, spans, &first);
+        for (u64 i = first; i < first + count; i++) {
+            struct trace_span *span = &spans[i];
+            // Timestamps are in microseconds
+            fprintf(output, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%u", span->name, span->start * 1e-3,
+                    span->duration * 1e-3, pid, buffer->tid);
+            if (span->arg != TRACE_NO_ARG) {
+                fprintf(output, ",\"args\":{\"%s\":%u}", span->arg_name, span->arg);
+            }
+            fprintf(output, "}");
+        }
+    }
+    fprintf(output, "\n]}\n");
+    free(spans);
+
+    bool written = !ferror(output);
+    return fclose(output) == 0 && written;
+}
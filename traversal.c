@@ -0,0 +1,115 @@
+#include "traversal.h"
+
+#include <stdlib.h>
+
+// Every other bit of a Morton code, packed together
+static inline u32 compact_bits(u32 x)
+{
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+// Position d along a Hilbert curve filling a side x side square, side
+// being a power of two
+static void hilbert_point(u32 side, u32 d, u32 *x, u32 *y)
+{
+    u32 rx, ry, t = d;
+    *x = 0;
+    *y = 0;
+    for (u32 s = 1; s < side; s *= 2) {
+        rx = 1 & (t / 2);
+        ry = 1 & (t ^ rx);
+        // Rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            u32 swap = *x;
+            *x = *y;
+            *y = swap;
+        }
+        *x += s * rx;
+        *y += s * ry;
+        t /= 4;
+    }
+}
+
+/*
+ * Calls visit() for the points of a width x height grid in the given order.
+ * Curves are walked over the enclosing power of two square and points
+ * outside the grid are skipped.
+ */
+static u32 walk_grid(enum traversal_order order, u32 width, u32 height,
+                     void (*visit)(void *data, u32 n, u32 x, u32 y), void *data)
+{
+    u32 side = 1;
+    u32 n = 0;
+    while (side < width || side < height) {
+        side *= 2;
+    }
+
+    if (order == ORDER_SCANLINE) {
+        for (u32 y = 0; y < height; y++) {
+            for (u32 x = 0; x < width; x++) {
+                visit(data, n++, x, y);
+            }
+        }
+        return n;
+    }
+
+    for (u32 d = 0; d < side * side; d++) {
+        u32 x, y;
+        if (order == ORDER_MORTON) {
+            x = compact_bits(d);
+            y = compact_bits(d >> 1);
+        } else {
+            hilbert_point(side, d, &x, &y);
+        }
+        if (x < width && y < height) {
+            visit(data, n++, x, y);
+        }
+    }
+    return n;
+}
+
+struct tile_walk {
+    u32 *tiles;
+    u32 across;
+};
+
+static void visit_tile(void *data, u32 n, u32 x, u32 y)
+{
+    struct tile_walk *walk = data;
+    walk->tiles[n] = y * walk->across + x;
+}
+
+static void visit_pixel(void *data, u32 n, u32 x, u32 y)
+{
+    struct traversal *traversal = data;
+    traversal->pixel_x[n] = x;
+    traversal->pixel_y[n] = y;
+}
+
+void init_traversal(struct traversal *traversal, struct pixmap image, enum traversal_order order)
+{
+    struct tile_walk walk;
+    walk.across = tiles_across(image);
+    walk.tiles = malloc(sizeof(u32) * num_tiles(image));
+
+    traversal->tiles = walk.tiles;
+    // Not num_tiles() / walk.across, which divides by zero for empty images
+    u32 down = (image.height + TILE_SIZE - 1) / TILE_SIZE;
+    traversal->num_tiles = walk_grid(order, walk.across, down, visit_tile, &walk);
+    walk_grid(order, TILE_SIZE, TILE_SIZE, visit_pixel, traversal);
+}
+
+void free_traversal(struct traversal *traversal)
+{
+    free(traversal->tiles);
+    traversal->tiles = NULL;
+}